@@ -0,0 +1,165 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "math.h"
+#include "camera.h"
+#include "scene.h"
+
+// Radiance sums are kept in 32.32 fixed point. Integer addition is associative, so buffers
+// rendered over disjoint sample ranges merge to exactly the sums of a single render.
+
+#define ACCUM_ONE 4294967296.0
+#define ACCUM_MAGIC "RTACCUM2"
+
+typedef struct accum_pixel {
+    uint64_t r, g, b;
+    uint32_t samples;
+    uint32_t padding;
+} accum_pixel;
+
+typedef struct accum_buffer {
+    accum_pixel* pixels;
+    int width;
+    int height;
+} accum_buffer;
+
+typedef struct accum_header {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    // Sample index range rendered into the buffer, end is exclusive.
+    uint32_t sample_begin;
+    uint32_t sample_end;
+    // Everything else that decides the image, parts only merge when all of it matches.
+    int32_t max_depth;
+    float aspect_ratio;
+    camera_params view;
+    scene_descriptor scene;
+} accum_header;
+
+bool same_accum_render(const accum_header* a, const accum_header* b) {
+    return a->width == b->width && a->height == b->height && a->max_depth == b->max_depth &&
+        a->aspect_ratio == b->aspect_ratio && memcmp(&a->view, &b->view, sizeof(a->view)) == 0 &&
+        same_scene_descriptor(&a->scene, &b->scene);
+}
+
+uint64_t accum_quantize(float value) {
+    // Radiance never exceeds 1 here, the clamp only guards against NaNs and overflow.
+    if (!(value > 0.f)) return 0;
+    if (value > 65536.f) value = 65536.f;
+    return (uint64_t)((double) value * ACCUM_ONE + 0.5);
+}
+
+void accum_add_radiance(accum_pixel* pixel, color radiance) {
+    // Without counting a sample, for paths whose contribution arrives separately.
+    pixel->r += accum_quantize(radiance.R);
+    pixel->g += accum_quantize(radiance.G);
+    pixel->b += accum_quantize(radiance.B);
+}
+
+void accum_add(accum_pixel* pixel, color sample) {
+    accum_add_radiance(pixel, sample);
+    ++pixel->samples;
+}
+
+void accum_merge(accum_pixel* pixel, const accum_pixel* other) {
+    pixel->r += other->r;
+    pixel->g += other->g;
+    pixel->b += other->b;
+    pixel->samples += other->samples;
+}
+
+color accum_resolve(const accum_pixel* pixel) {
+    if (pixel->samples == 0) {
+        return HMM_Vec3(0.f, 0.f, 0.f);
+    }
+
+    const double scale = 1.0 / (ACCUM_ONE * pixel->samples);
+    return HMM_Vec3((float)(pixel->r * scale), (float)(pixel->g * scale), (float)(pixel->b * scale));
+}
+
+// Resolves count pixels into out, each like accum_resolve().
+typedef void (*resolve_accum_fn)(const accum_pixel* pixels, color* out, size_t count);
+
+void resolve_accum_pixels_scalar(const accum_pixel* pixels, color* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = accum_resolve(pixels + i);
+    }
+}
+
+#ifdef CPU_X86
+CPU_TARGET_AVX512 void resolve_accum_pixels_avx512(const accum_pixel* pixels, color* out, size_t count) {
+    // Two pixels a step. AVX-512DQ converts their unsigned 64-bit sums to double directly, the
+    // samples lanes are converted along with them but never stored.
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const double scale0 = pixels[i].samples ? 1.0 / (ACCUM_ONE * pixels[i].samples) : 0.0;
+        const double scale1 = pixels[i + 1].samples ? 1.0 / (ACCUM_ONE * pixels[i + 1].samples) : 0.0;
+        const __m512d sums = _mm512_cvtepu64_pd(_mm512_loadu_si512(pixels + i));
+        const __m512d scales = _mm512_set_pd(scale1, scale1, scale1, scale1, scale0, scale0, scale0, scale0);
+
+        float resolved[8];
+        _mm256_storeu_ps(resolved, _mm512_cvtpd_ps(_mm512_mul_pd(sums, scales)));
+        out[i] = HMM_Vec3(resolved[0], resolved[1], resolved[2]);
+        out[i + 1] = HMM_Vec3(resolved[4], resolved[5], resolved[6]);
+    }
+    resolve_accum_pixels_scalar(pixels + i, out + i, count - i);
+}
+#endif
+
+resolve_accum_fn resolve_accum_pixels = resolve_accum_pixels_scalar;
+
+cpu_isa select_resolve_kernel(cpu_isa isa) {
+#ifdef CPU_X86
+    if (isa >= CPU_ISA_AVX512) {
+        resolve_accum_pixels = resolve_accum_pixels_avx512;
+        return CPU_ISA_AVX512;
+    }
+#endif
+    resolve_accum_pixels = resolve_accum_pixels_scalar;
+    return CPU_ISA_SCALAR;
+}
+
+accum_buffer create_accum_buffer(const int width, const int height) {
+    return (accum_buffer) {
+        .pixels = calloc((size_t) width * height, sizeof(accum_pixel)),
+        .width = width,
+        .height = height
+    };
+}
+
+void destroy_accum_buffer(accum_buffer* buffer) {
+    free(buffer->pixels);
+    *buffer = (accum_buffer) { 0 };
+}
+
+accum_pixel* accum_at(const accum_buffer* buffer, const int x, const int y) {
+    return buffer->pixels + (size_t) y * buffer->width + x;
+}
+
+bool write_accum_buffer(FILE* stream, const accum_buffer* buffer, const accum_header* header) {
+    return fwrite(header, sizeof(*header), 1, stream) == 1 &&
+        fwrite(buffer->pixels, sizeof(accum_pixel), (size_t) buffer->width * buffer->height, stream) ==
+            (size_t) buffer->width * buffer->height;
+}
+
+bool read_accum_buffer(FILE* stream, accum_buffer* buffer, accum_header* header) {
+    if (fread(header, sizeof(*header), 1, stream) != 1 || memcmp(header->magic, ACCUM_MAGIC, 8) != 0 ||
+        header->width < 1 || header->height < 1) {
+        return false;
+    }
+
+    *buffer = create_accum_buffer(header->width, header->height);
+    if (fread(buffer->pixels, sizeof(accum_pixel), (size_t) buffer->width * buffer->height, stream) !=
+        (size_t) buffer->width * buffer->height) {
+        destroy_accum_buffer(buffer);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "framebuffer.h"
+#include "scene.h"
+#include "bvh.h"
+#include "render.h"
+#include "hdr.h"
+#include "perf.h"
+
+// Renders a sequence of frames in which an animator moves the spheres. Instead of building
+// the hierarchy again every frame its bounds are refit in parallel, which keeps the topology
+// and lets the tree degrade as spheres drift apart. Once the nodes' surface area has grown
+// past threshold times their area at the last build the tree is rebuilt. The wide and
+// compressed layouts are collapsed from it again every frame, only the grid is rebuilt.
+
+#define ANIMATION_FRAME_RATE 24.f
+
+// Moves spheres for the given frame, rest holds every sphere as it was before the first frame.
+typedef void (*scene_animator)(scene* world, const sphere* rest, unsigned int frame, float time);
+
+bool write_animation_frame(const char* pattern, unsigned int frame, const framebuffer* fb, const tonemap_options* tonemap) {
+    char path[4096];
+    snprintf(path, sizeof(path), pattern, frame);
+
+    hdr_format format;
+    if (parse_hdr_format(path, &format)) {
+        return write_hdr_file(path, fb);
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return false;
+    }
+
+    write_framebuffer(file, fb, tonemap);
+    return fclose(file) == 0;
+}
+
+bool render_animation(const render_options* options, scene* world, scene_animator animate, unsigned int frames,
+    const char* pattern, float rebuild_threshold) {
+    const unsigned int capacity = HMM_MAX(world->spheres_length, 1u);
+    sphere* rest = malloc(sizeof(sphere) * capacity);
+    memcpy(rest, world->spheres, sizeof(sphere) * world->spheres_length);
+    framebuffer fb = create_framebuffer(options->image_width, options->image_height);
+
+    unsigned int rebuilds = 0;
+    double refit_total = 0.0, rebuild_total = 0.0, render_total = 0.0;
+    bool written = true;
+
+    fprintf(stderr, "%-6s %10s %10s %10s %9s %10s\n", "frame", "update ms", "refit ms", "rebuild ms", "inflation", "render s");
+
+    for (unsigned int frame = 0; frame < frames && written; ++frame) {
+        double start = now_seconds();
+        animate(world, rest, frame, frame / ANIMATION_FRAME_RATE);
+        const double update = now_seconds() - start;
+
+        start = now_seconds();
+        aabb* bounds = create_sphere_bounds(world->spheres, world->spheres_length);
+        refit_bvh(&world->accel, bounds, options->threads);
+        free(bounds);
+        const float inflation = bvh_inflation(&world->accel);
+        double refit = now_seconds() - start;
+
+        double rebuild = 0.0;
+        const bool rebuilt = inflation > rebuild_threshold;
+        if (rebuilt) {
+            start = now_seconds();
+            build_scene_bvh(world);
+            rebuild = now_seconds() - start;
+            ++rebuilds;
+        }
+
+        start = now_seconds();
+        refresh_scene_accel(world);
+        if (world->accel_kind == SCENE_ACCEL_GRID) {
+            rebuild += now_seconds() - start;
+        }
+        else {
+            refit += now_seconds() - start;
+        }
+
+        start = now_seconds();
+        render(options, world, &fb, false);
+        const double render_seconds = now_seconds() - start;
+
+        written = write_animation_frame(pattern, frame, &fb, &options->tonemap);
+
+        fprintf(stderr, "%-6u %10.3f %10.3f %10.3f %9.3f %10.3f%s\n", frame, update * 1e3, refit * 1e3, rebuild * 1e3,
+            inflation, render_seconds, rebuilt ? "  rebuilt" : "");
+        refit_total += refit;
+        rebuild_total += rebuild;
+        render_total += render_seconds;
+    }
+
+    fprintf(stderr, "%u frames, %u rebuilds, refit %.3fs, rebuild %.3fs, render %.3fs\n", frames, rebuilds,
+        refit_total, rebuild_total, render_total);
+
+    destroy_framebuffer(&fb);
+    free(rest);
+    return written;
+}
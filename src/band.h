@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "framebuffer.h"
+#include "scene.h"
+#include "render.h"
+#include "perf.h"
+
+// Band streaming for images too large to hold as one framebuffer. The image is rendered as
+// horizontal bands of whole tile rows, each band in parallel over the thread pool. While one
+// band renders the previous one is encoded and written, so two band buffers are all that's
+// ever allocated.
+
+typedef struct band_write {
+    FILE* stream;
+    const framebuffer* fb;
+    const tonemap_context* tonemap;
+    double seconds;
+} band_write;
+
+void* write_band_main(void* arg) {
+    band_write* write = arg;
+    const double start = now_seconds();
+    write_framebuffer_rows(write->stream, write->fb, 0, write->fb->height, write->tonemap);
+    write->seconds = now_seconds() - start;
+    return NULL;
+}
+
+int band_height(const render_options* options, int band_rows) {
+    // Rounded up to whole tile rows, so no tile straddles two bands.
+    const int tile_size = HMM_MIN(options->tile_size, MAX_TILE_SIZE);
+    return (band_rows + tile_size - 1) / tile_size * tile_size;
+}
+
+void render_bands(const render_options* options, const scene* world, FILE* stream, int band_rows, bool progress) {
+    const int width = options->image_width;
+    const int height = options->image_height;
+    const int rows = band_height(options, band_rows);
+    const int band_count = (height + rows - 1) / rows;
+
+    framebuffer bands[2] = { create_framebuffer(width, rows), create_framebuffer(width, rows) };
+    band_write writes[2] = { 0 };
+    pthread_t writer;
+    bool writing = false;
+    // Every band has the image's width, so all of them share one set of tables.
+    tonemap_context tonemap = create_tonemap_context(&options->tonemap, width);
+    double render_seconds = 0.0, write_seconds = 0.0;
+
+    write_ppm_header(stream, width, height);
+
+    for (int band = 0; band < band_count; ++band) {
+        framebuffer* fb = bands + (band & 1);
+        const int y0 = band * rows;
+        fb->height = HMM_MIN(rows, height - y0);
+
+        if (progress) {
+            fprintf(stderr, "\rBand %i of %i ", band + 1, band_count);
+        }
+
+        const double start = now_seconds();
+        render_region(options, world, fb, 0, y0, false);
+        render_seconds += now_seconds() - start;
+
+        // Bands must reach the stream in order, and the buffer is reused two bands later.
+        if (writing) {
+            pthread_join(writer, NULL);
+            write_seconds += writes[(band + 1) & 1].seconds;
+        }
+
+        writes[band & 1] = (band_write) { .stream = stream, .fb = fb, .tonemap = &tonemap };
+        pthread_create(&writer, NULL, write_band_main, writes + (band & 1));
+        writing = true;
+    }
+
+    if (writing) {
+        pthread_join(writer, NULL);
+        write_seconds += writes[(band_count - 1) & 1].seconds;
+    }
+
+    if (progress) {
+        const double band_bytes = 2.0 * sizeof(color) * width * rows;
+        fprintf(stderr, "\n%i bands of %i rows, %.1f MiB of band buffers instead of %.1f MiB, "
+            "render %.3fs, overlapped writing %.3fs\n", band_count, rows, band_bytes / (1024.0 * 1024.0),
+            (double) sizeof(color) * width * height / (1024.0 * 1024.0), render_seconds, write_seconds);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        destroy_framebuffer(bands + i);
+    }
+    destroy_tonemap_context(&tonemap);
+}
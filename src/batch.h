@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "camera.h"
+#include "framebuffer.h"
+#include "scene.h"
+#include "tile.h"
+#include "render.h"
+#include "hdr.h"
+#include "perf.h"
+
+// Renders many views of one scene in a single process. The tiles of all frames go into one
+// queue, frame after frame, so the thread pool moves on to the next frame's tiles while the
+// last tiles of the previous one finish instead of idling at a barrier. A frame is written
+// by whichever worker completes its last tile, overlapping with the other frames' tracing.
+//
+// Each line of the batch file is one frame:
+//   lookfrom lookat vfov aperture focus_dist output
+// e.g. "13,2,3 0,0,0 20 0.1 10 frame0.ppm". Outputs ending in .exr or .pfm get linear colors.
+
+#define BATCH_MAX_PATH 1024
+
+typedef struct batch_frame {
+    camera_params view;
+    char path[BATCH_MAX_PATH];
+    render_options options;
+    render_job job;
+    framebuffer fb;
+    atomic_uint remaining;
+    double finished_at;
+    bool written;
+} batch_frame;
+
+typedef struct batch {
+    batch_frame* frames;
+    unsigned int length;
+    const tile_set* frame_tiles;
+} batch;
+
+bool parse_batch_file(const char* path, hmm_v3 vup, batch* b) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open batch file %s\n", path);
+        return false;
+    }
+
+    unsigned int capacity = 0;
+    char line[2048];
+    int line_number = 0;
+    *b = (batch) { 0 };
+
+    while (fgets(line, sizeof(line), file)) {
+        ++line_number;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+        if (b->length == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            b->frames = realloc(b->frames, sizeof(batch_frame) * capacity);
+        }
+
+        batch_frame* frame = b->frames + b->length;
+        memset(frame, 0, sizeof(*frame));
+        camera_params* view = &frame->view;
+        view->vup = vup;
+
+        if (sscanf(line, "%f,%f,%f %f,%f,%f %f %f %f %1023s",
+                &view->position.X, &view->position.Y, &view->position.Z,
+                &view->lookat.X, &view->lookat.Y, &view->lookat.Z,
+                &view->vfov, &view->aperture, &view->focus_dist, frame->path) != 10) {
+            fprintf(stderr, "%s:%i: expected lookfrom lookat vfov aperture focus output\n", path, line_number);
+            fclose(file);
+            free(b->frames);
+            *b = (batch) { 0 };
+            return false;
+        }
+
+        ++b->length;
+    }
+
+    fclose(file);
+    return true;
+}
+
+bool write_batch_frame(const batch_frame* frame, const tonemap_options* tonemap) {
+    hdr_format format;
+    if (parse_hdr_format(frame->path, &format)) {
+        return write_hdr_file(frame->path, &frame->fb);
+    }
+
+    FILE* file = fopen(frame->path, "wb");
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", frame->path);
+        return false;
+    }
+
+    write_framebuffer(file, &frame->fb, tonemap);
+    return fclose(file) == 0;
+}
+
+void render_batch_tile(const tile* t, const tile_set* set, unsigned int worker, void* user) {
+    (void) set;
+    batch* b = user;
+    const unsigned int frame_length = b->frame_tiles->length;
+    batch_frame* frame = b->frames + t->index / frame_length;
+
+    render_tile(b->frame_tiles->tiles + t->index % frame_length, b->frame_tiles, worker, &frame->job);
+
+    if (atomic_fetch_sub(&frame->remaining, 1) == 1) {
+        // Last tile of the frame, every other tile's pixels are visible after the atomic.
+        frame->written = write_batch_frame(frame, &frame->options.tonemap);
+        frame->finished_at = now_seconds();
+        destroy_framebuffer(&frame->fb);
+    }
+}
+
+bool render_batch(const render_options* options, const scene* world, batch* b) {
+    tile_set frame_tiles = create_tile_set(options->image_width, options->image_height, options->tile_size,
+        options->order, options->pixel_order);
+    b->frame_tiles = &frame_tiles;
+
+    // One combined set, indices encode frame * tiles per frame + tile.
+    tile_set all = frame_tiles;
+    all.length = frame_tiles.length * b->length;
+    all.tiles = malloc(sizeof(tile) * all.length);
+
+    for (unsigned int f = 0; f < b->length; ++f) {
+        batch_frame* frame = b->frames + f;
+        frame->options = *options;
+        frame->options.view = frame->view;
+        frame->fb = create_framebuffer(options->image_width, options->image_height);
+        frame->job = (render_job) {
+            .options = &frame->options,
+            .cam = create_camera_from_params(&frame->view, options->aspect_ratio),
+            .fb = &frame->fb,
+            .tiles = &frame_tiles,
+            .worlds = { world },
+            .world_count = 1
+        };
+        atomic_init(&frame->remaining, frame_tiles.length);
+
+        for (unsigned int i = 0; i < frame_tiles.length; ++i) {
+            tile t = frame_tiles.tiles[i];
+            t.index = f * frame_tiles.length + i;
+            all.tiles[t.index] = t;
+        }
+    }
+
+    const tile_dispatch_config config = {
+        .threads = options->threads,
+        .progress = true
+    };
+
+    const double start = now_seconds();
+    dispatch_tiles(&all, &config, render_batch_tile, b);
+    const double elapsed = now_seconds() - start;
+
+    bool written = true;
+    fprintf(stderr, "\n%-6s %10s  %s\n", "frame", "done at", "output");
+    for (unsigned int f = 0; f < b->length; ++f) {
+        fprintf(stderr, "%-6u %9.3fs  %s%s\n", f, b->frames[f].finished_at - start, b->frames[f].path,
+            b->frames[f].written ? "" : "  (failed)");
+        written = written && b->frames[f].written;
+    }
+    fprintf(stderr, "%u frames in %.3fs, %.3f frames/s\n", b->length, elapsed, b->length / elapsed);
+
+    free(all.tiles);
+    destroy_tile_set(&frame_tiles);
+    b->frame_tiles = NULL;
+    return written;
+}
+
+void destroy_batch(batch* b) {
+    free(b->frames);
+    *b = (batch) { 0 };
+}
@@ -0,0 +1,441 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+
+// Binary bounding volume hierarchy over primitive bounding boxes, built with binned SAH. It
+// serves both the scene's spheres and the instances of the top level, see instance.h. Children
+// are allocated in pairs, right = left + 1, and always after their parent. When spheres move
+// the bounds can be refit bottom-up in place. How much the nodes have grown since the build
+// tells how far the tree has degraded.
+
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_BINS 12
+#define BVH_STACK_SIZE 64
+#define BVH_TRAVERSAL_COST 1.f
+#define BVH_INTERSECTION_COST 1.f
+
+typedef struct aabb {
+    hmm_v3 min;
+    hmm_v3 max;
+} aabb;
+
+typedef struct bvh_node {
+    aabb bounds;
+    unsigned int first;     // left child for inner nodes, first entry of indices for leaves
+    unsigned int count;     // spheres in a leaf, 0 for inner nodes
+} bvh_node;
+
+// Intersects primitive index of primitives, hit->t is the closest hit so far. A closer hit
+// lowers it and records the primitive, nothing changes otherwise.
+typedef bool (*bvh_intersect_fn)(const void* primitives, unsigned int index, const ray* r, float t_min, ray_hit* hit);
+
+typedef struct bvh {
+    bvh_node* nodes;
+    unsigned int node_count;
+    // Primitive indices, every leaf covers a contiguous range.
+    unsigned int* indices;
+    unsigned int length;
+    // Surface area of every node when the tree was built.
+    float* build_areas;
+} bvh;
+
+aabb empty_aabb() {
+    return (aabb) {
+        .min = HMM_Vec3(INFINITY, INFINITY, INFINITY),
+        .max = HMM_Vec3(-INFINITY, -INFINITY, -INFINITY)
+    };
+}
+
+aabb aabb_union(aabb a, aabb b) {
+    return (aabb) {
+        .min = HMM_Vec3(fminf(a.min.X, b.min.X), fminf(a.min.Y, b.min.Y), fminf(a.min.Z, b.min.Z)),
+        .max = HMM_Vec3(fmaxf(a.max.X, b.max.X), fmaxf(a.max.Y, b.max.Y), fmaxf(a.max.Z, b.max.Z))
+    };
+}
+
+aabb aabb_extend(aabb a, hmm_v3 p) {
+    return aabb_union(a, (aabb) { .min = p, .max = p });
+}
+
+float aabb_area(aabb a) {
+    const hmm_v3 d = HMM_SubtractVec3(a.max, a.min);
+    if (d.X < 0.f) return 0.f;
+    return 2.f * (d.X * d.Y + d.Y * d.Z + d.Z * d.X);
+}
+
+hmm_v3 aabb_center(aabb a) {
+    return HMM_MultiplyVec3f(HMM_AddVec3(a.min, a.max), 0.5f);
+}
+
+aabb sphere_bounds(const sphere* s) {
+    const hmm_v3 r = HMM_Vec3(s->radius, s->radius, s->radius);
+    return (aabb) { .min = HMM_SubtractVec3(s->center, r), .max = HMM_AddVec3(s->center, r) };
+}
+
+aabb* create_sphere_bounds(const sphere* spheres, unsigned int length) {
+    aabb* bounds = malloc(sizeof(aabb) * (length > 0 ? length : 1));
+    for (unsigned int i = 0; i < length; ++i) {
+        bounds[i] = sphere_bounds(spheres + i);
+    }
+    return bounds;
+}
+
+float aabb_entry(const aabb* box, const ray* r, hmm_v3 inverse_direction, float t_min, float t_max) {
+    // Slab test, returns the entry distance or INFINITY when the ray misses within [t_min, t_max].
+    for (int axis = 0; axis < 3; ++axis) {
+        float t0 = (box->min.Elements[axis] - r->origin.Elements[axis]) * inverse_direction.Elements[axis];
+        float t1 = (box->max.Elements[axis] - r->origin.Elements[axis]) * inverse_direction.Elements[axis];
+        if (t0 > t1) {
+            const float t = t0;
+            t0 = t1;
+            t1 = t;
+        }
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min) return INFINITY;
+    }
+
+    return t_min;
+}
+
+aabb bvh_leaf_bounds(const bvh* tree, const aabb* primitive_bounds, const bvh_node* node) {
+    aabb bounds = empty_aabb();
+    for (unsigned int i = 0; i < node->count; ++i) {
+        bounds = aabb_union(bounds, primitive_bounds[tree->indices[node->first + i]]);
+    }
+    return bounds;
+}
+
+float bvh_inflation(const bvh* tree) {
+    // Mean growth of the inner nodes' surface area since the build, 1 for a fresh tree. Unlike
+    // the SAH cost this isn't dominated by a few huge nodes near the root.
+    double sum = 0.0;
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < tree->node_count; ++i) {
+        if (tree->nodes[i].count || tree->build_areas[i] <= 0.f) continue;
+        sum += aabb_area(tree->nodes[i].bounds) / tree->build_areas[i];
+        ++count;
+    }
+
+    return count ? (float)(sum / count) : 1.f;
+}
+
+void bvh_subdivide(bvh* tree, const aabb* primitive_bounds, unsigned int node_index, unsigned int depth) {
+    bvh_node* node = tree->nodes + node_index;
+    node->bounds = bvh_leaf_bounds(tree, primitive_bounds, node);
+    // Depth is capped so traversal never overflows its stack.
+    if (node->count <= 1 || depth + 1 >= BVH_STACK_SIZE) return;
+
+    aabb centroids = empty_aabb();
+    for (unsigned int i = 0; i < node->count; ++i) {
+        centroids = aabb_extend(centroids, aabb_center(primitive_bounds[tree->indices[node->first + i]]));
+    }
+
+    // Binned SAH over the centroid bounds of every axis.
+    int best_axis = -1, best_split = 0;
+    float best_cost = node->count * BVH_INTERSECTION_COST * aabb_area(node->bounds);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const float low = centroids.min.Elements[axis];
+        const float extent = centroids.max.Elements[axis] - low;
+        if (extent <= 0.f) continue;
+
+        aabb bins[BVH_BINS];
+        unsigned int counts[BVH_BINS] = { 0 };
+        for (int b = 0; b < BVH_BINS; ++b) bins[b] = empty_aabb();
+
+        for (unsigned int i = 0; i < node->count; ++i) {
+            const aabb* box = primitive_bounds + tree->indices[node->first + i];
+            const int b = HMM_MIN((int)((aabb_center(*box).Elements[axis] - low) / extent * BVH_BINS), BVH_BINS - 1);
+            bins[b] = aabb_union(bins[b], *box);
+            ++counts[b];
+        }
+
+        // Sweep from the right to get the cost of every right side, then from the left.
+        float right_area[BVH_BINS];
+        unsigned int right_count[BVH_BINS];
+        aabb right = empty_aabb();
+        unsigned int count = 0;
+        for (int b = BVH_BINS - 1; b > 0; --b) {
+            right = aabb_union(right, bins[b]);
+            count += counts[b];
+            right_area[b] = aabb_area(right);
+            right_count[b] = count;
+        }
+
+        aabb left = empty_aabb();
+        count = 0;
+        for (int b = 0; b < BVH_BINS - 1; ++b) {
+            left = aabb_union(left, bins[b]);
+            count += counts[b];
+            const float cost = BVH_TRAVERSAL_COST * aabb_area(node->bounds) +
+                BVH_INTERSECTION_COST * (count * aabb_area(left) + right_count[b + 1] * right_area[b + 1]);
+            if (count > 0 && right_count[b + 1] > 0 && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b + 1;
+            }
+        }
+    }
+
+    unsigned int mid;
+
+    if (best_axis >= 0) {
+        const float low = centroids.min.Elements[best_axis];
+        const float extent = centroids.max.Elements[best_axis] - low;
+        unsigned int i = node->first, j = node->first + node->count;
+        while (i < j) {
+            const float c = aabb_center(primitive_bounds[tree->indices[i]]).Elements[best_axis];
+            const int b = HMM_MIN((int)((c - low) / extent * BVH_BINS), BVH_BINS - 1);
+            if (b < best_split) {
+                ++i;
+            }
+            else {
+                const unsigned int swap = tree->indices[i];
+                tree->indices[i] = tree->indices[--j];
+                tree->indices[j] = swap;
+            }
+        }
+        mid = i;
+    }
+    else if (node->count > BVH_MAX_LEAF_SIZE) {
+        // Splitting doesn't pay off but the leaf would be too large, or all centroids coincide.
+        mid = node->first + node->count / 2;
+    }
+    else {
+        return;
+    }
+
+    const unsigned int left = tree->node_count;
+    tree->node_count += 2;
+    tree->nodes[left] = (bvh_node) { .first = node->first, .count = mid - node->first };
+    tree->nodes[left + 1] = (bvh_node) { .first = mid, .count = node->first + node->count - mid };
+    node->first = left;
+    node->count = 0;
+
+    bvh_subdivide(tree, primitive_bounds, left, depth + 1);
+    bvh_subdivide(tree, primitive_bounds, left + 1, depth + 1);
+}
+
+bvh build_bvh_subset(const aabb* primitive_bounds, const unsigned int* subset, unsigned int length) {
+    // Builds over the primitives listed in subset, or over the first length ones without it.
+    const size_t capacity = length > 0 ? length : 1;
+    bvh tree = {
+        .nodes = malloc(sizeof(bvh_node) * (2 * capacity - 1)),
+        .indices = malloc(sizeof(unsigned int) * capacity),
+        .length = length
+    };
+
+    if (length == 0) return tree;
+
+    for (unsigned int i = 0; i < length; ++i) {
+        tree.indices[i] = subset ? subset[i] : i;
+    }
+
+    tree.node_count = 1;
+    tree.nodes[0] = (bvh_node) { .first = 0, .count = length };
+    bvh_subdivide(&tree, primitive_bounds, 0, 0);
+
+    tree.build_areas = malloc(sizeof(float) * tree.node_count);
+    for (unsigned int i = 0; i < tree.node_count; ++i) {
+        tree.build_areas[i] = aabb_area(tree.nodes[i].bounds);
+    }
+    return tree;
+}
+
+bvh build_bvh(const aabb* primitive_bounds, unsigned int length) {
+    return build_bvh_subset(primitive_bounds, NULL, length);
+}
+
+bvh copy_bvh(const bvh* tree) {
+    bvh copy = *tree;
+    if (!tree->nodes) return copy;
+
+    const size_t capacity = tree->length > 0 ? tree->length : 1;
+    copy.nodes = malloc(sizeof(bvh_node) * (2 * capacity - 1));
+    copy.indices = malloc(sizeof(unsigned int) * capacity);
+    memcpy(copy.nodes, tree->nodes, sizeof(bvh_node) * tree->node_count);
+    memcpy(copy.indices, tree->indices, sizeof(unsigned int) * tree->length);
+    if (tree->build_areas) {
+        copy.build_areas = malloc(sizeof(float) * tree->node_count);
+        memcpy(copy.build_areas, tree->build_areas, sizeof(float) * tree->node_count);
+    }
+    return copy;
+}
+
+size_t bvh_bytes(const bvh* tree) {
+    return sizeof(bvh_node) * tree->node_count + sizeof(unsigned int) * tree->length;
+}
+
+void destroy_bvh(bvh* tree) {
+    free(tree->build_areas);
+    free(tree->indices);
+    free(tree->nodes);
+    *tree = (bvh) { 0 };
+}
+
+aabb refit_bvh_node(bvh* tree, const aabb* primitive_bounds, unsigned int index, const bool* done) {
+    // Nodes flagged in done already have their bounds, NULL refits the whole subtree.
+    bvh_node* node = tree->nodes + index;
+    if (done && done[index]) return node->bounds;
+
+    if (node->count) {
+        node->bounds = bvh_leaf_bounds(tree, primitive_bounds, node);
+    }
+    else {
+        const aabb left = refit_bvh_node(tree, primitive_bounds, node->first, done);
+        node->bounds = aabb_union(left, refit_bvh_node(tree, primitive_bounds, node->first + 1, done));
+    }
+    return node->bounds;
+}
+
+typedef struct bvh_refit {
+    bvh* tree;
+    const aabb* primitive_bounds;
+    const unsigned int* roots;
+    unsigned int root_count;
+    atomic_uint next;
+} bvh_refit;
+
+void* bvh_refit_main(void* arg) {
+    bvh_refit* refit = arg;
+    unsigned int i;
+    while ((i = atomic_fetch_add(&refit->next, 1)) < refit->root_count) {
+        refit_bvh_node(refit->tree, refit->primitive_bounds, refit->roots[i], NULL);
+    }
+    return NULL;
+}
+
+void refit_bvh(bvh* tree, const aabb* primitive_bounds, unsigned int threads) {
+    // Disjoint subtrees below a frontier of about 4 per thread are refit in parallel, then
+    // the few nodes above the frontier on the calling thread.
+    if (tree->node_count == 0) return;
+    threads = HMM_MAX(threads, 1u);
+
+    const unsigned int wanted = 4 * threads;
+    unsigned int* roots = malloc(sizeof(unsigned int) * (wanted + 2));
+    bool* done = calloc(tree->node_count, sizeof(bool));
+    unsigned int root_count = 1;
+    roots[0] = 0;
+
+    // Expand the frontier's inner node with the largest surface area, which stands in for its
+    // subtree size, until there are enough subtrees.
+    while (root_count < wanted) {
+        unsigned int expand = root_count;
+        float largest_area = -1.f;
+        for (unsigned int i = 0; i < root_count; ++i) {
+            const bvh_node* node = tree->nodes + roots[i];
+            if (node->count == 0 && aabb_area(node->bounds) > largest_area) {
+                expand = i;
+                largest_area = aabb_area(node->bounds);
+            }
+        }
+        if (expand == root_count) break;
+
+        const unsigned int left = tree->nodes[roots[expand]].first;
+        roots[expand] = roots[--root_count];
+        roots[root_count++] = left;
+        roots[root_count++] = left + 1;
+    }
+
+    bvh_refit refit = { .tree = tree, .primitive_bounds = primitive_bounds, .roots = roots, .root_count = root_count };
+    atomic_init(&refit.next, 0);
+
+    const unsigned int workers = HMM_MIN(threads, root_count);
+    pthread_t* handles = malloc(sizeof(pthread_t) * workers);
+    for (unsigned int i = 0; i < workers; ++i) {
+        pthread_create(handles + i, NULL, bvh_refit_main, &refit);
+    }
+    for (unsigned int i = 0; i < workers; ++i) {
+        pthread_join(handles[i], NULL);
+    }
+
+    for (unsigned int i = 0; i < root_count; ++i) {
+        done[roots[i]] = true;
+    }
+    refit_bvh_node(tree, primitive_bounds, 0, done);
+
+    free(handles);
+    free(done);
+    free(roots);
+}
+
+bool bvh_traverse(const bvh* tree, const void* primitives, bvh_intersect_fn intersect, const ray* r, float t_min,
+    bool any_hit, ray_hit* hit) {
+    // Searches below hit->t, any_hit stops at the first intersection instead of the closest.
+    const hmm_v3 inverse_direction = HMM_Vec3(1.f / r->direction.X, 1.f / r->direction.Y, 1.f / r->direction.Z);
+    unsigned int stack[BVH_STACK_SIZE];
+    unsigned int stack_length = 0;
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+
+    if (tree->node_count == 0 || aabb_entry(&tree->nodes[0].bounds, r, inverse_direction, t_min, closest_so_far) == INFINITY) {
+        return false;
+    }
+
+    unsigned int index = 0;
+    for (;;) {
+        const bvh_node* node = tree->nodes + index;
+
+        if (node->count) {
+            for (unsigned int i = 0; i < node->count; ++i) {
+                if (intersect(primitives, tree->indices[node->first + i], r, t_min, hit)) {
+                    if (any_hit) return true;
+                    hit_anything = true;
+                    closest_so_far = hit->t;
+                }
+            }
+        }
+        else {
+            // Visit the nearer child first, the farther one is culled later if a hit got closer.
+            unsigned int near = node->first, far = node->first + 1;
+            float near_entry = aabb_entry(&tree->nodes[near].bounds, r, inverse_direction, t_min, closest_so_far);
+            float far_entry = aabb_entry(&tree->nodes[far].bounds, r, inverse_direction, t_min, closest_so_far);
+
+            if (far_entry < near_entry) {
+                const unsigned int swap = near;
+                near = far;
+                far = swap;
+                const float entry = near_entry;
+                near_entry = far_entry;
+                far_entry = entry;
+            }
+
+            if (near_entry != INFINITY) {
+                if (far_entry != INFINITY) stack[stack_length++] = far;
+                index = near;
+                continue;
+            }
+        }
+
+        // Pop the next node that can still hold a closer hit.
+        bool found = false;
+        while (stack_length > 0) {
+            index = stack[--stack_length];
+            if (aabb_entry(&tree->nodes[index].bounds, r, inverse_direction, t_min, closest_so_far) != INFINITY) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) break;
+    }
+
+    return hit_anything;
+}
+
+bool intersect_sphere_at(const void* spheres, unsigned int index, const ray* r, float t_min, ray_hit* hit) {
+    if (!intersect_sphere((const sphere*) spheres + index, r, t_min, &hit->t)) return false;
+    hit->primitive = index;
+    return true;
+}
+
+bool bvh_hit(const bvh* tree, const sphere* spheres, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    return bvh_traverse(tree, spheres, intersect_sphere_at, r, t_min, any_hit, hit);
+}
@@ -12,6 +12,15 @@ typedef struct camera {
     float lens_radius;
 } camera;
 
+typedef struct camera_params {
+    point3 position;
+    point3 lookat;
+    hmm_v3 vup;
+    float vfov;
+    float aperture;
+    float focus_dist;
+} camera_params;
+
 camera create_camera(const hmm_v3* pos, const hmm_v3* lookat, const hmm_v3* vup, const float vfov, const float aspect_ratio,
     float aperture, float focus_dist) 
 {
@@ -42,6 +51,11 @@ camera create_camera(const hmm_v3* pos, const hmm_v3* lookat, const hmm_v3* vup,
     };
 }
 
+camera create_camera_from_params(const camera_params* params, const float aspect_ratio) {
+    return create_camera(&params->position, &params->lookat, &params->vup, params->vfov, aspect_ratio,
+        params->aperture, params->focus_dist);
+}
+
 ray get_ray(const camera* cam, const float u, const float v) {
     const hmm_v3 rd = HMM_MultiplyVec3f(random_in_unit_disk(), cam->lens_radius);
     hmm_v3 offset = HMM_MultiplyVec3f(cam->u, rd.X);
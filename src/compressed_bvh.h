@@ -0,0 +1,266 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+
+// Wide BVH with quantized child bounds for scenes whose float boxes no longer fit in cache.
+// Every node keeps its own box as an origin and a per-axis step, and each child's box as
+// COMPRESSED_BVH_BITS integers counting steps from the origin. Minimums are rounded down
+// and maximums up, so decoded boxes only ever grow and no hit is lost, at the price of
+// visiting a few more nodes.
+
+#ifndef COMPRESSED_BVH_BITS
+#define COMPRESSED_BVH_BITS 8
+#endif
+
+#if COMPRESSED_BVH_BITS == 16
+typedef uint16_t quantized_bound;
+#else
+typedef uint8_t quantized_bound;
+#endif
+
+#define COMPRESSED_BVH_STEPS ((1 << COMPRESSED_BVH_BITS) - 1)
+// Larger leaves are spread over the lanes of extra nodes, see split_leaf_lanes().
+#define COMPRESSED_BVH_MAX_LEAF UINT8_MAX
+
+typedef quantized_bound quantized_lanes __attribute__((vector_size(sizeof(quantized_bound) * WIDE_BVH_WIDTH)));
+
+typedef struct compressed_bvh_node {
+    float origin[3];
+    float step[3];
+    // Child boxes in steps from the origin, bounds[0] the minimum and bounds[1] the maximum.
+    quantized_lanes bounds[2][3];
+    unsigned int child[WIDE_BVH_WIDTH];
+    // Primitives of a leaf child, 0 for inner children. Children fill the first lanes, empty
+    // lanes after them have child and count 0, the root is nobody's child.
+    uint8_t count[WIDE_BVH_WIDTH];
+} compressed_bvh_node;
+
+typedef struct compressed_bvh {
+    compressed_bvh_node* nodes;
+    unsigned int node_count;
+    unsigned int* indices;
+    unsigned int length;
+} compressed_bvh;
+
+float decode_bound(float origin, float step, unsigned int q) {
+    return origin + (float) q * step;
+}
+
+float quantize_margin(float value, float step) {
+    // Slack left between a bound and its decoded plane, covers rounding in the slab test.
+    return 0.01f * step + 1e-5f * fabsf(value);
+}
+
+unsigned int quantize_min(float value, float origin, float step) {
+    // Round down, then step back while the decoded plane isn't safely below value.
+    int q = (int) floorf((value - origin) / step);
+    q = HMM_Clamp(0, q, COMPRESSED_BVH_STEPS);
+    const float margin = quantize_margin(value, step);
+    while (q > 0 && decode_bound(origin, step, (unsigned int) q) > value - margin) --q;
+    return (unsigned int) q;
+}
+
+unsigned int quantize_max(float value, float origin, float step) {
+    int q = (int) ceilf((value - origin) / step);
+    q = HMM_Clamp(0, q, COMPRESSED_BVH_STEPS);
+    const float margin = quantize_margin(value, step);
+    while (q < COMPRESSED_BVH_STEPS && decode_bound(origin, step, (unsigned int) q) < value + margin) ++q;
+    return (unsigned int) q;
+}
+
+void compress_bvh_node(compressed_bvh_node* out, const wide_bvh_node* node) {
+    // The node's box is the union of its children, empty lanes hold inverted boxes.
+    aabb box = empty_aabb();
+    for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+        for (int axis = 0; axis < 3; ++axis) {
+            box.min.Elements[axis] = fminf(box.min.Elements[axis], node->bounds[0][axis][lane]);
+            box.max.Elements[axis] = fmaxf(box.max.Elements[axis], node->bounds[1][axis][lane]);
+        }
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        // Pad the box, so the first and last steps keep their margins to the outermost bounds.
+        const float extent = box.max.Elements[axis] - box.min.Elements[axis];
+        const float pad = 2e-5f * (fabsf(box.min.Elements[axis]) + fabsf(box.max.Elements[axis])) + 0.02f * extent /
+            COMPRESSED_BVH_STEPS + 1e-30f;
+        out->origin[axis] = box.min.Elements[axis] - pad;
+        out->step[axis] = (extent + 2.f * pad) / COMPRESSED_BVH_STEPS;
+    }
+
+    for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+        const bool empty = node->bounds[0][0][lane] > node->bounds[1][0][lane];
+        for (int axis = 0; axis < 3; ++axis) {
+            out->bounds[0][axis][lane] = empty ? COMPRESSED_BVH_STEPS :
+                quantize_min(node->bounds[0][axis][lane], out->origin[axis], out->step[axis]);
+            out->bounds[1][axis][lane] = empty ? 0 :
+                quantize_max(node->bounds[1][axis][lane], out->origin[axis], out->step[axis]);
+        }
+        out->child[lane] = node->child[lane];
+        out->count[lane] = node->count[lane] <= COMPRESSED_BVH_MAX_LEAF ? (uint8_t) node->count[lane] : 0;
+    }
+}
+
+unsigned int compressed_leaf_nodes(unsigned int count) {
+    // Nodes split_leaf_lanes() adds for a leaf of count primitives.
+    if (count <= COMPRESSED_BVH_MAX_LEAF) return 0;
+    const unsigned int per_lane = (count + WIDE_BVH_WIDTH - 1) / WIDE_BVH_WIDTH;
+    unsigned int nodes = 1;
+    for (unsigned int begin = 0; begin < count; begin += per_lane) {
+        nodes += compressed_leaf_nodes(HMM_MIN(per_lane, count - begin));
+    }
+    return nodes;
+}
+
+wide_bvh_node split_leaf_lanes(const wide_bvh_node* parent, int parent_lane) {
+    // Spreads a leaf too large for the 8-bit counts evenly over the lanes of a new node, all of
+    // them with the leaf's box. The binary build stops splitting at its depth cap, so leaves
+    // of any size can get here.
+    const unsigned int first = parent->child[parent_lane], count = parent->count[parent_lane];
+    const unsigned int per_lane = (count + WIDE_BVH_WIDTH - 1) / WIDE_BVH_WIDTH;
+    wide_bvh_node node;
+
+    for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+        const unsigned int begin = (unsigned int) lane * per_lane;
+        const bool used = begin < count;
+        for (int axis = 0; axis < 3; ++axis) {
+            node.bounds[0][axis][lane] = used ? parent->bounds[0][axis][parent_lane] : INFINITY;
+            node.bounds[1][axis][lane] = used ? parent->bounds[1][axis][parent_lane] : -INFINITY;
+        }
+        node.child[lane] = used ? first + begin : 0;
+        node.count[lane] = used ? HMM_MIN(per_lane, count - begin) : 0;
+    }
+
+    return node;
+}
+
+void compress_bvh_node_at(compressed_bvh* tree, unsigned int index, const wide_bvh_node* node) {
+    compress_bvh_node(tree->nodes + index, node);
+    for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+        if (node->count[lane] > COMPRESSED_BVH_MAX_LEAF) {
+            const wide_bvh_node split = split_leaf_lanes(node, lane);
+            const unsigned int child = tree->node_count++;
+            tree->nodes[index].child[lane] = child;
+            compress_bvh_node_at(tree, child, &split);
+        }
+    }
+}
+
+compressed_bvh compress_bvh(const wide_bvh* wide) {
+    compressed_bvh tree = { .node_count = wide->node_count, .length = wide->length };
+    if (wide->node_count == 0) return tree;
+
+    // Oversized leaves get their nodes after the wide ones.
+    unsigned int capacity = wide->node_count;
+    for (unsigned int i = 0; i < wide->node_count; ++i) {
+        for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+            capacity += compressed_leaf_nodes(wide->nodes[i].count[lane]);
+        }
+    }
+
+    tree.nodes = aligned_alloc(16, sizeof(compressed_bvh_node) * capacity);
+    tree.indices = malloc(sizeof(unsigned int) * wide->length);
+    memcpy(tree.indices, wide->indices, sizeof(unsigned int) * wide->length);
+    for (unsigned int i = 0; i < wide->node_count; ++i) {
+        compress_bvh_node_at(&tree, i, wide->nodes + i);
+    }
+    return tree;
+}
+
+compressed_bvh copy_compressed_bvh(const compressed_bvh* tree) {
+    compressed_bvh copy = *tree;
+    if (!tree->nodes) return copy;
+
+    copy.nodes = aligned_alloc(16, sizeof(compressed_bvh_node) * tree->node_count);
+    copy.indices = malloc(sizeof(unsigned int) * tree->length);
+    memcpy(copy.nodes, tree->nodes, sizeof(compressed_bvh_node) * tree->node_count);
+    memcpy(copy.indices, tree->indices, sizeof(unsigned int) * tree->length);
+    return copy;
+}
+
+void destroy_compressed_bvh(compressed_bvh* tree) {
+    free(tree->indices);
+    free(tree->nodes);
+    *tree = (compressed_bvh) { 0 };
+}
+
+size_t compressed_bvh_bytes(const compressed_bvh* tree) {
+    return sizeof(compressed_bvh_node) * tree->node_count + sizeof(unsigned int) * tree->length;
+}
+
+bool compressed_bvh_traverse(const compressed_bvh* tree, const void* primitives, bvh_intersect_fn intersect,
+    const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    if (tree->node_count == 0) return false;
+
+    const hmm_v3 inverse_direction = HMM_Vec3(1.f / r->direction.X, 1.f / r->direction.Y, 1.f / r->direction.Z);
+    int near_plane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        near_plane[axis] = inverse_direction.Elements[axis] < 0.f;
+    }
+
+    wide_bvh_entry stack[WIDE_BVH_STACK_SIZE];
+    unsigned int stack_length = 0;
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+    stack[stack_length++] = (wide_bvh_entry) { .child = 0, .count = 0, .entry = t_min };
+
+    while (stack_length > 0) {
+        const wide_bvh_entry top = stack[--stack_length];
+        if (top.entry > closest_so_far) continue;
+
+        if (top.count) {
+            for (unsigned int i = 0; i < top.count; ++i) {
+                if (intersect(primitives, tree->indices[top.child + i], r, t_min, hit)) {
+                    if (any_hit) return true;
+                    hit_anything = true;
+                    closest_so_far = hit->t;
+                }
+            }
+            continue;
+        }
+
+        // Decoding folds into the slab test: plane = origin + q * step, so the distance to it is
+        // q * (step * inverse) + (origin - ray origin) * inverse.
+        const compressed_bvh_node* node = tree->nodes + top.child;
+        node_lanes entry = t_min + (node_lanes) { 0 };
+        node_lanes exit = closest_so_far + (node_lanes) { 0 };
+        for (int axis = 0; axis < 3; ++axis) {
+            const float scale = node->step[axis] * inverse_direction.Elements[axis];
+            const float offset = (node->origin[axis] - r->origin.Elements[axis]) * inverse_direction.Elements[axis];
+            const node_lanes near = __builtin_convertvector(node->bounds[near_plane[axis]][axis], node_lanes);
+            const node_lanes far = __builtin_convertvector(node->bounds[1 - near_plane[axis]][axis], node_lanes);
+            entry = lanes_max(near * scale + offset, entry);
+            exit = lanes_min(far * scale + offset, exit);
+        }
+        const node_mask lanes_hit = entry <= exit;
+
+        wide_bvh_entry hits[WIDE_BVH_WIDTH];
+        int hit_count = 0;
+        for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+            // A zero step times an infinite inverse drops that axis' planes, so empty lanes are
+            // skipped by their child and not by their bounds.
+            if (!lanes_hit[lane] || (node->child[lane] == 0 && node->count[lane] == 0)) continue;
+            int i = hit_count++;
+            while (i > 0 && hits[i - 1].entry < entry[lane]) {
+                hits[i] = hits[i - 1];
+                --i;
+            }
+            hits[i] = (wide_bvh_entry) { .child = node->child[lane], .count = node->count[lane], .entry = entry[lane] };
+        }
+        memcpy(stack + stack_length, hits, sizeof(wide_bvh_entry) * hit_count);
+        stack_length += hit_count;
+    }
+
+    return hit_anything;
+}
+
+bool compressed_bvh_hit(const compressed_bvh* tree, const sphere* spheres, const ray* r, float t_min, bool any_hit,
+    ray_hit* hit) {
+    return compressed_bvh_traverse(tree, spheres, intersect_sphere_at, r, t_min, any_hit, hit);
+}
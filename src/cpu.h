@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string.h>
+#include <stdbool.h>
+
+// Instruction set levels the vector kernels are built for. Every level a kernel benefits from
+// gets its own variant in the same binary, compiled with a target attribute instead of a
+// global -m flag, and the kernel's select function points it at the best variant the CPU
+// supports at startup. Kernels without a variant for a level fall back to the one below.
+
+typedef enum cpu_isa {
+    CPU_ISA_SCALAR,
+    CPU_ISA_SSE4,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512,
+    CPU_ISA_COUNT
+} cpu_isa;
+
+const char* cpu_isa_names[CPU_ISA_COUNT] = { "scalar", "sse4", "avx2", "avx512" };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CPU_X86 1
+#define CPU_TARGET_SSE4 __attribute__((target("sse4.2")))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+// AVX-512 brings FMA along, fusing multiplies and adds would round differently from the
+// other variants.
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw"), optimize("fp-contract=off")))
+#endif
+
+bool parse_cpu_isa(const char* name, cpu_isa* isa) {
+    for (int i = 0; i < CPU_ISA_COUNT; ++i) {
+        if (strcmp(name, cpu_isa_names[i]) == 0) {
+            *isa = (cpu_isa) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+cpu_isa detect_cpu_isa() {
+    // CPUID, and for AVX whether the OS saves the wider registers.
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw")) {
+        return CPU_ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) return CPU_ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return CPU_ISA_SSE4;
+#endif
+    return CPU_ISA_SCALAR;
+}
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "camera.h"
+#include "framebuffer.h"
+#include "scene.h"
+#include "render.h"
+#include "net.h"
+#include "perf.h"
+
+// Long running render server. Scenes are built on first use and stay resident, so a job
+// only pays for tracing. A request carries the client's whole scene description, which is
+// also the cache key. Jobs are served one at a time, each using the whole thread pool.
+
+#define DAEMON_MAGIC 0x52544433u
+#define DAEMON_MAX_SCENES 16
+#define DAEMON_MAX_DIMENSION 16384
+#define DAEMON_IDLE_SECONDS 10
+#define DAEMON_IO_SECONDS 10
+
+typedef struct daemon_request {
+    uint32_t magic;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    // The client's own, recomputing it from the rounded image size would frame the view differently.
+    float aspect_ratio;
+    camera_params view;
+    scene_descriptor scene;
+} daemon_request;
+
+typedef struct daemon_response {
+    uint32_t magic;
+    int32_t status;             // 0 on success, the pixels only follow on success
+    int32_t image_width;
+    int32_t image_height;
+    double setup_seconds;       // scene build time, zero when the scene was resident
+    double render_seconds;
+} daemon_response;
+
+typedef struct scene_cache_entry {
+    scene_descriptor description;
+    scene world;
+    uint64_t last_used;
+} scene_cache_entry;
+
+typedef struct scene_cache {
+    scene_cache_entry entries[DAEMON_MAX_SCENES];
+    unsigned int length;
+    uint64_t clock;
+    scene_factory build;
+} scene_cache;
+
+const scene* acquire_scene(scene_cache* cache, const scene_descriptor* description, double* setup_seconds) {
+    // Returns NULL when the scene can't be built.
+    *setup_seconds = 0.0;
+    ++cache->clock;
+
+    for (unsigned int i = 0; i < cache->length; ++i) {
+        if (same_scene_descriptor(&cache->entries[i].description, description)) {
+            cache->entries[i].last_used = cache->clock;
+            return &cache->entries[i].world;
+        }
+    }
+
+    // Evict the least recently used scene once the cache is full.
+    scene_cache_entry* entry = cache->entries + cache->length;
+    if (cache->length == DAEMON_MAX_SCENES) {
+        entry = cache->entries;
+        for (unsigned int i = 1; i < cache->length; ++i) {
+            if (cache->entries[i].last_used < entry->last_used) entry = cache->entries + i;
+        }
+        destroy_scene(&entry->world);
+        // Moves the last entry into the hole, so a failed build below leaves no empty entry.
+        *entry = cache->entries[--cache->length];
+        entry = cache->entries + cache->length;
+    }
+
+    const double start = now_seconds();
+    *entry = (scene_cache_entry) { .description = *description, .last_used = cache->clock };
+    if (!cache->build(description, &entry->world)) {
+        return NULL;
+    }
+    ++cache->length;
+    *setup_seconds = now_seconds() - start;
+
+    return &entry->world;
+}
+
+void destroy_scene_cache(scene_cache* cache) {
+    for (unsigned int i = 0; i < cache->length; ++i) {
+        destroy_scene(&cache->entries[i].world);
+    }
+    cache->length = 0;
+}
+
+volatile sig_atomic_t daemon_stop = 0;
+
+void handle_daemon_signal(int signal) {
+    (void) signal;
+    daemon_stop = 1;
+}
+
+// Waits for the client's next request, giving up once the daemon is stopping or the client
+// has been idle for too long, so one open connection can't hold the server.
+bool wait_for_request(int fd) {
+    const double deadline = now_seconds() + DAEMON_IDLE_SECONDS;
+    while (!daemon_stop) {
+        const double left = deadline - now_seconds();
+        if (left <= 0.0) return false;
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        const int ready = poll(&pfd, 1, (int)(left * 1000.0) + 1);
+        if (ready > 0) return true;
+        if (ready < 0 && errno != EINTR) return false;
+    }
+    return false;
+}
+
+bool serve_render_job(int fd, scene_cache* cache, const render_options* defaults) {
+    daemon_request request;
+    if (!wait_for_request(fd) || !recv_all(fd, &request, sizeof(request))) {
+        return false;
+    }
+
+    daemon_response response = { .magic = DAEMON_MAGIC };
+
+    if (request.magic != DAEMON_MAGIC ||
+        request.image_width < 2 || request.image_width > DAEMON_MAX_DIMENSION ||
+        request.image_height < 2 || request.image_height > DAEMON_MAX_DIMENSION ||
+        request.samples_per_pixel < 1 || request.max_depth < 1 || !(request.aspect_ratio > 0.f) ||
+        !isfinite(request.aspect_ratio) || !memchr(request.scene.mesh, 0, SCENE_MESH_PATH_MAX)) {
+        response.status = 1;
+        send_all(fd, &response, sizeof(response));
+        return false;
+    }
+
+    render_options options = *defaults;
+    options.image_width = request.image_width;
+    options.image_height = request.image_height;
+    options.aspect_ratio = request.aspect_ratio;
+    options.samples_per_pixel = request.samples_per_pixel;
+    options.max_depth = request.max_depth;
+    options.view = request.view;
+
+    const scene* world = acquire_scene(cache, &request.scene, &response.setup_seconds);
+    if (!world) {
+        response.status = 1;
+        return send_all(fd, &response, sizeof(response));
+    }
+    framebuffer fb = create_framebuffer(options.image_width, options.image_height);
+
+    const double start = now_seconds();
+    render(&options, world, &fb, false);
+    response.render_seconds = now_seconds() - start;
+    response.image_width = fb.width;
+    response.image_height = fb.height;
+
+    fprintf(stderr, "Job %ix%i %i spp, scene %u size %i: setup %.3fs, render %.3fs\n", fb.width, fb.height,
+        options.samples_per_pixel, request.scene.seed, request.scene.size, response.setup_seconds, response.render_seconds);
+
+    const bool sent = send_all(fd, &response, sizeof(response)) &&
+        send_all(fd, fb.pixels, sizeof(color) * (size_t) fb.width * fb.height);
+    destroy_framebuffer(&fb);
+    return sent;
+}
+
+int run_render_daemon(const char* address, const render_options* defaults, scene_factory build) {
+    const int listen_fd = net_listen(address);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Can't listen on %s\n", address);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts poll and the loop can shut down cleanly.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_daemon_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // The daemon's own scene options pick the scene built ahead of the first job.
+    scene_cache cache = { .build = build };
+    const scene_descriptor preload = describe_scene(defaults);
+    double setup_seconds;
+    if (!acquire_scene(&cache, &preload, &setup_seconds)) {
+        close(listen_fd);
+        return 1;
+    }
+    fprintf(stderr, "Listening on %s, scene %u built in %.3fs\n", address, preload.seed, setup_seconds);
+
+    while (!daemon_stop) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) <= 0) continue;
+
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+
+        // A client that stalls mid-transfer times out instead of blocking everyone else.
+        const struct timeval timeout = { .tv_sec = DAEMON_IO_SECONDS };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // A client may submit several jobs over one connection.
+        while (!daemon_stop && serve_render_job(fd, &cache, defaults)) {
+        }
+
+        close(fd);
+    }
+
+    fprintf(stderr, "Shutting down\n");
+    destroy_scene_cache(&cache);
+    close(listen_fd);
+    if (strncmp(address, "unix:", 5) == 0) {
+        unlink(address + 5);
+    }
+
+    return 0;
+}
+
+int submit_render_job(const char* address, const render_options* options, framebuffer* fb) {
+    const int fd = net_connect(address);
+    if (fd < 0) {
+        fprintf(stderr, "Can't connect to %s\n", address);
+        return 1;
+    }
+
+    const daemon_request request = {
+        .magic = DAEMON_MAGIC,
+        .image_width = options->image_width,
+        .image_height = options->image_height,
+        .samples_per_pixel = options->samples_per_pixel,
+        .max_depth = options->max_depth,
+        .aspect_ratio = options->aspect_ratio,
+        .view = options->view,
+        .scene = describe_scene(options)
+    };
+
+    daemon_response response;
+    const double start = now_seconds();
+
+    if (!send_all(fd, &request, sizeof(request)) || !recv_all(fd, &response, sizeof(response)) ||
+        response.magic != DAEMON_MAGIC || response.status != 0) {
+        fprintf(stderr, "Render job failed\n");
+        close(fd);
+        return 1;
+    }
+
+    *fb = create_framebuffer(response.image_width, response.image_height);
+    const bool received = recv_all(fd, fb->pixels, sizeof(color) * (size_t) fb->width * fb->height);
+    close(fd);
+
+    if (!received) {
+        fprintf(stderr, "Render job interrupted\n");
+        destroy_framebuffer(fb);
+        return 1;
+    }
+
+    fprintf(stderr, "Setup %.3fs, render %.3fs, total %.3fs\n", response.setup_seconds, response.render_seconds,
+        now_seconds() - start);
+    return 0;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "framebuffer.h"
+#include "features.h"
+#include "tile.h"
+
+// Edge-avoiding a-trous wavelet filter for low sample counts, guided by variance like SVGF.
+// Colors are divided by the first-hit albedo, so textures survive, and the remaining
+// illumination is blurred with a 5x5 B3 spline kernel whose taps spread twice as far every
+// pass. Taps across normal or albedo edges get little weight, and so do taps whose luminance
+// differs by more than the pixel's estimated noise.
+
+#define DENOISE_ITERATIONS 3
+#define DENOISE_TILE_SIZE 64
+#define DENOISE_SIGMA_LUMINANCE 2.f
+#define DENOISE_SIGMA_NORMAL 0.3f
+#define DENOISE_SIGMA_ALBEDO 0.1f
+
+typedef struct denoise_pass {
+    const color* in;
+    const float* variance_in;
+    color* out;
+    float* variance_out;
+    const feature_buffer* features;
+    int step;
+} denoise_pass;
+
+const float atrous_kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+float squared_distance(hmm_v3 a, hmm_v3 b) {
+    return HMM_LengthSquaredVec3(HMM_SubtractVec3(a, b));
+}
+
+float blurred_variance(const denoise_pass* pass, int x, int y) {
+    // A single pixel's variance estimate is itself noisy, smooth it over its 3x3 neighbourhood.
+    const float gaussian[2] = { 0.25f, 0.125f };
+    const int width = pass->features->width;
+    const int height = pass->features->height;
+    float sum = 0.f, weight_sum = 0.f;
+
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            const int qx = x + dx, qy = y + dy;
+            if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+            const float weight = gaussian[abs(dx)] * gaussian[abs(dy)];
+            sum += weight * pass->variance_in[feature_index(pass->features, qx, qy)];
+            weight_sum += weight;
+        }
+    }
+
+    return sum / weight_sum;
+}
+
+void denoise_tile(const tile* t, const tile_set* set, unsigned int worker, void* user) {
+    (void) set;
+    (void) worker;
+    const denoise_pass* pass = user;
+    const feature_buffer* features = pass->features;
+    const int width = features->width;
+    const int height = features->height;
+    const float normal_scale = 1.f / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+    const float albedo_scale = 1.f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+
+    for (int y = t->y0; y < t->y1; ++y) {
+        for (int x = t->x0; x < t->x1; ++x) {
+            const size_t p = feature_index(features, x, y);
+            const float center = luminance(pass->in[p]);
+            const float luminance_scale = 1.f / (DENOISE_SIGMA_LUMINANCE * sqrtf(blurred_variance(pass, x, y)) + 1e-4f);
+            color sum = HMM_Vec3(0.f, 0.f, 0.f);
+            float weight_sum = 0.f, variance_sum = 0.f;
+
+            for (int dy = -2; dy <= 2; ++dy) {
+                const int qy = y + dy * pass->step;
+                if (qy < 0 || qy >= height) continue;
+
+                for (int dx = -2; dx <= 2; ++dx) {
+                    const int qx = x + dx * pass->step;
+                    if (qx < 0 || qx >= width) continue;
+
+                    const size_t q = feature_index(features, qx, qy);
+                    const float distance =
+                        fabsf(center - luminance(pass->in[q])) * luminance_scale +
+                        squared_distance(features->normal[p], features->normal[q]) * normal_scale +
+                        squared_distance(features->albedo[p], features->albedo[q]) * albedo_scale;
+                    const float weight = atrous_kernel[dx + 2] * atrous_kernel[dy + 2] * expf(-distance);
+
+                    sum = HMM_AddVec3(sum, HMM_MultiplyVec3f(pass->in[q], weight));
+                    weight_sum += weight;
+                    variance_sum += weight * weight * pass->variance_in[q];
+                }
+            }
+
+            // The center tap always has weight, so the sum is never zero.
+            pass->out[p] = HMM_DivideVec3f(sum, weight_sum);
+            pass->variance_out[p] = variance_sum / (weight_sum * weight_sum);
+        }
+    }
+}
+
+float demodulate(float value, float albedo) {
+    return value / fmaxf(albedo, 1e-3f);
+}
+
+void denoise_framebuffer(framebuffer* fb, const feature_buffer* features, unsigned int threads) {
+    const size_t count = (size_t) fb->width * fb->height;
+    color* buffers[2] = { malloc(sizeof(color) * count), malloc(sizeof(color) * count) };
+    float* variances[2] = { malloc(sizeof(float) * count), malloc(sizeof(float) * count) };
+
+    for (size_t p = 0; p < count; ++p) {
+        const color albedo = features->albedo[p];
+        const float albedo_luminance = fmaxf(luminance(albedo), 1e-3f);
+        buffers[0][p] = HMM_Vec3(demodulate(fb->pixels[p].R, albedo.R), demodulate(fb->pixels[p].G, albedo.G),
+            demodulate(fb->pixels[p].B, albedo.B));
+        variances[0][p] = features->variance[p] / (albedo_luminance * albedo_luminance);
+    }
+
+    tile_set tiles = create_tile_set(fb->width, fb->height, DENOISE_TILE_SIZE, TILE_ORDER_SCANLINE, TILE_ORDER_SCANLINE);
+    const tile_dispatch_config config = { .threads = threads };
+
+    for (int i = 0; i < DENOISE_ITERATIONS; ++i) {
+        denoise_pass pass = {
+            .in = buffers[i & 1],
+            .variance_in = variances[i & 1],
+            .out = buffers[(i + 1) & 1],
+            .variance_out = variances[(i + 1) & 1],
+            .features = features,
+            .step = 1 << i
+        };
+        dispatch_tiles(&tiles, &config, denoise_tile, &pass);
+    }
+
+    const color* result = buffers[DENOISE_ITERATIONS & 1];
+    for (size_t p = 0; p < count; ++p) {
+        const color albedo = features->albedo[p];
+        fb->pixels[p] = HMM_Vec3(result[p].R * fmaxf(albedo.R, 1e-3f), result[p].G * fmaxf(albedo.G, 1e-3f),
+            result[p].B * fmaxf(albedo.B, 1e-3f));
+    }
+
+    destroy_tile_set(&tiles);
+    free(variances[1]);
+    free(variances[0]);
+    free(buffers[1]);
+    free(buffers[0]);
+}
+
+double framebuffer_rmse(const framebuffer* a, const framebuffer* b) {
+    // Over linear colors, both framebuffers have the same size.
+    const size_t count = (size_t) a->width * a->height;
+    double sum = 0.0;
+
+    for (size_t p = 0; p < count; ++p) {
+        const hmm_v3 d = HMM_SubtractVec3(a->pixels[p], b->pixels[p]);
+        sum += (double) d.R * d.R + (double) d.G * d.G + (double) d.B * d.B;
+    }
+
+    return sqrt(sum / (3.0 * (double) count));
+}
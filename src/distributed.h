@@ -0,0 +1,336 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "framebuffer.h"
+#include "tile.h"
+#include "render.h"
+#include "net.h"
+#include "perf.h"
+
+// Coordinator/worker tile rendering. Workers build the scene described in the coordinator's
+// job locally and only exchange tile rectangles and float pixels with the coordinator. Messages are sent in
+// host byte order, so all processes are expected to run on the same architecture.
+
+#define NET_MAGIC 0x52543032u
+#define NET_DONE UINT32_MAX
+#define NET_MAX_WORKERS 256
+// Tiles kept in flight per worker, so a worker never idles waiting for its next tile.
+#define NET_PIPELINE 2
+
+typedef struct net_job {
+    uint32_t magic;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    int32_t tile_size;
+    int32_t pixel_order;
+    float aspect_ratio;
+    camera_params view;
+    scene_descriptor scene;
+} net_job;
+
+typedef struct net_tile {
+    uint32_t index;
+    int32_t x0, y0;
+    int32_t x1, y1;
+} net_tile;
+
+typedef struct net_worker {
+    int fd;
+    unsigned int in_flight[NET_PIPELINE];
+    unsigned int in_flight_count;
+    unsigned int tiles;
+    double connected_at;
+} net_worker;
+
+typedef struct coordinator {
+    const tile_set* tiles;
+    framebuffer* fb;
+    // Stack of tiles still to hand out, the next tile is on top.
+    unsigned int* pending;
+    unsigned int pending_length;
+    bool* received;
+    unsigned int received_count;
+    unsigned int reassigned;
+    net_worker workers[NET_MAX_WORKERS];
+    unsigned int worker_count;
+} coordinator;
+
+int run_render_worker(const char* address, render_options options, scene_factory build, int exit_after) {
+    int fd = -1;
+
+    // The coordinator may still be starting up.
+    for (int attempt = 0; attempt < 50 && fd < 0; ++attempt) {
+        fd = net_connect(address);
+        if (fd < 0) usleep(100000);
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "Worker can't connect to %s\n", address);
+        return 1;
+    }
+
+    net_job job;
+    if (!recv_all(fd, &job, sizeof(job)) || job.magic != NET_MAGIC) {
+        fprintf(stderr, "Worker received an invalid job\n");
+        close(fd);
+        return 1;
+    }
+
+    options.image_width = job.image_width;
+    options.image_height = job.image_height;
+    options.samples_per_pixel = job.samples_per_pixel;
+    options.max_depth = job.max_depth;
+    options.tile_size = job.tile_size;
+    options.pixel_order = (tile_order) job.pixel_order;
+    options.aspect_ratio = job.aspect_ratio;
+    options.view = job.view;
+
+    // A worker that can't build the scene, like one missing the mesh file, refuses the job
+    // and the coordinator hands its tiles to the others.
+    scene world = { 0 };
+    if (!build(&job.scene, &world)) {
+        fprintf(stderr, "Worker can't build the job's scene, refusing the job\n");
+        close(fd);
+        return 1;
+    }
+
+    int rendered = 0;
+    net_tile t;
+
+    while (recv_all(fd, &t, sizeof(t)) && t.index != NET_DONE) {
+        if (exit_after >= 0 && rendered >= exit_after) {
+            // Simulated crash for exercising the coordinator's reassignment.
+            fprintf(stderr, "Worker %i exiting after %i tiles\n", (int) getpid(), rendered);
+            _exit(2);
+        }
+
+        framebuffer fb = create_framebuffer(t.x1 - t.x0, t.y1 - t.y0);
+        render_region(&options, &world, &fb, t.x0, t.y0, false);
+
+        const bool sent = send_all(fd, &t, sizeof(t)) &&
+            send_all(fd, fb.pixels, sizeof(color) * (size_t) fb.width * fb.height);
+        destroy_framebuffer(&fb);
+
+        if (!sent) break;
+        ++rendered;
+    }
+
+    close(fd);
+    destroy_scene(&world);
+    return 0;
+}
+
+void requeue_worker_tiles(coordinator* c, net_worker* w) {
+    for (unsigned int i = 0; i < w->in_flight_count; ++i) {
+        const unsigned int index = w->in_flight[i];
+        if (c->received[index]) continue;
+        c->pending[c->pending_length++] = index;
+        ++c->reassigned;
+    }
+    w->in_flight_count = 0;
+}
+
+void drop_worker(coordinator* c, unsigned int slot) {
+    net_worker* w = c->workers + slot;
+    fprintf(stderr, "\rWorker %u lost, reassigning %u tiles\n", slot, w->in_flight_count);
+    requeue_worker_tiles(c, w);
+    close(w->fd);
+    w->fd = -1;
+}
+
+bool feed_worker(coordinator* c, net_worker* w) {
+    while (w->in_flight_count < NET_PIPELINE && c->pending_length > 0) {
+        const unsigned int index = c->pending[--c->pending_length];
+        const tile* t = c->tiles->tiles + index;
+        const net_tile message = { .index = index, .x0 = t->x0, .y0 = t->y0, .x1 = t->x1, .y1 = t->y1 };
+
+        w->in_flight[w->in_flight_count++] = index;
+        if (!send_all(w->fd, &message, sizeof(message))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool receive_tile(coordinator* c, net_worker* w, color* scratch) {
+    net_tile message;
+    if (!recv_all(w->fd, &message, sizeof(message))) {
+        return false;
+    }
+
+    unsigned int slot = w->in_flight_count;
+    for (unsigned int i = 0; i < w->in_flight_count; ++i) {
+        if (w->in_flight[i] == message.index) slot = i;
+    }
+
+    if (slot == w->in_flight_count) {
+        fprintf(stderr, "Worker sent a tile it wasn't assigned\n");
+        return false;
+    }
+
+    const tile* t = c->tiles->tiles + message.index;
+    const int width = t->x1 - t->x0;
+    const int height = t->y1 - t->y0;
+    if (!recv_all(w->fd, scratch, sizeof(color) * (size_t) width * height)) {
+        return false;
+    }
+
+    for (int y = 0; y < height; ++y) {
+        memcpy(framebuffer_at(c->fb, t->x0, t->y0 + y), scratch + (size_t) y * width, sizeof(color) * width);
+    }
+
+    w->in_flight[slot] = w->in_flight[--w->in_flight_count];
+    if (!c->received[message.index]) {
+        c->received[message.index] = true;
+        ++c->received_count;
+        ++w->tiles;
+    }
+
+    return true;
+}
+
+void spawn_local_workers(const char* address, unsigned int count, unsigned int threads) {
+    char threads_arg[16];
+    snprintf(threads_arg, sizeof(threads_arg), "%u", threads);
+    fflush(stdout);
+    fflush(stderr);
+
+    for (unsigned int i = 0; i < count; ++i) {
+        if (fork() == 0) {
+            char* args[] = { "raytracer", "--worker", (char*) address, "--threads", threads_arg, NULL };
+            execv("/proc/self/exe", args);
+            _exit(127);
+        }
+    }
+}
+
+int run_coordinator(const char* address, const render_options* options, int work_tile_size, unsigned int spawn, framebuffer* fb) {
+    const int listen_fd = net_listen(address);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Can't listen on %s\n", address);
+        return 1;
+    }
+
+    if (spawn > 0) {
+        spawn_local_workers(address, spawn, HMM_MAX(options->threads / spawn, 1u));
+    }
+
+    tile_set tiles = create_tile_set(fb->width, fb->height, work_tile_size, options->order, options->order);
+    coordinator c = {
+        .tiles = &tiles,
+        .fb = fb,
+        .pending = malloc(sizeof(unsigned int) * tiles.length),
+        .received = calloc(tiles.length, sizeof(bool))
+    };
+
+    for (unsigned int i = 0; i < tiles.length; ++i) {
+        c.pending[i] = tiles.length - 1 - i;
+    }
+    c.pending_length = tiles.length;
+
+    const net_job job = {
+        .magic = NET_MAGIC,
+        .image_width = options->image_width,
+        .image_height = options->image_height,
+        .samples_per_pixel = options->samples_per_pixel,
+        .max_depth = options->max_depth,
+        .tile_size = options->tile_size,
+        .pixel_order = options->pixel_order,
+        .aspect_ratio = options->aspect_ratio,
+        .view = options->view,
+        .scene = describe_scene(options)
+    };
+
+    color* scratch = malloc(sizeof(color) * tiles.tile_size * tiles.tile_size);
+    struct pollfd fds[NET_MAX_WORKERS + 1];
+    unsigned int fd_slots[NET_MAX_WORKERS + 1];
+    const double start = now_seconds();
+
+    while (c.received_count < tiles.length) {
+        nfds_t nfds = 0;
+        fds[nfds++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+
+        for (unsigned int i = 0; i < c.worker_count; ++i) {
+            if (c.workers[i].fd < 0) continue;
+            fd_slots[nfds] = i;
+            fds[nfds++] = (struct pollfd) { .fd = c.workers[i].fd, .events = POLLIN };
+        }
+
+        if (nfds == 1) {
+            fprintf(stderr, "\rWaiting for workers, %u tiles left ", tiles.length - c.received_count);
+        }
+
+        if (poll(fds, nfds, 1000) <= 0) continue;
+
+        for (nfds_t f = 1; f < nfds; ++f) {
+            if (!(fds[f].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            net_worker* w = c.workers + fd_slots[f];
+
+            if (!receive_tile(&c, w, scratch)) {
+                drop_worker(&c, fd_slots[f]);
+                continue;
+            }
+
+            fprintf(stderr, "\rTiles remaining: %u ", tiles.length - c.received_count);
+        }
+
+        if ((fds[0].revents & POLLIN) && c.worker_count < NET_MAX_WORKERS) {
+            const int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                if (send_all(fd, &job, sizeof(job))) {
+                    c.workers[c.worker_count++] = (net_worker) { .fd = fd, .connected_at = now_seconds() };
+                }
+                else {
+                    close(fd);
+                }
+            }
+        }
+
+        // Hand out new and reassigned tiles to every live worker with a free slot.
+        for (unsigned int i = 0; i < c.worker_count; ++i) {
+            if (c.workers[i].fd >= 0 && !feed_worker(&c, c.workers + i)) {
+                drop_worker(&c, i);
+            }
+        }
+    }
+
+    const net_tile done = { .index = NET_DONE };
+    fprintf(stderr, "\n%-8s %8s %12s\n", "worker", "tiles", "tiles/s");
+
+    for (unsigned int i = 0; i < c.worker_count; ++i) {
+        net_worker* w = c.workers + i;
+        fprintf(stderr, "%-8u %8u %12.2f%s\n", i, w->tiles, w->tiles / (now_seconds() - w->connected_at),
+            w->fd < 0 ? "  (lost)" : "");
+        if (w->fd < 0) continue;
+        send_all(w->fd, &done, sizeof(done));
+        close(w->fd);
+    }
+
+    fprintf(stderr, "%u tiles reassigned, %.3f seconds\n", c.reassigned, now_seconds() - start);
+
+    // Reap spawned workers, including ones that died.
+    for (unsigned int i = 0; i < spawn; ++i) {
+        wait(NULL);
+    }
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        unlink(address + 5);
+    }
+
+    free(scratch);
+    free(c.received);
+    free(c.pending);
+    destroy_tile_set(&tiles);
+    close(listen_fd);
+    return 0;
+}
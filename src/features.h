@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdlib.h>
+#include "math.h"
+#include "sphere.h"
+#include "hdr.h"
+
+// Surface features of the first hit along each camera ray, averaged over a pixel's samples.
+// The denoiser uses them to find edges that the noisy colors can't show reliably, and the
+// variance of the pixel's mean luminance to tell noise from detail. They are also written
+// out as AOVs for compositing.
+
+#define FEATURE_NO_MATERIAL -1.f
+
+typedef struct first_hit {
+    color albedo;
+    hmm_v3 normal;
+    float depth;            // distance along the camera ray, infinite for a miss
+    float material_id;      // FEATURE_NO_MATERIAL for a miss
+} first_hit;
+
+typedef struct feature_buffer {
+    // Same layout as the framebuffer, rows from the top down.
+    color* albedo;
+    hmm_v3* normal;
+    float* variance;
+    // Averaged over the samples that hit a surface.
+    float* depth;
+    // Of the pixel's first sample, ids don't average.
+    float* material_id;
+    int width;
+    int height;
+} feature_buffer;
+
+float luminance(color c) {
+    return 0.2126f * c.R + 0.7152f * c.G + 0.0722f * c.B;
+}
+
+void record_first_hit(first_hit* first, const ray* r, const hit_record* rec) {
+    // Glass has no albedo of its own, it shows what's behind it.
+    first->albedo = rec->material.dielectric ? HMM_Vec3(1.f, 1.f, 1.f) : rec->material.albedo;
+    first->normal = rec->normal;
+    first->depth = rec->t * HMM_LengthVec3(r->direction);
+    first->material_id = (float) rec->material.id;
+}
+
+void record_first_miss(first_hit* first, color sky) {
+    first->albedo = sky;
+    first->normal = HMM_Vec3(0.f, 0.f, 0.f);
+    first->depth = INFINITY;
+    first->material_id = FEATURE_NO_MATERIAL;
+}
+
+feature_buffer create_feature_buffer(const int width, const int height) {
+    return (feature_buffer) {
+        .albedo = calloc((size_t) width * height, sizeof(color)),
+        .normal = calloc((size_t) width * height, sizeof(hmm_v3)),
+        .variance = calloc((size_t) width * height, sizeof(float)),
+        .depth = calloc((size_t) width * height, sizeof(float)),
+        .material_id = calloc((size_t) width * height, sizeof(float)),
+        .width = width,
+        .height = height
+    };
+}
+
+void destroy_feature_buffer(feature_buffer* features) {
+    free(features->material_id);
+    free(features->depth);
+    free(features->variance);
+    free(features->normal);
+    free(features->albedo);
+    *features = (feature_buffer) { 0 };
+}
+
+size_t feature_index(const feature_buffer* features, const int x, const int y) {
+    return (size_t) y * features->width + x;
+}
+
+bool write_feature_buffers(const char* path, const feature_buffer* features) {
+    // path names the format, e.g. aov.exr becomes aov.depth.exr, aov.normal.exr and so on.
+    const char* extension = strrchr(path, '.');
+    const int stem = extension ? (int)(extension - path) : (int) strlen(path);
+    const struct { const char* name; const float* pixels; int channels; } aovs[] = {
+        { "depth", features->depth, 1 },
+        { "normal", (const float*) features->normal, 3 },
+        { "albedo", (const float*) features->albedo, 3 },
+        { "material", features->material_id, 1 }
+    };
+
+    for (size_t i = 0; i < sizeof(aovs) / sizeof(aovs[0]); ++i) {
+        char aov_path[4096];
+        snprintf(aov_path, sizeof(aov_path), "%.*s.%s%s", stem, path, aovs[i].name, extension ? extension : "");
+
+        const hdr_image image = {
+            .pixels = aovs[i].pixels,
+            .width = features->width,
+            .height = features->height,
+            .channels = aovs[i].channels
+        };
+        if (!write_hdr_image(aov_path, &image)) return false;
+    }
+
+    return true;
+}
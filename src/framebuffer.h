@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "math.h"
+#include "tonemap.h"
+
+typedef struct framebuffer {
+    // Linear colors, rows stored from the top of the image down.
+    color* pixels;
+    int width;
+    int height;
+} framebuffer;
+
+framebuffer create_framebuffer(const int width, const int height) {
+    return (framebuffer) {
+        .pixels = calloc((size_t) width * height, sizeof(color)),
+        .width = width,
+        .height = height
+    };
+}
+
+void destroy_framebuffer(framebuffer* fb) {
+    free(fb->pixels);
+    *fb = (framebuffer) { 0 };
+}
+
+color* framebuffer_at(const framebuffer* fb, const int x, const int y) {
+    return fb->pixels + (size_t) y * fb->width + x;
+}
+
+void write_ppm_header(FILE* stream, const int width, const int height) {
+    fprintf(stream, "P3\n");
+    fprintf(stream, "%i %i\n", width, height);
+    fprintf(stream, "255\n");
+}
+
+void write_framebuffer_rows(FILE* stream, const framebuffer* fb, const int y0, const int y1, const tonemap_context* tonemap) {
+    // Tone-map a chunk of rows in one pass, format it and hand it to stdio in one write.
+    const int chunk_rows = 64;
+    const size_t row_bytes = (size_t) fb->width * 3;
+    uint8_t* rgb = malloc(row_bytes * chunk_rows);
+    char* text = malloc(row_bytes * chunk_rows * 4);
+
+    for (int y = y0; y < y1; y += chunk_rows) {
+        const int rows = HMM_MIN(chunk_rows, y1 - y);
+        tonemap_rows(tonemap, (const float*) fb->pixels, y, y + rows, rgb);
+        fwrite(text, 1, format_ppm_rows(rgb, row_bytes * rows, text), stream);
+    }
+
+    free(text);
+    free(rgb);
+}
+
+void write_framebuffer(FILE* stream, const framebuffer* fb, const tonemap_options* options) {
+    write_ppm_header(stream, fb->width, fb->height);
+    tonemap_context tonemap = create_tonemap_context(options, fb->width);
+    write_framebuffer_rows(stream, fb, 0, fb->height, &tonemap);
+    destroy_tonemap_context(&tonemap);
+}
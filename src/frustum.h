@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "camera.h"
+#include "sphere.h"
+#include "scene.h"
+#include "tile.h"
+
+// Candidate spheres for the primary rays of every tile. Those rays start on the lens disk and
+// pass through the tile's rectangle on the focus plane, so at depth z they cover the rectangle
+// scaled by z / focus_dist and widened by lens_radius * |z / focus_dist - 1|. Each side of
+// that volume is bounded by one plane before the focus plane and another after it, a sphere
+// outside both planes of any side, or behind the lens, is culled. With a pinhole both planes
+// are the same. Tiles that see more than FRUSTUM_CANDIDATE_LIMIT spheres keep tracing their
+// primary rays through the acceleration structure.
+
+#define FRUSTUM_CANDIDATE_LIMIT 64
+
+typedef struct frustum_plane {
+    // Unit normal, points x with dot(normal, x - origin) + offset > 0 are outside.
+    hmm_v3 normal;
+    float offset;
+} frustum_plane;
+
+typedef struct tile_frustum {
+    point3 origin;
+    // Left, right, bottom and top.
+    frustum_plane sides[4][2];
+    frustum_plane behind;
+} tile_frustum;
+
+typedef struct tile_candidates {
+    // Spheres of the tile with scanline index t are items[first[t]] to items[first[t] + count[t]]
+    // if listed[t] is set.
+    unsigned int* first;
+    unsigned int* count;
+    bool* listed;
+    unsigned int tile_count;
+    unsigned int* items;
+    unsigned int items_length;
+    unsigned int items_capacity;
+} tile_candidates;
+
+frustum_plane make_frustum_plane(hmm_v3 normal, float offset) {
+    const float length = HMM_LengthVec3(normal);
+    return (frustum_plane) { .normal = HMM_DivideVec3f(normal, length), .offset = offset / length };
+}
+
+tile_frustum make_tile_frustum(const camera* cam, float s0, float s1, float t0, float t1) {
+    // s and t are the get_ray() coordinates of the tile's corners.
+    const hmm_v3 to_corner = HMM_SubtractVec3(cam->lower_left_corner, cam->origin);
+    const hmm_v3 to_center = HMM_AddVec3(to_corner,
+        HMM_MultiplyVec3f(HMM_AddVec3(cam->horizontal, cam->vertical), 0.5f));
+    const float focus_dist = -HMM_DotVec3(to_center, cam->w);
+    const float lens = cam->lens_radius;
+
+    const hmm_v3 axes[2] = { cam->u, cam->v };
+    const hmm_v3 extents[2] = { cam->horizontal, cam->vertical };
+    const float low[2] = { s0, t0 }, high[2] = { s1, t1 };
+
+    tile_frustum f = { .origin = cam->origin, .behind = { .normal = cam->w, .offset = 0.f } };
+    for (int axis = 0; axis < 2; ++axis) {
+        const float start = HMM_DotVec3(to_corner, axes[axis]);
+        const float extent = HMM_DotVec3(extents[axis], axes[axis]);
+        for (int side = 0; side < 2; ++side) {
+            // Lateral bound b on the focus plane, facing sign. Before the focus plane the
+            // bound is b * z / focus_dist + lens * (1 - z / focus_dist), after it the lens
+            // term flips sign.
+            const float sign = side ? 1.f : -1.f;
+            const float bound = start + (side ? high[axis] : low[axis]) * extent;
+            const hmm_v3 outward = HMM_MultiplyVec3f(axes[axis], sign);
+            const float before = (sign * bound - lens) / focus_dist, after = (sign * bound + lens) / focus_dist;
+            frustum_plane* planes = f.sides[axis * 2 + side];
+            planes[0] = make_frustum_plane(HMM_AddVec3(outward, HMM_MultiplyVec3f(cam->w, before)), -lens);
+            planes[1] = make_frustum_plane(HMM_AddVec3(outward, HMM_MultiplyVec3f(cam->w, after)), lens);
+        }
+    }
+    return f;
+}
+
+float frustum_plane_distance(const frustum_plane* p, const point3 origin, const point3 x) {
+    return HMM_DotVec3(p->normal, HMM_SubtractVec3(x, origin)) + p->offset;
+}
+
+bool frustum_culls_sphere(const tile_frustum* f, const sphere* s) {
+    if (frustum_plane_distance(&f->behind, f->origin, s->center) > s->radius) return true;
+
+    for (int side = 0; side < 4; ++side) {
+        if (frustum_plane_distance(&f->sides[side][0], f->origin, s->center) > s->radius &&
+            frustum_plane_distance(&f->sides[side][1], f->origin, s->center) > s->radius) {
+            return true;
+        }
+    }
+    return false;
+}
+
+float frustum_plane_box_distance(const frustum_plane* p, const point3 origin, const aabb* box) {
+    // Distance of the box corner farthest inside.
+    const point3 corner = HMM_Vec3(p->normal.X > 0.f ? box->min.X : box->max.X,
+        p->normal.Y > 0.f ? box->min.Y : box->max.Y, p->normal.Z > 0.f ? box->min.Z : box->max.Z);
+    return frustum_plane_distance(p, origin, corner);
+}
+
+bool frustum_culls_box(const tile_frustum* f, const aabb* box) {
+    if (frustum_plane_box_distance(&f->behind, f->origin, box) > 0.f) return true;
+
+    for (int side = 0; side < 4; ++side) {
+        if (frustum_plane_box_distance(&f->sides[side][0], f->origin, box) > 0.f &&
+            frustum_plane_box_distance(&f->sides[side][1], f->origin, box) > 0.f) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void add_tile_candidate(tile_candidates* c, unsigned int index) {
+    if (c->items_length >= c->items_capacity) {
+        c->items_capacity = c->items_capacity ? c->items_capacity * 2 : 1024;
+        c->items = realloc(c->items, sizeof(unsigned int) * c->items_capacity);
+    }
+    c->items[c->items_length++] = index;
+}
+
+void gather_frustum_spheres(const scene* world, const tile_frustum* f, tile_candidates* c) {
+    if (!world->accel.nodes) {
+        for (unsigned int i = 0; i < world->spheres_length; ++i) {
+            if (!frustum_culls_sphere(f, world->spheres + i)) add_tile_candidate(c, i);
+        }
+        return;
+    }
+
+    // Cull whole subtrees of the BVH, then the spheres of the leaves left.
+    const bvh* tree = &world->accel;
+    unsigned int stack[BVH_STACK_SIZE];
+    unsigned int stack_length = 0;
+    stack[stack_length++] = 0;
+    while (stack_length > 0) {
+        const bvh_node* node = tree->nodes + stack[--stack_length];
+        if (frustum_culls_box(f, &node->bounds)) continue;
+
+        if (node->count) {
+            for (unsigned int i = 0; i < node->count; ++i) {
+                const unsigned int index = tree->indices[node->first + i];
+                if (!frustum_culls_sphere(f, world->spheres + index)) add_tile_candidate(c, index);
+            }
+        }
+        else {
+            stack[stack_length++] = node->first;
+            stack[stack_length++] = node->first + 1;
+        }
+    }
+
+    for (unsigned int i = 0; i < world->large_length; ++i) {
+        if (!frustum_culls_sphere(f, world->spheres + world->large[i])) add_tile_candidate(c, world->large[i]);
+    }
+}
+
+tile_candidates build_tile_candidates(const scene* world, const camera* cam, const tile_set* tiles, int image_width,
+    int image_height, int origin_x, int origin_y) {
+    // Tiles are placed in the image at origin, like render_tile() does. Half a pixel of margin
+    // covers rounding.
+    tile_candidates c = {
+        .first = malloc(sizeof(unsigned int) * tiles->length),
+        .count = malloc(sizeof(unsigned int) * tiles->length),
+        .listed = malloc(sizeof(bool) * tiles->length),
+        .tile_count = tiles->length
+    };
+    const bool linear = scene_traces_linearly(world);
+    const float du = 1.f / ((float) image_width - 1.f), dv = 1.f / ((float) image_height - 1.f);
+
+    for (unsigned int i = 0; i < tiles->length; ++i) {
+        const tile* t = tiles->tiles + i;
+        const float s0 = ((float) (origin_x + t->x0) - 0.5f) * du;
+        const float s1 = ((float) (origin_x + t->x1) + 0.5f) * du;
+        const float t0 = ((float) (image_height - origin_y - t->y1) - 0.5f) * dv;
+        const float t1 = ((float) (image_height - origin_y - t->y0) + 0.5f) * dv;
+        const tile_frustum f = make_tile_frustum(cam, s0, s1, t0, t1);
+
+        const unsigned int first = c.items_length;
+        gather_frustum_spheres(world, &f, &c);
+        const unsigned int count = c.items_length - first;
+
+        // Testing every sphere is still cheaper than the plain loop over all of them.
+        const bool listed = linear || count <= FRUSTUM_CANDIDATE_LIMIT;
+        c.first[t->index] = first;
+        c.count[t->index] = listed ? count : 0;
+        c.listed[t->index] = listed;
+        if (!listed) c.items_length = first;
+    }
+    return c;
+}
+
+sphere_subset tile_sphere_subset(const tile_candidates* c, const tile* t) {
+    return (sphere_subset) { .indices = c->items + c->first[t->index], .length = c->count[t->index] };
+}
+
+void report_tile_candidates(const tile_candidates* c, const scene* world, double seconds) {
+    unsigned int listed = 0;
+    for (unsigned int t = 0; t < c->tile_count; ++t) {
+        listed += c->listed[t];
+    }
+    fprintf(stderr, "Frustum culling: %u of %u tiles listed, %.1f of %u spheres per listed tile, %.3f ms\n", listed,
+        c->tile_count, listed ? (double) c->items_length / listed : 0.0, world->spheres_length, seconds * 1e3);
+}
+
+void destroy_tile_candidates(tile_candidates* c) {
+    free(c->items);
+    free(c->listed);
+    free(c->count);
+    free(c->first);
+    *c = (tile_candidates) { 0 };
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "bvh.h"
+
+// Uniform grid over the spheres, walked cell by cell with a 3D-DDA. For spheres spread evenly
+// over a region, like the random scene's lattice, a cell holds a few spheres and finding the
+// next one costs a few additions instead of a descent through the hierarchy. The resolution
+// follows from the sphere count, about GRID_DENSITY cells per sphere with roughly cubic
+// cells. Spheres far larger than the typical one would cover most cells and stretch the
+// grid, the scene keeps them out of it, see classify_scene_spheres().
+
+#define GRID_DENSITY 2.f
+#define GRID_MAX_RESOLUTION 1024
+
+typedef struct uniform_grid {
+    aabb bounds;
+    int resolution[3];
+    hmm_v3 cell_size;
+    // Sphere indices of cell c are items[cell_start[c]] to items[cell_start[c + 1]].
+    unsigned int* cell_start;
+    unsigned int* items;
+    unsigned int item_count;
+} uniform_grid;
+
+unsigned int grid_cell_count(const uniform_grid* grid) {
+    return (unsigned int) grid->resolution[0] * grid->resolution[1] * grid->resolution[2];
+}
+
+int grid_cell_coordinate(const uniform_grid* grid, float value, int axis) {
+    const int cell = (int) floorf((value - grid->bounds.min.Elements[axis]) / grid->cell_size.Elements[axis]);
+    return HMM_Clamp(0, cell, grid->resolution[axis] - 1);
+}
+
+void grid_cell_range(const uniform_grid* grid, const sphere* s, int low[3], int high[3]) {
+    const aabb box = sphere_bounds(s);
+    for (int axis = 0; axis < 3; ++axis) {
+        low[axis] = grid_cell_coordinate(grid, box.min.Elements[axis], axis);
+        high[axis] = grid_cell_coordinate(grid, box.max.Elements[axis], axis);
+    }
+}
+
+uniform_grid build_grid(const sphere* spheres, const unsigned int* indices, unsigned int length) {
+    // Only the spheres listed in indices go into the cells.
+    uniform_grid grid = { .bounds = empty_aabb() };
+    if (length == 0) return grid;
+
+    for (unsigned int i = 0; i < length; ++i) {
+        grid.bounds = aabb_union(grid.bounds, sphere_bounds(spheres + indices[i]));
+    }
+
+    // Cubic cells, as many as GRID_DENSITY per sphere, and at least one along flat axes.
+    const hmm_v3 extent = HMM_SubtractVec3(grid.bounds.max, grid.bounds.min);
+    const float volume = fmaxf(extent.X, 1e-6f) * fmaxf(extent.Y, 1e-6f) * fmaxf(extent.Z, 1e-6f);
+    const float cells_per_unit = cbrtf(GRID_DENSITY * length / volume);
+    for (int axis = 0; axis < 3; ++axis) {
+        const int resolution = (int) (extent.Elements[axis] * cells_per_unit + 0.5f);
+        grid.resolution[axis] = HMM_Clamp(1, resolution, GRID_MAX_RESOLUTION);
+        grid.cell_size.Elements[axis] = fmaxf(extent.Elements[axis], 1e-6f) / grid.resolution[axis];
+    }
+
+    // Count the spheres overlapping each cell, turn the counts into offsets, then fill.
+    const unsigned int cells = grid_cell_count(&grid);
+    grid.cell_start = calloc(cells + 1, sizeof(unsigned int));
+    for (unsigned int i = 0; i < length; ++i) {
+        int low[3], high[3];
+        grid_cell_range(&grid, spheres + indices[i], low, high);
+        for (int z = low[2]; z <= high[2]; ++z) {
+            for (int y = low[1]; y <= high[1]; ++y) {
+                for (int x = low[0]; x <= high[0]; ++x) {
+                    ++grid.cell_start[((unsigned int) z * grid.resolution[1] + y) * grid.resolution[0] + x + 1];
+                }
+            }
+        }
+    }
+    for (unsigned int c = 0; c < cells; ++c) {
+        grid.cell_start[c + 1] += grid.cell_start[c];
+    }
+
+    grid.item_count = grid.cell_start[cells];
+    grid.items = malloc(sizeof(unsigned int) * (grid.item_count > 0 ? grid.item_count : 1));
+    unsigned int* fill = malloc(sizeof(unsigned int) * cells);
+    memcpy(fill, grid.cell_start, sizeof(unsigned int) * cells);
+    for (unsigned int i = 0; i < length; ++i) {
+        int low[3], high[3];
+        grid_cell_range(&grid, spheres + indices[i], low, high);
+        for (int z = low[2]; z <= high[2]; ++z) {
+            for (int y = low[1]; y <= high[1]; ++y) {
+                for (int x = low[0]; x <= high[0]; ++x) {
+                    grid.items[fill[((unsigned int) z * grid.resolution[1] + y) * grid.resolution[0] + x]++] = indices[i];
+                }
+            }
+        }
+    }
+
+    free(fill);
+    return grid;
+}
+
+uniform_grid copy_grid(const uniform_grid* grid) {
+    uniform_grid copy = *grid;
+    if (!grid->cell_start) return copy;
+
+    const unsigned int cells = grid_cell_count(grid);
+    copy.cell_start = malloc(sizeof(unsigned int) * (cells + 1));
+    copy.items = malloc(sizeof(unsigned int) * (grid->item_count > 0 ? grid->item_count : 1));
+    memcpy(copy.cell_start, grid->cell_start, sizeof(unsigned int) * (cells + 1));
+    memcpy(copy.items, grid->items, sizeof(unsigned int) * grid->item_count);
+    return copy;
+}
+
+void destroy_grid(uniform_grid* grid) {
+    free(grid->items);
+    free(grid->cell_start);
+    *grid = (uniform_grid) { 0 };
+}
+
+size_t grid_bytes(const uniform_grid* grid) {
+    if (!grid->cell_start) return 0;
+    return sizeof(unsigned int) * (grid_cell_count(grid) + 1 + grid->item_count);
+}
+
+bool grid_hit(const uniform_grid* grid, const sphere* spheres, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    if (!grid->cell_start) return false;
+
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+
+    const hmm_v3 inverse_direction = HMM_Vec3(1.f / r->direction.X, 1.f / r->direction.Y, 1.f / r->direction.Z);
+    const float entry = aabb_entry(&grid->bounds, r, inverse_direction, t_min, closest_so_far);
+    if (entry == INFINITY) return hit_anything;
+
+    // Start in the cell holding the entry point, then step into whichever neighbour the ray
+    // reaches first. next[axis] is the distance to the next cell boundary along that axis.
+    const point3 start = ray_at(r, entry);
+    int cell[3], step[3], stop[3];
+    float next[3], delta[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        const float direction = r->direction.Elements[axis];
+        cell[axis] = grid_cell_coordinate(grid, start.Elements[axis], axis);
+        const float cell_size = grid->cell_size.Elements[axis];
+        const float low = grid->bounds.min.Elements[axis] + cell[axis] * cell_size;
+
+        if (direction > 0.f) {
+            step[axis] = 1;
+            stop[axis] = grid->resolution[axis];
+            next[axis] = (low + cell_size - r->origin.Elements[axis]) * inverse_direction.Elements[axis];
+            delta[axis] = cell_size * inverse_direction.Elements[axis];
+        }
+        else if (direction < 0.f) {
+            step[axis] = -1;
+            stop[axis] = -1;
+            next[axis] = (low - r->origin.Elements[axis]) * inverse_direction.Elements[axis];
+            delta[axis] = -cell_size * inverse_direction.Elements[axis];
+        }
+        else {
+            step[axis] = 0;
+            stop[axis] = -1;
+            next[axis] = INFINITY;
+            delta[axis] = INFINITY;
+        }
+    }
+
+    for (;;) {
+        const unsigned int c = ((unsigned int) cell[2] * grid->resolution[1] + cell[1]) * grid->resolution[0] + cell[0];
+        for (unsigned int i = grid->cell_start[c]; i < grid->cell_start[c + 1]; ++i) {
+            if (intersect_sphere(spheres + grid->items[i], r, t_min, &closest_so_far)) {
+                hit_anything = true;
+                hit->primitive = grid->items[i];
+                if (any_hit) break;
+            }
+        }
+
+        const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        // Hits found so far may lie in later cells, but nothing in them can be closer.
+        if ((any_hit && hit_anything) || next[axis] > closest_so_far) break;
+
+        cell[axis] += step[axis];
+        if (cell[axis] == stop[axis]) break;
+        next[axis] += delta[axis];
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "math.h"
+#include "framebuffer.h"
+
+// Linear HDR output for compositing: uncompressed half-float scanline OpenEXR, or PFM with
+// 32-bit floats. The file is sized up front, mapped and encoded in place, so the whole image
+// goes out in a single write-back without an intermediate copy. Both formats are little
+// endian, the encoders assume a little endian host.
+
+typedef enum hdr_format {
+    HDR_FORMAT_EXR,
+    HDR_FORMAT_PFM
+} hdr_format;
+
+uint16_t float_to_half(float value) {
+    // Round to nearest even, overflow goes to infinity and NaNs stay NaNs.
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    const uint32_t magnitude = bits & 0x7fffffff;
+
+    if (magnitude >= 0x7f800000) {
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    }
+
+    if (magnitude >= 0x477ff000) {
+        return sign | 0x7c00;
+    }
+
+    if (magnitude < 0x38800000) {
+        // Subnormal half, the implicit one becomes explicit and is shifted into place.
+        if (magnitude < 0x33000000) return sign;
+        const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        const int shift = 126 - (int)(magnitude >> 23);
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        uint32_t half = mantissa >> shift;
+        if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+        return sign | (uint16_t) half;
+    }
+
+    uint32_t half = (magnitude - 0x38000000) >> 13;
+    const uint32_t rest = magnitude & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return sign | (uint16_t) half;
+}
+
+bool parse_hdr_format(const char* path, hdr_format* format) {
+    // Picked from the file extension.
+    const char* extension = strrchr(path, '.');
+    if (extension && strcmp(extension, ".exr") == 0) {
+        *format = HDR_FORMAT_EXR;
+        return true;
+    }
+    if (extension && strcmp(extension, ".pfm") == 0) {
+        *format = HDR_FORMAT_PFM;
+        return true;
+    }
+    return false;
+}
+
+uint8_t* exr_attribute(uint8_t* p, const char* name, const char* type, int32_t size, const void* value) {
+    const size_t name_length = strlen(name) + 1;
+    const size_t type_length = strlen(type) + 1;
+    memcpy(p, name, name_length);
+    p += name_length;
+    memcpy(p, type, type_length);
+    p += type_length;
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    memcpy(p, value, (size_t) size);
+    return p + size;
+}
+
+typedef struct hdr_image {
+    // Interleaved floats, rows from the top down. 3 channels are RGB, 1 channel is grey.
+    const float* pixels;
+    int width;
+    int height;
+    int channels;
+} hdr_image;
+
+size_t exr_header(uint8_t* out, const hdr_image* image) {
+    // Everything a reader requires for a single part scanline image. out needs 512 bytes.
+    uint8_t* p = out;
+    const uint32_t magic = 20000630;
+    const uint32_t version = 2;
+    memcpy(p, &magic, 4);
+    memcpy(p + 4, &version, 4);
+    p += 8;
+
+    // Channels are stored in alphabetical order, each one HALF (1) with 1x1 sampling.
+    const char* names = image->channels == 3 ? "BGR" : "Y";
+    uint8_t channels[3 * 18 + 1] = { 0 };
+    for (int c = 0; c < image->channels; ++c) {
+        uint8_t* channel = channels + c * 18;
+        const int32_t fields[4] = { 1, 0, 1, 1 };
+        channel[0] = (uint8_t) names[c];
+        memcpy(channel + 2, fields, sizeof(int32_t));
+        memcpy(channel + 10, fields + 2, 2 * sizeof(int32_t));
+    }
+
+    const int32_t window[4] = { 0, 0, image->width - 1, image->height - 1 };
+    const uint8_t no_compression = 0;
+    const uint8_t increasing_y = 0;
+    const float one = 1.f;
+    const float center[2] = { 0.f, 0.f };
+
+    p = exr_attribute(p, "channels", "chlist", image->channels * 18 + 1, channels);
+    p = exr_attribute(p, "compression", "compression", 1, &no_compression);
+    p = exr_attribute(p, "dataWindow", "box2i", sizeof(window), window);
+    p = exr_attribute(p, "displayWindow", "box2i", sizeof(window), window);
+    p = exr_attribute(p, "lineOrder", "lineOrder", 1, &increasing_y);
+    p = exr_attribute(p, "pixelAspectRatio", "float", sizeof(one), &one);
+    p = exr_attribute(p, "screenWindowCenter", "v2f", sizeof(center), center);
+    p = exr_attribute(p, "screenWindowWidth", "float", sizeof(one), &one);
+    *p++ = 0;
+
+    return (size_t)(p - out);
+}
+
+size_t exr_line_bytes(const hdr_image* image) {
+    // Scanline y and byte count, then one plane of halves per channel.
+    return 8 + (size_t) image->width * image->channels * sizeof(uint16_t);
+}
+
+void encode_exr(uint8_t* out, const uint8_t* header, size_t header_size, const hdr_image* image) {
+    memcpy(out, header, header_size);
+
+    const size_t line_bytes = exr_line_bytes(image);
+    const size_t row_floats = (size_t) image->width * image->channels;
+    uint8_t* offsets = out + header_size;
+    uint8_t* lines = offsets + (size_t) image->height * 8;
+
+    for (int y = 0; y < image->height; ++y) {
+        uint8_t* line = lines + (size_t) y * line_bytes;
+        const uint64_t offset = (uint64_t)(line - out);
+        const int32_t fields[2] = { y, (int32_t)(line_bytes - 8) };
+        memcpy(offsets + (size_t) y * 8, &offset, 8);
+        memcpy(line, fields, sizeof(fields));
+
+        // The header has no fixed length, so planes may be unaligned. RGB is stored as B, G, R.
+        uint8_t* planes = line + 8;
+        const float* row = image->pixels + (size_t) y * row_floats;
+        for (int x = 0; x < image->width; ++x) {
+            for (int c = 0; c < image->channels; ++c) {
+                const uint16_t half = float_to_half(row[(size_t) x * image->channels + image->channels - 1 - c]);
+                memcpy(planes + ((size_t) c * image->width + x) * sizeof(uint16_t), &half, sizeof(uint16_t));
+            }
+        }
+    }
+}
+
+size_t pfm_header(char* out, const hdr_image* image) {
+    // A negative scale marks little endian data. out needs 64 bytes.
+    return (size_t) snprintf(out, 64, "%s\n%i %i\n-1.0\n", image->channels == 3 ? "PF" : "Pf", image->width, image->height);
+}
+
+void encode_pfm(uint8_t* out, const char* header, size_t header_size, const hdr_image* image) {
+    // PFM rows run bottom-up.
+    memcpy(out, header, header_size);
+    const size_t row_floats = (size_t) image->width * image->channels;
+    for (int y = 0; y < image->height; ++y) {
+        memcpy(out + header_size + (size_t) y * row_floats * sizeof(float),
+            image->pixels + (size_t)(image->height - 1 - y) * row_floats, row_floats * sizeof(float));
+    }
+}
+
+bool write_hdr_image(const char* path, const hdr_image* image) {
+    hdr_format format;
+    if (!parse_hdr_format(path, &format)) {
+        fprintf(stderr, "Unknown HDR format for %s, expected .exr or .pfm\n", path);
+        return false;
+    }
+
+    uint8_t header[512];
+    size_t header_size, size;
+
+    if (format == HDR_FORMAT_EXR) {
+        header_size = exr_header(header, image);
+        size = header_size + (size_t) image->height * (8 + exr_line_bytes(image));
+    }
+    else {
+        header_size = pfm_header((char*) header, image);
+        size = header_size + sizeof(float) * image->channels * (size_t) image->width * image->height;
+    }
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t) size) != 0) {
+        fprintf(stderr, "Can't create %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    uint8_t* out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s\n", path);
+        close(fd);
+        return false;
+    }
+
+    if (format == HDR_FORMAT_EXR) {
+        encode_exr(out, header, header_size, image);
+    }
+    else {
+        encode_pfm(out, (const char*) header, header_size, image);
+    }
+
+    const bool written = munmap(out, size) == 0;
+    return close(fd) == 0 && written;
+}
+
+bool write_hdr_file(const char* path, const framebuffer* fb) {
+    const hdr_image image = { .pixels = (const float*) fb->pixels, .width = fb->width, .height = fb->height, .channels = 3 };
+    return write_hdr_image(path, &image);
+}
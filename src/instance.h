@@ -0,0 +1,270 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "bvh.h"
+
+// Two-level instancing. Geometry that repeats is stored once as a group of spheres with its
+// own bottom-level BVH in object space, and every placement of it is an instance holding
+// only an affine transform and the group's index. A top-level BVH over the instances' world
+// bounds finds the candidates, their rays are moved into object space and traced against
+// the group's BVH, so memory grows with the unique geometry and not with the instance count.
+
+typedef struct transform {
+    // Rows of a 3x4 affine matrix, the last column is the translation.
+    float m[3][4];
+} transform;
+
+typedef struct sphere_group {
+    sphere* spheres;
+    unsigned int length;
+    unsigned int capacity;
+    // Bottom level, in object space.
+    bvh blas;
+} sphere_group;
+
+typedef struct instance {
+    transform to_world;
+    transform to_object;
+    unsigned int group;
+    // Scene-wide material id of the group's first sphere in this placement.
+    unsigned int material_base;
+} instance;
+
+typedef struct instance_set {
+    sphere_group* groups;
+    unsigned int groups_length;
+    unsigned int groups_capacity;
+    instance* instances;
+    unsigned int instances_length;
+    unsigned int instances_capacity;
+    // Top level over the instances, built by build_instance_tlas().
+    bvh tlas;
+} instance_set;
+
+transform make_transform(hmm_v3 translation, float rotation_y, float scale) {
+    // Scale, then rotate around y, then translate.
+    const float c = cosf(rotation_y) * scale, s = sinf(rotation_y) * scale;
+    return (transform) { .m = {
+        { c, 0.f, s, translation.X },
+        { 0.f, scale, 0.f, translation.Y },
+        { -s, 0.f, c, translation.Z }
+    } };
+}
+
+transform invert_transform(const transform* t) {
+    // Inverse of the 3x3 part through its adjugate, the translation goes back through it.
+    const float (*m)[4] = t->m;
+    const float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    const float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    const float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    const float inv_det = 1.f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+    transform inv = { .m = {
+        { c00, m[0][2] * m[2][1] - m[0][1] * m[2][2], m[0][1] * m[1][2] - m[0][2] * m[1][1], 0.f },
+        { c01, m[0][0] * m[2][2] - m[0][2] * m[2][0], m[0][2] * m[1][0] - m[0][0] * m[1][2], 0.f },
+        { c02, m[0][1] * m[2][0] - m[0][0] * m[2][1], m[0][0] * m[1][1] - m[0][1] * m[1][0], 0.f }
+    } };
+
+    for (int row = 0; row < 3; ++row) {
+        for (int col = 0; col < 3; ++col) {
+            inv.m[row][col] *= inv_det;
+        }
+        inv.m[row][3] = -(inv.m[row][0] * m[0][3] + inv.m[row][1] * m[1][3] + inv.m[row][2] * m[2][3]);
+    }
+
+    return inv;
+}
+
+hmm_v3 transform_vector(const transform* t, hmm_v3 v) {
+    return HMM_Vec3(
+        t->m[0][0] * v.X + t->m[0][1] * v.Y + t->m[0][2] * v.Z,
+        t->m[1][0] * v.X + t->m[1][1] * v.Y + t->m[1][2] * v.Z,
+        t->m[2][0] * v.X + t->m[2][1] * v.Y + t->m[2][2] * v.Z);
+}
+
+point3 transform_point(const transform* t, point3 p) {
+    const hmm_v3 v = transform_vector(t, p);
+    return HMM_Vec3(v.X + t->m[0][3], v.Y + t->m[1][3], v.Z + t->m[2][3]);
+}
+
+hmm_v3 transform_normal(const transform* to_object, hmm_v3 n) {
+    // Normals go through the transpose of the inverse.
+    const float (*m)[4] = to_object->m;
+    return HMM_Vec3(
+        m[0][0] * n.X + m[1][0] * n.Y + m[2][0] * n.Z,
+        m[0][1] * n.X + m[1][1] * n.Y + m[2][1] * n.Z,
+        m[0][2] * n.X + m[1][2] * n.Y + m[2][2] * n.Z);
+}
+
+aabb transform_bounds(const transform* t, aabb box) {
+    aabb bounds = empty_aabb();
+    for (int corner = 0; corner < 8; ++corner) {
+        const point3 p = HMM_Vec3(corner & 1 ? box.max.X : box.min.X, corner & 2 ? box.max.Y : box.min.Y,
+            corner & 4 ? box.max.Z : box.min.Z);
+        bounds = aabb_extend(bounds, transform_point(t, p));
+    }
+    return bounds;
+}
+
+unsigned int add_sphere_group(instance_set* set) {
+    if (set->groups_length >= set->groups_capacity) {
+        set->groups_capacity = set->groups_capacity ? set->groups_capacity * 2 : 4;
+        set->groups = realloc(set->groups, sizeof(sphere_group) * set->groups_capacity);
+    }
+
+    set->groups[set->groups_length] = (sphere_group) { 0 };
+    return set->groups_length++;
+}
+
+void add_group_sphere(sphere_group* group, const point3 center, const float radius, const material mat) {
+    if (group->length >= group->capacity) {
+        group->capacity = group->capacity ? group->capacity * 2 : 64;
+        group->spheres = realloc(group->spheres, sizeof(sphere) * group->capacity);
+    }
+
+    group->spheres[group->length] = (sphere) {
+        .center = center,
+        .radius = radius,
+        .material = mat
+    };
+    // Within the group, every instance offsets it by its material_base.
+    group->spheres[group->length].material.id = group->length;
+
+    ++group->length;
+}
+
+void build_group_blas(sphere_group* group) {
+    destroy_bvh(&group->blas);
+    aabb* bounds = create_sphere_bounds(group->spheres, group->length);
+    group->blas = build_bvh(bounds, group->length);
+    free(bounds);
+}
+
+void add_instance(instance_set* set, unsigned int group, const transform* to_world, unsigned int material_base) {
+    if (set->instances_length >= set->instances_capacity) {
+        set->instances_capacity = set->instances_capacity ? set->instances_capacity * 2 : 64;
+        set->instances = realloc(set->instances, sizeof(instance) * set->instances_capacity);
+    }
+
+    set->instances[set->instances_length++] = (instance) {
+        .to_world = *to_world,
+        .to_object = invert_transform(to_world),
+        .group = group,
+        .material_base = material_base
+    };
+}
+
+void build_instance_tlas(instance_set* set) {
+    // Every group's bottom level has to be built first, its root bounds place the instance.
+    const unsigned int capacity = HMM_MAX(set->instances_length, 1u);
+    aabb* bounds = malloc(sizeof(aabb) * capacity);
+    for (unsigned int i = 0; i < set->instances_length; ++i) {
+        const instance* inst = set->instances + i;
+        const bvh* blas = &set->groups[inst->group].blas;
+        bounds[i] = blas->node_count > 0 ? transform_bounds(&inst->to_world, blas->nodes[0].bounds) : empty_aabb();
+    }
+
+    destroy_bvh(&set->tlas);
+    set->tlas = build_bvh(bounds, set->instances_length);
+    free(bounds);
+}
+
+size_t instance_set_bytes(const instance_set* set) {
+    size_t bytes = sizeof(instance) * set->instances_length + bvh_bytes(&set->tlas);
+    for (unsigned int g = 0; g < set->groups_length; ++g) {
+        bytes += sizeof(sphere) * set->groups[g].length + bvh_bytes(&set->groups[g].blas);
+    }
+    return bytes;
+}
+
+size_t flattened_instance_bytes(const instance_set* set) {
+    // Estimate for the same scene with every instance's spheres copied into world space, each
+    // copy needing its own share of a single hierarchy as large as the group's.
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < set->instances_length; ++i) {
+        const sphere_group* group = set->groups + set->instances[i].group;
+        bytes += sizeof(sphere) * group->length + bvh_bytes(&group->blas);
+    }
+    return bytes;
+}
+
+instance_set copy_instance_set(const instance_set* set) {
+    const unsigned int groups_capacity = HMM_MAX(set->groups_length, 1u);
+    const unsigned int instances_capacity = HMM_MAX(set->instances_length, 1u);
+    instance_set copy = {
+        .groups = malloc(sizeof(sphere_group) * groups_capacity),
+        .groups_length = set->groups_length,
+        .groups_capacity = groups_capacity,
+        .instances = malloc(sizeof(instance) * instances_capacity),
+        .instances_length = set->instances_length,
+        .instances_capacity = instances_capacity
+    };
+
+    for (unsigned int g = 0; g < set->groups_length; ++g) {
+        const sphere_group* group = set->groups + g;
+        const unsigned int capacity = HMM_MAX(group->length, 1u);
+        copy.groups[g] = (sphere_group) {
+            .spheres = malloc(sizeof(sphere) * capacity),
+            .length = group->length,
+            .capacity = capacity,
+            .blas = copy_bvh(&group->blas)
+        };
+        memcpy(copy.groups[g].spheres, group->spheres, sizeof(sphere) * group->length);
+    }
+
+    memcpy(copy.instances, set->instances, sizeof(instance) * set->instances_length);
+    copy.tlas = copy_bvh(&set->tlas);
+    return copy;
+}
+
+void destroy_instance_set(instance_set* set) {
+    for (unsigned int g = 0; g < set->groups_length; ++g) {
+        destroy_bvh(&set->groups[g].blas);
+        free(set->groups[g].spheres);
+    }
+    destroy_bvh(&set->tlas);
+    free(set->instances);
+    free(set->groups);
+    *set = (instance_set) { 0 };
+}
+
+ray object_space_ray(const instance* inst, const ray* r) {
+    // The direction isn't normalized after the transform, so t means the same in both spaces.
+    return (ray) {
+        .origin = transform_point(&inst->to_object, r->origin),
+        .direction = transform_vector(&inst->to_object, r->direction)
+    };
+}
+
+bool intersect_instance_at(const void* instances, unsigned int index, const ray* r, float t_min, ray_hit* hit) {
+    // The group's sphere goes into part.
+    const instance_set* set = instances;
+    const instance* inst = set->instances + index;
+    const sphere_group* group = set->groups + inst->group;
+    const ray local = object_space_ray(inst, r);
+
+    ray_hit local_hit = { .t = hit->t };
+    if (!bvh_hit(&group->blas, group->spheres, &local, t_min, false, &local_hit)) return false;
+
+    *hit = (ray_hit) { .t = local_hit.t, .primitive = index, .part = local_hit.primitive };
+    return true;
+}
+
+void fill_instance_record(hit_record* rec, const ray* r, const instance_set* set, const ray_hit* hit) {
+    const instance* inst = set->instances + hit->primitive;
+    const ray local = object_space_ray(inst, r);
+    fill_hit_record(rec, hit->t, &local, set->groups[inst->group].spheres + hit->part);
+    rec->material.id += inst->material_base;
+
+    // The facing test survives the transform, the normal only needs to be brought back.
+    rec->point = ray_at(r, rec->t);
+    rec->normal = HMM_NormalizeVec3(transform_normal(&inst->to_object, rec->normal));
+}
+
+bool hit_instances(const instance_set* set, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    return bvh_traverse(&set->tlas, set, intersect_instance_at, r, t_min, any_hit, hit);
+}
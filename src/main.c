@@ -1,160 +1,1096 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 #include "math.h"
 #include "sphere.h"
+#include "scene.h"
 #include "ray.h"
 #include "camera.h"
 #include "color.h"
+#include "framebuffer.h"
+#include "tile.h"
+#include "perf.h"
+#include "render.h"
+#include "hdr.h"
+#include "band.h"
+#include "denoise.h"
+#include "batch.h"
+#include "animation.h"
+#include "distributed.h"
+#include "daemon.h"
 
-#define MAX_SPHERES 2000
+#define RANDOM_SCENE_SIZE 11
 
-struct {
-    camera cam;
-    sphere spheres[MAX_SPHERES];
-    unsigned int spheres_length;
-} state;
+void generate_random_scene(scene* world, int size, bool ground_plane) {
 
-bool hit_spheres(const ray* r, float t_min, float t_max, hit_record* rec) {
-    bool hit_anything = false;
-    float closest_so_far = t_max;
+    const material ground_material = mat_lambertian(HMM_Vec3(0.5f, 0.5f, 0.5f));
+    if (ground_plane) {
+        add_plane(world, HMM_Vec3(0.f, 0.f, 0.f), HMM_Vec3(0.f, 1.f, 0.f), ground_material);
+    }
+    else {
+        add_sphere(world, HMM_Vec3(0.f,-1000.f,0.f), 1000.f, ground_material);
+    }
+
+    for (int a = -size; a < size; a++) {
+        for (int b = -size; b < size; b++) {
+            const float choose_mat = random_float();
+            const point3 center = HMM_Vec3(a + 0.9f * random_float(), 0.2f, b + 0.9f * random_float());
+            const hmm_v3 distance = HMM_SubtractVec3(center, HMM_Vec3(4.f, 0.2f, 0.f));
+
+
+            if (HMM_LengthVec3(distance) > 0.9f) {
 
-    for (size_t i = 0; i < state.spheres_length; ++i) {
-        if (hit_sphere(state.spheres + i, r, t_min, closest_so_far, rec)) {
-            hit_anything = true;
-            closest_so_far = rec->t;
+                if (choose_mat < 0.8f) {
+                    // diffuse
+                    const color albedo = HMM_MultiplyVec3(random_v3(), random_v3());
+                    add_sphere(world, center, 0.2f, mat_lambertian(albedo));
+                } 
+                else if (choose_mat < 0.95f) {
+                    // metal
+                    const color albedo = random_v3_interval(0.5f, 1.f);
+                    const float fuzz = random_float_interval(0.f, 0.5f);
+                    add_sphere(world, center, 0.2f, mat_metal(albedo, fuzz));
+                } 
+                else {
+                    // glass
+                    add_sphere(world, center, 0.2f, mat_dielectric(1.5f));
+                }
+            }
+        }
+    }
+
+    add_sphere(world, HMM_Vec3(0.f, 1.f, 0.f), 1.0f, mat_dielectric(1.5f));
+    add_sphere(world, HMM_Vec3(-4.f, 1.f, 0.f), 1.0f, mat_lambertian(HMM_Vec3(.4f, .2f, .1f)));
+    add_sphere(world, HMM_Vec3(4.f, 1.f, 0.f), 1.0f, mat_metal(HMM_Vec3(.7f, .6f, .5f), 0.f));
+}
+
+void generate_clustered_scene(scene* world, int size) {
+    // As many small spheres as the lattice of the random scene, but nine in ten of them packed
+    // into six dense clusters and the rest strewn through the air over the same floor. Cell
+    // occupancy varies by orders of magnitude, the case uniform grids handle worst. No two
+    // spheres touch and none are small or far enough for the intersection test to lose precision,
+    // so every structure finds the same closest hits.
+    add_sphere(world, HMM_Vec3(0.f, -1000.f, 0.f), 1000.f, mat_lambertian(HMM_Vec3(0.5f, 0.5f, 0.5f)));
+
+    const int count = 4 * size * size;
+    const int clustered = count * 9 / 10;
+    // Clusters are cubes of cells half a unit wide, one jittered sphere per cell, spaced
+    // around the big spheres in the middle.
+    const int per_cluster = (clustered + 5) / 6;
+    const int side = (int) ceilf(cbrtf((float) per_cluster));
+    const float ring = 0.6f * size + 6.f;
+
+    for (int i = 0; i < count; ++i) {
+        point3 center;
+        float radius;
+        if (i < clustered) {
+            const int cluster = i / per_cluster, cell = i % per_cluster;
+            const float angle = (cluster + 0.5f) * 1.0471976f;
+            radius = random_float_interval(0.1f, 0.2f);
+            const float jitter = 0.5f - 2.f * radius;
+            center = HMM_Vec3(ring * cosf(angle) + (cell % side) * 0.5f + radius + jitter * random_float(),
+                0.5f + (cell / side % side) * 0.5f + radius + jitter * random_float(),
+                ring * sinf(angle) + (cell / (side * side)) * 0.5f + radius + jitter * random_float());
+        }
+        else {
+            radius = 0.2f;
+            center = HMM_Vec3(random_float_interval((float) -size, (float) size), random_float_interval(0.5f, 0.25f * size + 1.f),
+                random_float_interval((float) -size, (float) size));
+        }
+
+        if (random_float() < 0.8f) {
+            add_sphere(world, center, radius, mat_lambertian(HMM_MultiplyVec3(random_v3(), random_v3())));
+        }
+        else {
+            add_sphere(world, center, radius, mat_metal(random_v3_interval(0.5f, 1.f), random_float_interval(0.f, 0.5f)));
         }
     }
 
-    return hit_anything;
+    add_sphere(world, HMM_Vec3(0.f, 1.f, 0.f), 1.0f, mat_dielectric(1.5f));
+    add_sphere(world, HMM_Vec3(-4.f, 1.f, 0.f), 1.0f, mat_lambertian(HMM_Vec3(.4f, .2f, .1f)));
+    add_sphere(world, HMM_Vec3(4.f, 1.f, 0.f), 1.0f, mat_metal(HMM_Vec3(.7f, .6f, .5f), 0.f));
 }
 
-color ray_color(const ray* r, int depth) {
+void animate_random_scene(scene* world, const sphere* rest, unsigned int frame, float time) {
+    // The small spheres bounce and circle the origin, each at its own pace, the big ones stay.
+    (void) frame;
+    for (unsigned int i = 0; i < world->spheres_length; ++i) {
+        if (rest[i].radius > 0.5f) continue;
+
+        const float phase = (float)(hash_u32(i) & 0xffff) / 65536.f;
+        const float angle = time * (0.2f + 0.6f * phase);
+        const float bounce = fabsf(sinf(6.2831853f * (1.5f * time + phase)));
+        const float c = cosf(angle), s = sinf(angle);
 
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0) {
-        return HMM_Vec3(0.f, 0.f, 0.f);
+        world->spheres[i].center = HMM_Vec3(c * rest[i].center.X + s * rest[i].center.Z, rest[i].center.Y + 0.6f * bounce,
+            -s * rest[i].center.X + c * rest[i].center.Z);
     }
+}
 
-    hit_record hit_r;
+void build_instanced_scene(scene* world, unsigned int count) {
+    // One cluster of small spheres stored once and placed count times on a grid around the
+    // origin, each copy turned and scaled differently.
+    add_sphere(world, HMM_Vec3(0.f, -1000.f, 0.f), 1000.f, mat_lambertian(HMM_Vec3(0.5f, 0.5f, 0.5f)));
+    build_scene_bvh(world);
 
-    if (hit_spheres(r, 0.001f, INFINITY, &hit_r)) {
-        ray scattered;
-        color attenuation;
-        
-        if (scatter_ray(&hit_r.material, r, &hit_r, &attenuation, &scattered)) {
-            return HMM_MultiplyVec3(attenuation, ray_color(&scattered, depth - 1));
+    instance_set* set = &world->instanced;
+    double start = now_seconds();
+    const unsigned int group = add_sphere_group(set);
+    sphere_group* cluster = set->groups + group;
+    for (int i = 0; i < 48; ++i) {
+        const float radius = random_float_interval(0.08f, 0.25f);
+        const point3 center = HMM_Vec3(random_float_interval(-1.f, 1.f), radius, random_float_interval(-1.f, 1.f));
+        const float choose_mat = random_float();
+        if (choose_mat < 0.7f) {
+            add_group_sphere(cluster, center, radius, mat_lambertian(HMM_MultiplyVec3(random_v3(), random_v3())));
+        }
+        else if (choose_mat < 0.9f) {
+            add_group_sphere(cluster, center, radius, mat_metal(random_v3_interval(0.5f, 1.f), random_float_interval(0.f, 0.3f)));
         }
+        else {
+            add_group_sphere(cluster, center, radius, mat_dielectric(1.5f));
+        }
+    }
+    build_group_blas(cluster);
+    const double blas_seconds = now_seconds() - start;
+
+    const int side = (int) ceilf(sqrtf((float) count));
+    for (unsigned int i = 0; i < count; ++i) {
+        const hmm_v3 position = HMM_Vec3(((int) i % side - side / 2) * 2.5f, 0.f, ((int) i / side - side / 2) * 2.5f);
+        const transform to_world = make_transform(position, random_float_interval(0.f, 6.2831853f),
+            random_float_interval(0.7f, 1.3f));
+        add_scene_instance(world, group, &to_world);
+    }
+
+    start = now_seconds();
+    build_instance_tlas(set);
+    const double tlas_seconds = now_seconds() - start;
+
+    fprintf(stderr, "%u instances of %u spheres, %u placed: %.2f MB stored, %.2f MB flattened, BLAS %.3f ms, TLAS %.3f ms\n",
+        count, cluster->length, count * cluster->length, instance_set_bytes(set) / 1e6, flattened_instance_bytes(set) / 1e6,
+        blas_seconds * 1e3, tlas_seconds * 1e3);
+}
+
+void run_order_benchmark(const render_options* options, const scene* world, const int image_height) {
+    // Render the same image once per tile/pixel order combination and compare cache behaviour.
+    perf_counters counters = perf_open();
+    const double samples = (double) options->image_width * image_height * options->samples_per_pixel;
+
+    fprintf(stderr, "%-10s %-10s %10s %10s", "tiles", "pixels", "seconds", "Msamples/s");
+    for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+        fprintf(stderr, " %14s", perf_counter_names[c]);
+    }
+    fprintf(stderr, "\n");
+
+    for (int order = 0; order < TILE_ORDER_COUNT; ++order) {
+        for (int pixel_order = 0; pixel_order < TILE_ORDER_COUNT; ++pixel_order) {
+            render_options run = *options;
+            run.order = (tile_order) order;
+            run.pixel_order = (tile_order) pixel_order;
+            framebuffer fb = create_framebuffer(options->image_width, image_height);
+
+            perf_start(&counters);
+            const double start = now_seconds();
+            render(&run, world, &fb, false);
+            const double elapsed = now_seconds() - start;
+            perf_stop(&counters);
+
+            fprintf(stderr, "%-10s %-10s %10.3f %10.3f", tile_order_names[order], tile_order_names[pixel_order],
+                elapsed, samples / elapsed * 1e-6);
+            for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+                if (perf_available(&counters, (perf_counter) c)) {
+                    fprintf(stderr, " %14llu", (unsigned long long) counters.values[c]);
+                }
+                else {
+                    fprintf(stderr, " %14s", "n/a");
+                }
+            }
+            fprintf(stderr, "\n");
+
+            destroy_framebuffer(&fb);
+        }
+    }
+
+    perf_close(&counters);
+}
+
+void report_grid(const uniform_grid* grid) {
+    unsigned int occupied = 0;
+    for (unsigned int c = 0; c < grid_cell_count(grid); ++c) {
+        occupied += grid->cell_start[c + 1] > grid->cell_start[c];
+    }
+    fprintf(stderr, "  grid %ix%ix%i, %u of %u cells occupied, %u references\n",
+        grid->resolution[0], grid->resolution[1], grid->resolution[2], occupied, grid_cell_count(grid), grid->item_count);
+}
+
+bool build_described_scene(const scene_descriptor* description, scene* world) {
+    // Builds into an empty world, which is left empty if the scene can't be built.
+    if (description->size < 0 || description->accel < 0 || description->accel >= SCENE_ACCEL_COUNT) {
+        fprintf(stderr, "Invalid scene description\n");
+        return false;
+    }
 
-        return HMM_Vec3(0.f, 0.f, 0.f);
+    random_seed(description->seed);
+    if (description->instances > 0) {
+        build_instanced_scene(world, description->instances);
+    }
+    else {
+        generate_random_scene(world, description->size, description->ground_plane);
+        select_scene_accel(world, (scene_accel) description->accel);
+        if (description->accel == SCENE_ACCEL_GRID) {
+            report_grid(&world->grid);
+        }
     }
 
-    hmm_v3 unit_direction = HMM_NormalizeVec3(r->direction);
-    const float t = 0.5f * (unit_direction.Y + 1.f);
-    color color0 = HMM_MultiplyVec3f(HMM_Vec3(1.f, 1.f, 1.f), (1.f - t));
-    color color1 = HMM_MultiplyVec3f(HMM_Vec3(0.5f, 0.7f, 1.f), t);
-    return HMM_AddVec3(color0, color1);
+    if (description->mesh[0]) {
+        mesh m;
+        if (!load_obj(description->mesh, mat_metal(HMM_Vec3(0.8f, 0.6f, 0.3f), 0.1f), &m)) {
+            destroy_scene(world);
+            return false;
+        }
+        add_mesh(world, &m);
+    }
+    return true;
 }
 
+bool select_kernels(cpu_isa requested) {
+    // Points every kernel at its best variant up to requested, or up to what the CPU supports
+    // for CPU_ISA_COUNT, and logs the choice.
+    const cpu_isa supported = detect_cpu_isa();
+    if (requested != CPU_ISA_COUNT && requested > supported) {
+        fprintf(stderr, "This CPU supports %s kernels at most, not %s\n", cpu_isa_names[supported],
+            cpu_isa_names[requested]);
+        return false;
+    }
 
+    const cpu_isa isa = requested == CPU_ISA_COUNT ? supported : requested;
+    const cpu_isa intersection = select_sphere_lanes_kernel(isa);
+    const cpu_isa resolve = select_resolve_kernel(isa);
+    const cpu_isa tonemap = select_tonemap_kernel(isa);
+    fprintf(stderr, "CPU supports %s, kernels%s%s%s: intersection %s, resolve %s, tonemap %s\n",
+        cpu_isa_names[supported], requested == CPU_ISA_COUNT ? "" : " (--isa ", requested == CPU_ISA_COUNT ? "" :
+        cpu_isa_names[requested], requested == CPU_ISA_COUNT ? "" : ")", cpu_isa_names[intersection],
+        cpu_isa_names[resolve], cpu_isa_names[tonemap]);
+    return true;
+}
+
+// Testing every sphere takes minutes beyond this.
+#define ACCEL_BENCH_LINEAR_LIMIT 10000u
 
-void add_sphere(const point3 center, const float radius, const material mat) {
-    if (state.spheres_length >= MAX_SPHERES) {
-        return;
+void run_accel_benchmark(const render_options* options, scene* world, const int image_height) {
+    // Render the same image with every acceleration structure, the images should match.
+    perf_counters counters = perf_open();
+    const double samples = (double) options->image_width * image_height * options->samples_per_pixel;
+    framebuffer reference = { 0 };
+
+    fprintf(stderr, "%u spheres, %u planes, spheres outside the structures: ", world->spheres_length, world->planes_length);
+    classify_scene_spheres(world);
+    for (unsigned int i = 0; i < world->large_length; ++i) {
+        fprintf(stderr, "%s%u (radius %g)", i ? ", " : "", world->large[i], world->spheres[world->large[i]].radius);
     }
+    fprintf(stderr, world->large_length ? "\n" : "none\n");
 
-    state.spheres[state.spheres_length] = (sphere) {
-        .center = center,
-        .radius = radius,
-        .material = mat
+    fprintf(stderr, "%-10s %10s %10s %8s %10s %10s %6s", "accel", "build ms", "MB", "B/sphere", "seconds", "Msamples/s",
+        "image");
+    for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+        fprintf(stderr, " %14s", perf_counter_names[c]);
+    }
+    fprintf(stderr, "\n");
+
+    for (int accel = 0; accel < SCENE_ACCEL_COUNT; ++accel) {
+        if (accel == SCENE_ACCEL_LINEAR && world->spheres_length > ACCEL_BENCH_LINEAR_LIMIT) {
+            fprintf(stderr, "%-10s skipped, more than %u spheres\n", scene_accel_names[accel], ACCEL_BENCH_LINEAR_LIMIT);
+            continue;
+        }
+
+        double start = now_seconds();
+        destroy_bvh(&world->accel);
+        select_scene_accel(world, (scene_accel) accel);
+        const double build = now_seconds() - start;
+        // Only the structure traversed, derived layouts keep the binary BVH around for refitting.
+        const size_t bytes = accel == SCENE_ACCEL_BVH ? bvh_bytes(&world->accel) :
+            wide_bvh_bytes(&world->wide) + compressed_bvh_bytes(&world->compressed) + grid_bytes(&world->grid);
+
+        framebuffer fb = create_framebuffer(options->image_width, image_height);
+        perf_start(&counters);
+        start = now_seconds();
+        render(options, world, &fb, false);
+        const double elapsed = now_seconds() - start;
+        perf_stop(&counters);
+
+        // Pixels that differ from the binary BVH's image. Grazing rays at a distance many times the
+        // radius can hit a sphere by rounding alone, and only some structures test it at all.
+        unsigned int differing = 0;
+        for (size_t i = 0; reference.pixels && i < (size_t) fb.width * fb.height; ++i) {
+            differing += memcmp(fb.pixels + i, reference.pixels + i, sizeof(color)) != 0;
+        }
+        char image[16] = "same";
+        if (differing) {
+            snprintf(image, sizeof(image), "%u px", differing);
+        }
+        fprintf(stderr, "%-10s %10.3f %10.3f %8.1f %10.3f %10.3f %6s", scene_accel_names[accel], build * 1e3, bytes / 1e6,
+            (double) bytes / world->spheres_length, elapsed, samples / elapsed * 1e-6, image);
+        for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+            if (perf_available(&counters, (perf_counter) c)) {
+                fprintf(stderr, " %14llu", (unsigned long long) counters.values[c]);
+            }
+            else {
+                fprintf(stderr, " %14s", "n/a");
+            }
+        }
+        fprintf(stderr, "\n");
+        if (accel == SCENE_ACCEL_GRID) {
+            report_grid(&world->grid);
+        }
+
+        if (reference.pixels) {
+            destroy_framebuffer(&fb);
+        }
+        else {
+            reference = fb;
+        }
+    }
+
+    destroy_framebuffer(&reference);
+    perf_close(&counters);
+}
+
+#define KERNEL_CHECK_RAYS 32768u
+
+typedef struct kernel_check_variant {
+    cpu_isa isa;
+    sphere_lanes_fn intersect;
+} kernel_check_variant;
+
+unsigned int check_sphere_lanes_kernel(sphere_lanes_fn intersect, const scene* world, const sphere_lanes* lanes,
+    const ray* rays, const float* t_max, bool any_hit, double* seconds) {
+    // Returns the rays whose hit differs from intersect_sphere() over every sphere. A closest hit
+    // must be the same sphere at the same distance, an any hit a sphere that is hit at its distance.
+    const float t_min = 0.001f;
+    ray_hit* hits = malloc(sizeof(ray_hit) * KERNEL_CHECK_RAYS);
+    bool* found = malloc(sizeof(bool) * KERNEL_CHECK_RAYS);
+
+    const double start = now_seconds();
+    for (unsigned int i = 0; i < KERNEL_CHECK_RAYS; ++i) {
+        hits[i] = (ray_hit) { .t = t_max[i] };
+        found[i] = intersect(lanes, rays + i, t_min, any_hit, hits + i);
+    }
+    *seconds = now_seconds() - start;
+
+    unsigned int mismatches = 0;
+    for (unsigned int i = 0; i < KERNEL_CHECK_RAYS; ++i) {
+        float t = t_max[i];
+        unsigned int primitive = 0;
+        bool expected = false;
+        for (unsigned int s = 0; s < world->spheres_length; ++s) {
+            if (intersect_sphere(world->spheres + s, rays + i, t_min, &t)) {
+                primitive = s;
+                expected = true;
+            }
+        }
+
+        if (found[i] != expected) {
+            ++mismatches;
+        }
+        else if (found[i] && !any_hit) {
+            mismatches += hits[i].primitive != primitive || hits[i].t != t;
+        }
+        else if (found[i]) {
+            t = t_max[i];
+            mismatches += hits[i].primitive >= world->spheres_length ||
+                !intersect_sphere(world->spheres + hits[i].primitive, rays + i, t_min, &t) || hits[i].t != t;
+        }
+    }
+
+    free(found);
+    free(hits);
+    return mismatches;
+}
+
+int run_kernel_check(const render_options* options, const scene* world) {
+    // Every sphere lane kernel the CPU runs against intersect_sphere(), on rays from above the
+    // scene towards its spheres, with a finite and an infinite t_max.
+    const cpu_isa supported = detect_cpu_isa();
+    kernel_check_variant variants[] = {
+        { CPU_ISA_SCALAR, intersect_sphere_lanes_scalar },
+#ifdef CPU_X86
+        { CPU_ISA_SSE4, intersect_sphere_lanes_sse4 },
+        { CPU_ISA_AVX2, intersect_sphere_lanes_avx2 },
+        { CPU_ISA_AVX512, intersect_sphere_lanes_avx512 },
+#endif
     };
 
-    ++state.spheres_length;
+    ray* rays = malloc(sizeof(ray) * KERNEL_CHECK_RAYS);
+    float* finite = malloc(sizeof(float) * KERNEL_CHECK_RAYS);
+    float* infinite = malloc(sizeof(float) * KERNEL_CHECK_RAYS);
+    random_seed(options->scene_seed);
+    for (unsigned int i = 0; i < KERNEL_CHECK_RAYS; ++i) {
+        // Aimed close to a sphere's surface, so plenty of rays hit, miss or graze it. The
+        // direction isn't normalized, t = 1 is the aim point and the finite t_max lies around it.
+        const sphere* target = world->spheres + (random_u32() % world->spheres_length);
+        const point3 aim = HMM_AddVec3(target->center, HMM_MultiplyVec3f(random_unit_vector(), target->radius * 1.1f));
+        const point3 origin = HMM_Vec3(random_float_interval(-15.f, 15.f), random_float_interval(0.2f, 4.f),
+            random_float_interval(-15.f, 15.f));
+        rays[i] = (ray) { .origin = origin, .direction = HMM_SubtractVec3(aim, origin) };
+        finite[i] = random_float_interval(0.2f, 1.5f);
+        infinite[i] = INFINITY;
+    }
+
+    sphere_lanes lanes = create_sphere_lanes(world->spheres, world->spheres_length);
+    fprintf(stderr, "%u rays against %u spheres, rays differing from intersect_sphere():\n", KERNEL_CHECK_RAYS,
+        world->spheres_length);
+    fprintf(stderr, "%-8s %10s %11s %10s %10s %15s %15s\n", "kernel", "closest", "closest inf", "any", "any inf",
+        "closest Mrays/s", "any Mrays/s");
+
+    unsigned int failed = 0;
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+        if (variants[v].isa > supported) {
+            fprintf(stderr, "%-8s skipped, not supported by this CPU\n", cpu_isa_names[variants[v].isa]);
+            continue;
+        }
+
+        double closest_seconds, any_seconds, seconds;
+        const sphere_lanes_fn intersect = variants[v].intersect;
+        const unsigned int closest = check_sphere_lanes_kernel(intersect, world, &lanes, rays, finite, false, &seconds);
+        const unsigned int closest_inf =
+            check_sphere_lanes_kernel(intersect, world, &lanes, rays, infinite, false, &closest_seconds);
+        const unsigned int any = check_sphere_lanes_kernel(intersect, world, &lanes, rays, finite, true, &seconds);
+        const unsigned int any_inf = check_sphere_lanes_kernel(intersect, world, &lanes, rays, infinite, true, &any_seconds);
+        failed += closest + closest_inf + any + any_inf;
+
+        fprintf(stderr, "%-8s %10u %11u %10u %10u %15.3f %15.3f\n", cpu_isa_names[variants[v].isa], closest, closest_inf,
+            any, any_inf, KERNEL_CHECK_RAYS / closest_seconds * 1e-6, KERNEL_CHECK_RAYS / any_seconds * 1e-6);
+    }
+
+    destroy_sphere_lanes(&lanes);
+    free(infinite);
+    free(finite);
+    free(rays);
+    return failed ? 1 : 0;
 }
 
-void generate_random_scene() {
+accum_header describe_accum(const render_options* options) {
+    accum_header header = {
+        .width = options->image_width,
+        .height = options->image_height,
+        .max_depth = options->max_depth,
+        .aspect_ratio = options->aspect_ratio,
+        .view = options->view,
+        .scene = describe_scene(options)
+    };
+    memcpy(header.magic, ACCUM_MAGIC, 8);
+    return header;
+}
 
-    const material ground_material = mat_lambertian(HMM_Vec3(0.5f, 0.5f, 0.5f));
-    add_sphere(HMM_Vec3(0.f,-1000.f,0.f), 1000.f, ground_material);
+int render_accum_file(const render_options* options, const scene* world, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return 1;
+    }
 
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            const float choose_mat = random_float();
-            const point3 center = HMM_Vec3(a + 0.9f * random_float(), 0.2f, b + 0.9f * random_float());
-            const hmm_v3 distance = HMM_SubtractVec3(center, HMM_Vec3(4.f, 0.2f, 0.f));
+    accum_buffer accum = create_accum_buffer(options->image_width, options->image_height);
+    render_accum(options, world, &accum, true);
 
+    accum_header header = describe_accum(options);
+    header.sample_begin = (uint32_t) options->sample_begin;
+    header.sample_end = (uint32_t) render_sample_end(options);
 
-            if (HMM_LengthVec3(distance) > 0.9f) {
+    const bool written = write_accum_buffer(file, &accum, &header);
+    destroy_accum_buffer(&accum);
 
-                if (choose_mat < 0.8f) {
-                    // diffuse
-                    const color albedo = HMM_MultiplyVec3(random_v3(), random_v3());
-                    add_sphere(center, 0.2f, mat_lambertian(albedo));
-                } 
-                else if (choose_mat < 0.95f) {
-                    // metal
-                    const color albedo = random_v3_interval(0.5f, 1.f);
-                    const float fuzz = random_float_interval(0.f, 0.5f);
-                    add_sphere(center, 0.2f, mat_metal(albedo, fuzz));
-                } 
-                else {
-                    // glass
-                    add_sphere(center, 0.2f, mat_dielectric(1.5f));
-                }
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return 1;
+    }
+
+    fprintf(stderr, "\nWrote samples %u to %u to %s\n", header.sample_begin, header.sample_end, path);
+    return 0;
+}
+
+bool load_reference(const char* path, const render_options* options, framebuffer* reference) {
+    FILE* file = fopen(path, "rb");
+    accum_buffer accum;
+    accum_header header;
+
+    if (!file || !read_accum_buffer(file, &accum, &header)) {
+        fprintf(stderr, "Can't read reference %s\n", path);
+        if (file) fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    if (accum.width != options->image_width || accum.height != options->image_height) {
+        fprintf(stderr, "Reference %s is %ix%i, the image is %ix%i\n", path, accum.width, accum.height,
+            options->image_width, options->image_height);
+        destroy_accum_buffer(&accum);
+        return false;
+    }
+
+    const accum_header expected = describe_accum(options);
+    if (!same_accum_render(&header, &expected)) {
+        fprintf(stderr, "Reference %s was rendered with a different camera, depth or scene\n", path);
+        destroy_accum_buffer(&accum);
+        return false;
+    }
+
+    *reference = create_framebuffer(accum.width, accum.height);
+    resolve_accum_pixels(accum.pixels, reference->pixels, (size_t) accum.width * accum.height);
+
+    destroy_accum_buffer(&accum);
+    return true;
+}
+
+bool render_with_features(const render_options* options, const scene* world, framebuffer* fb) {
+    // Captures first-hit features while tracing, for denoising and AOV output.
+    feature_buffer features = create_feature_buffer(fb->width, fb->height);
+    render_features(options, world, fb, &features, true);
+
+    if (options->aov_out && !write_feature_buffers(options->aov_out, &features)) {
+        destroy_feature_buffer(&features);
+        return false;
+    }
+
+    if (!options->denoise) {
+        destroy_feature_buffer(&features);
+        return true;
+    }
+
+    framebuffer reference = { 0 };
+    const bool compare = options->reference && load_reference(options->reference, options, &reference);
+    const double noisy_rmse = compare ? framebuffer_rmse(fb, &reference) : 0.0;
+
+    const double start = now_seconds();
+    denoise_framebuffer(fb, &features, options->threads);
+    fprintf(stderr, "\nDenoised in %.3fs\n", now_seconds() - start);
+
+    if (compare) {
+        fprintf(stderr, "RMSE against %s: %.5f noisy, %.5f denoised\n", options->reference, noisy_rmse,
+            framebuffer_rmse(fb, &reference));
+    }
+
+    destroy_framebuffer(&reference);
+    destroy_feature_buffer(&features);
+    return true;
+}
+
+bool render_budgeted(const render_options* options, const scene* world, framebuffer* fb) {
+    accum_buffer accum = create_accum_buffer(fb->width, fb->height);
+    const double start = now_seconds();
+    const unsigned int passes = render_time_budget(options, world, &accum, options->time_budget);
+    const double elapsed = now_seconds() - start;
+
+    uint32_t min_spp = UINT32_MAX, max_spp = 0;
+    uint64_t total_spp = 0;
+    float* spp_map = options->spp_map ? malloc(sizeof(float) * (size_t) fb->width * fb->height) : NULL;
+
+    resolve_accum_pixels(accum.pixels, fb->pixels, (size_t) fb->width * fb->height);
+    for (size_t p = 0; p < (size_t) fb->width * fb->height; ++p) {
+        const uint32_t spp = accum.pixels[p].samples;
+        min_spp = HMM_MIN(min_spp, spp);
+        max_spp = HMM_MAX(max_spp, spp);
+        total_spp += spp;
+        if (spp_map) spp_map[p] = (float) spp;
+    }
+
+    fprintf(stderr, "%u passes in %.3fs of a %.3fs budget, spp min %u, mean %.2f, max %u\n", passes, elapsed,
+        options->time_budget, min_spp, (double) total_spp / ((double) fb->width * fb->height), max_spp);
+
+    bool written = true;
+    if (spp_map) {
+        const hdr_image image = { .pixels = spp_map, .width = fb->width, .height = fb->height, .channels = 1 };
+        written = write_hdr_image(options->spp_map, &image);
+    }
+
+    free(spp_map);
+    destroy_accum_buffer(&accum);
+    return written;
+}
+
+bool parse_v3(const char* value, hmm_v3* v) {
+    if (sscanf(value, "%f,%f,%f", &v->X, &v->Y, &v->Z) != 3) {
+        fprintf(stderr, "Expected x,y,z instead of %s\n", value);
+        return false;
+    }
+    return true;
+}
+
+bool parse_options(int argc, char** argv, render_options* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--bench") == 0) {
+            options->bench = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--accel-bench") == 0) {
+            options->accel_bench = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--kernel-check") == 0) {
+            options->kernel_check = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--frustum-cull") == 0) {
+            options->frustum_cull = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--ground-plane") == 0) {
+            options->ground_plane = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--gamma-lut") == 0) {
+            options->tonemap.gamma_lut = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--sync-output") == 0) {
+            options->sync_output = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--denoise") == 0) {
+            options->denoise = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--pin") == 0 || strcmp(arg, "--numa") == 0) {
+#ifndef NUMA_SUPPORTED
+            fprintf(stderr, "%s isn't supported on this platform, threads can't be pinned\n", arg);
+            return false;
+#endif
+            if (strcmp(arg, "--pin") == 0) options->pin = true;
+            else options->numa = true;
+            continue;
+        }
+
+        if (value == NULL) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return false;
+        }
+
+        if (strcmp(arg, "--width") == 0) {
+            options->image_width = atoi(value);
+        }
+        else if (strcmp(arg, "--spp") == 0) {
+            options->samples_per_pixel = atoi(value);
+        }
+        else if (strcmp(arg, "--depth") == 0) {
+            options->max_depth = atoi(value);
+        }
+        else if (strcmp(arg, "--threads") == 0) {
+            options->threads = (unsigned int) atoi(value);
+        }
+        else if (strcmp(arg, "--tile") == 0) {
+            options->tile_size = atoi(value);
+        }
+        else if (strcmp(arg, "--lookfrom") == 0) {
+            if (!parse_v3(value, &options->view.position)) return false;
+        }
+        else if (strcmp(arg, "--lookat") == 0) {
+            if (!parse_v3(value, &options->view.lookat)) return false;
+        }
+        else if (strcmp(arg, "--vfov") == 0) {
+            options->view.vfov = (float) atof(value);
+        }
+        else if (strcmp(arg, "--aperture") == 0) {
+            options->view.aperture = (float) atof(value);
+        }
+        else if (strcmp(arg, "--focus") == 0) {
+            options->view.focus_dist = (float) atof(value);
+        }
+        else if (strcmp(arg, "--sample-range") == 0) {
+            if (sscanf(value, "%i:%i", &options->sample_begin, &options->sample_end) != 2 ||
+                options->sample_begin < 0 || options->sample_end <= options->sample_begin) {
+                fprintf(stderr, "Expected a sample range BEGIN:END instead of %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--accum-out") == 0) {
+            options->accum_out = value;
+        }
+        else if (strcmp(arg, "--band-rows") == 0) {
+            options->band_rows = atoi(value);
+        }
+        else if (strcmp(arg, "--reference") == 0) {
+            options->reference = value;
+        }
+        else if (strcmp(arg, "--animate") == 0) {
+            options->animate_frames = (unsigned int) atoi(value);
+        }
+        else if (strcmp(arg, "--frame-out") == 0) {
+            options->frame_out = value;
+        }
+        else if (strcmp(arg, "--rebuild-threshold") == 0) {
+            options->rebuild_threshold = (float) atof(value);
+        }
+        else if (strcmp(arg, "--batch") == 0) {
+            options->batch = value;
+        }
+        else if (strcmp(arg, "--time-budget") == 0) {
+            options->time_budget = atof(value);
+        }
+        else if (strcmp(arg, "--spp-map") == 0) {
+            options->spp_map = value;
+        }
+        else if (strcmp(arg, "--aov-out") == 0) {
+            options->aov_out = value;
+        }
+        else if (strcmp(arg, "--hdr-out") == 0) {
+            options->hdr_out = value;
+        }
+        else if (strcmp(arg, "--quantize") == 0) {
+            if (!parse_quantize_mode(value, &options->tonemap.mode)) {
+                fprintf(stderr, "Unknown quantization: %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--scene-seed") == 0) {
+            options->scene_seed = (uint32_t) strtoul(value, NULL, 10);
+        }
+        else if (strcmp(arg, "--daemon") == 0) {
+            options->daemon = value;
+        }
+        else if (strcmp(arg, "--instances") == 0) {
+            options->instances = (unsigned int) atoi(value);
+        }
+        else if (strcmp(arg, "--accel") == 0) {
+            if (!parse_scene_accel(value, &options->accel)) {
+                fprintf(stderr, "Unknown acceleration structure: %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--isa") == 0) {
+            if (!parse_cpu_isa(value, &options->isa)) {
+                fprintf(stderr, "Unknown instruction set: %s\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--wavefront") == 0) {
+            if (!parse_ray_order(value, &options->ray_order)) {
+                fprintf(stderr, "Unknown ray order: %s\n", value);
+                return false;
+            }
+            options->wavefront = true;
+        }
+        else if (strcmp(arg, "--scene-size") == 0) {
+            options->scene_size = atoi(value);
+        }
+        else if (strcmp(arg, "--mesh") == 0) {
+            if (strlen(value) >= SCENE_MESH_PATH_MAX) {
+                fprintf(stderr, "Mesh path too long: %s\n", value);
+                return false;
+            }
+            options->mesh = value;
+        }
+        else if (strcmp(arg, "--submit") == 0) {
+            options->submit = value;
+        }
+        else if (strcmp(arg, "--coordinator") == 0) {
+            options->coordinator = value;
+        }
+        else if (strcmp(arg, "--worker") == 0) {
+            options->worker = value;
+        }
+        else if (strcmp(arg, "--spawn") == 0) {
+            options->spawn = (unsigned int) atoi(value);
+        }
+        else if (strcmp(arg, "--work-tile") == 0) {
+            options->work_tile_size = atoi(value);
+        }
+        else if (strcmp(arg, "--worker-exit-after") == 0) {
+            options->worker_exit_after = atoi(value);
+        }
+        else if (strcmp(arg, "--order") == 0) {
+            if (!parse_tile_order(value, &options->order)) {
+                fprintf(stderr, "Unknown tile order: %s\n", value);
+                return false;
             }
         }
+        else if (strcmp(arg, "--pixel-order") == 0) {
+            if (!parse_tile_order(value, &options->pixel_order)) {
+                fprintf(stderr, "Unknown pixel order: %s\n", value);
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return false;
+        }
+
+        ++i;
     }
 
-    add_sphere(HMM_Vec3(0.f, 1.f, 0.f), 1.0f, mat_dielectric(1.5f));
-    add_sphere(HMM_Vec3(-4.f, 1.f, 0.f), 1.0f, mat_lambertian(HMM_Vec3(.4f, .2f, .1f)));
-    add_sphere(HMM_Vec3(4.f, 1.f, 0.f), 1.0f, mat_metal(HMM_Vec3(.7f, .6f, .5f), 0.f));
+    if (options->image_width < 2 || options->samples_per_pixel < 1 || options->tile_size < 1 || options->work_tile_size < 1 ||
+        options->band_rows < 0 || options->time_budget < 0.0 || options->scene_size < 0) {
+        fprintf(stderr, "Invalid image size, sample count or tile size\n");
+        return false;
+    }
+
+    return true;
+}
+
+void print_usage() {
+    fprintf(stderr,
+        "usage: raytracer [options] > image.ppm\n"
+        "  --width N             image width in pixels (1200)\n"
+        "  --spp N               samples per pixel (500)\n"
+        "  --depth N             maximum bounce depth (50)\n"
+        "  --threads N           render threads (number of online cores)\n"
+        "  --tile N              tile size in pixels, at most 256 (16)\n"
+        "  --order ORDER         tile traversal: scanline, morton, hilbert (hilbert)\n"
+        "  --pixel-order ORDER   pixel traversal inside a tile (morton)\n"
+        "  --lookfrom X,Y,Z      camera position (13,2,3)\n"
+        "  --lookat X,Y,Z        camera target (0,0,0)\n"
+        "  --vfov DEGREES        vertical field of view (20)\n"
+        "  --aperture A          lens aperture (0.1)\n"
+        "  --focus D             focus distance (10)\n"
+        "  --sample-range B:E    only render sample indices B to E-1 of every pixel (0:spp)\n"
+        "  --accum-out FILE      write the raw sample sums and counts for rtmerge instead of an image\n"
+        "  --hdr-out FILE        write linear colors to a half-float .exr or float .pfm instead of a PPM\n"
+        "  --quantize MODE       8-bit conversion: truncate, round, dither (truncate)\n"
+        "  --gamma-lut           gamma-encode through a lookup table instead of square roots\n"
+        "  --denoise             filter the image guided by first-hit albedo and normals, for low spp\n"
+        "  --reference FILE      accumulation buffer of a high spp render, reports RMSE before and after denoising\n"
+        "  --animate N           render N frames of moving spheres, refitting the BVH between frames\n"
+        "  --frame-out PATTERN   printf pattern of the frame files, .exr and .pfm get linear colors (frame%%04d.ppm)\n"
+        "  --rebuild-threshold R rebuild the BVH once its nodes grew to R times their built area (1.5)\n"
+        "  --batch FILE          render every view listed in FILE against one scene build, one line per\n"
+        "                        frame: lookfrom lookat vfov aperture focus output, e.g.\n"
+        "                        13,2,3 0,0,0 20 0.1 10 frame0.ppm\n"
+        "  --time-budget SECONDS render progressive passes of one sample per pixel until the time is up,\n"
+        "                        --spp stays the upper limit\n"
+        "  --spp-map FILE        with --time-budget, write the samples each pixel got as an .exr or .pfm\n"
+        "  --aov-out FILE        also write first-hit depth, normal, albedo and material id images,\n"
+        "                        FILE.exr becomes FILE.depth.exr and so on, .pfm works too\n"
+        "  --band-rows N         render and write bands of N rows, memory stays proportional to the band\n"
+        "  --sync-output         write the image after rendering instead of streaming rows as they finish\n"
+        "  --mesh FILE           add the triangles of an OBJ file to the scene, in its own coordinates\n"
+        "  --scene-seed N        seed of the random scene (0)\n"
+        "  --scene-size N        small spheres fill a lattice from -N to N, about 4N^2 of them (11)\n"
+        "  --ground-plane        make the random scene's ground an infinite plane instead of a huge sphere\n"
+        "  --accel KIND          sphere acceleration structure: bvh, wide (4/8 children per node), compressed\n"
+        "                        (wide with 8-bit quantized child boxes), grid (uniform, resolution from\n"
+        "                        the sphere count), linear (bvh)\n"
+        "  --accel-bench         render with every acceleration structure and report build, memory and speed\n"
+        "  --kernel-check        check every sphere intersection kernel variant against the scalar sphere\n"
+        "                        test and report each one's throughput\n"
+        "  --isa ISA             kernel variants to run instead of the best the CPU supports: scalar, sse4,\n"
+        "                        avx2, avx512\n"
+        "  --wavefront ORDER     trace all paths a bounce at a time, reordering the rays between bounces:\n"
+        "                        none, octant (direction signs), morton (direction and origin cells),\n"
+        "                        and report rays, time and cache misses per bounce\n"
+        "  --frustum-cull        cull the spheres against every tile's frustum, primary rays of tiles seeing\n"
+        "                        only a few test just those\n"
+        "  --instances N         instead of the random scene, place N copies of one sphere cluster by\n"
+        "                        instancing and report memory against copying them\n"
+        "  --pin                 pin render threads to cores, spread over NUMA nodes\n"
+        "  --numa                pin threads, replicate the scene per node, split the image into per-node\n"
+        "                        bands with first-touched framebuffer pages and report per-node throughput\n"
+        "  --bench               render with every order combination and report timings and cache misses\n"
+        "  --daemon ADDR         serve render jobs on ADDR, keeping scenes resident between jobs,\n"
+        "                        ADDR is unix:/path or tcp:host:port\n"
+        "  --submit ADDR         send the job described by the other options to a daemon and write the image\n"
+        "  --coordinator ADDR    hand out tiles to worker processes connecting to ADDR and write the image,\n"
+        "                        ADDR is unix:/path or tcp:host:port\n"
+        "  --spawn N             start N local worker processes for the coordinator\n"
+        "  --work-tile N         size of the tiles handed to workers, at most 256 (64)\n"
+        "  --worker ADDR         render tiles for the coordinator at ADDR\n"
+        "  --worker-exit-after N worker exits abruptly after N tiles, for testing reassignment\n");
 }
 
-int main() {
+int main(int argc, char** argv) {
+
+    render_options options = {
+        .image_width = 1200,
+        .aspect_ratio = 3.f / 2.f,
+        .samples_per_pixel = 500,
+        .view = {
+            .position = HMM_Vec3(13.f, 2.f, 3.f),
+            .lookat = HMM_Vec3(0.f, 0.f, 0.f),
+            .vup = HMM_Vec3(0.f, 1.f, 0.f),
+            .vfov = 20.f,
+            .aperture = 0.1f,
+            .focus_dist = 10.f
+        },
+        .max_depth = 50,
+        .threads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN),
+        .tile_size = 16,
+        .order = TILE_ORDER_HILBERT,
+        .pixel_order = TILE_ORDER_MORTON,
+        .work_tile_size = 64,
+        .frame_out = "frame%04d.ppm",
+        .rebuild_threshold = 1.5f,
+        .worker_exit_after = -1,
+        .scene_size = RANDOM_SCENE_SIZE,
+        .isa = CPU_ISA_COUNT
+    };
+
+    if (!parse_options(argc, argv, &options)) {
+        print_usage();
+        return 1;
+    }
+
+    if (!select_kernels(options.isa)) {
+        return 1;
+    }
 
     // Image
-    const float aspect_ratio = 3.f / 2.f;
-    const int image_width = 1200;
+    const float aspect_ratio = options.aspect_ratio;
+    const int image_width = options.image_width;
     const int image_height = (int)(image_width / aspect_ratio);
-    const int samples_per_pixel = 500;
-    const int max_depth = 50;
+    options.image_height = image_height;
+
+    if (options.daemon) {
+        return run_render_daemon(options.daemon, &options, build_described_scene);
+    }
+
+    framebuffer fb = { 0 };
+
+    if (options.submit) {
+        if (submit_render_job(options.submit, &options, &fb) != 0) {
+            return 1;
+        }
+        bool written = true;
+        if (options.hdr_out) {
+            written = write_hdr_file(options.hdr_out, &fb);
+        }
+        else {
+            write_framebuffer(stdout, &fb, &options.tonemap);
+        }
+        destroy_framebuffer(&fb);
+        return written ? 0 : 1;
+    }
 
-    const hmm_v3 position = HMM_Vec3(13.f, 2.f, 3.f);
-    const hmm_v3 lookat = HMM_Vec3(0.f, 0.f, 0.f);
-    const hmm_v3 vup = HMM_Vec3(0.f, 1.f, 0.f);
+    if (options.worker) {
+        // The scene comes with the coordinator's job.
+        return run_render_worker(options.worker, options, build_described_scene, options.worker_exit_after);
+    }
 
-    const float dist_to_focus = 10.f;
-    const float aperture = 0.1f;
+    scene world = { 0 };
+    const scene_descriptor description = describe_scene(&options);
+    if (!build_described_scene(&description, &world)) {
+        return 1;
+    }
 
-    state.cam = create_camera(&position, &lookat, &vup, 20.f, aspect_ratio, aperture, dist_to_focus);
+    if (options.accel_bench) {
+        fprintf(stderr, "Scene as described:\n");
+        run_accel_benchmark(&options, &world, image_height);
+        destroy_scene(&world);
 
-    generate_random_scene();
+        // The same number of spheres, clustered instead of on a lattice.
+        random_seed(options.scene_seed);
+        generate_clustered_scene(&world, options.scene_size);
+        fprintf(stderr, "\nClustered scene:\n");
+        run_accel_benchmark(&options, &world, image_height);
+        destroy_scene(&world);
+        return 0;
+    }
 
-    // Render
-    printf("P3\n");
-    printf("%i %i\n", image_width, image_height);
-    printf("255\n");
-
-    for (int j = image_height-1; j >= 0; --j) {
-        fprintf(stderr, "\rScanlines remaining: %i", j);
-        fflush(stderr);
-
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color = HMM_Vec3(0.f, 0.f, 0.f);
-            
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                const float u = ((float) i + random_float()) / ((float) image_width - 1.f);
-                const float v = ((float) j + random_float()) / ((float) image_height - 1.f);
-                const ray r = get_ray(&state.cam, u, v);
-                pixel_color = HMM_AddVec3(pixel_color, ray_color(&r, max_depth));
-            }
+    if (options.kernel_check) {
+        const int result = run_kernel_check(&options, &world);
+        destroy_scene(&world);
+        return result;
+    }
+
+    if (options.bench) {
+        run_order_benchmark(&options, &world, image_height);
+        destroy_scene(&world);
+        return 0;
+    }
+
+
+    if (options.accum_out) {
+        const int result = render_accum_file(&options, &world, options.accum_out);
+        destroy_scene(&world);
+        return result;
+    }
+
+    if (options.animate_frames > 0) {
+        const bool written = render_animation(&options, &world, animate_random_scene, options.animate_frames,
+            options.frame_out, options.rebuild_threshold);
+        destroy_scene(&world);
+        return written ? 0 : 1;
+    }
+
+    if (options.batch) {
+        batch b;
+        int result = 1;
+        if (parse_batch_file(options.batch, options.view.vup, &b)) {
+            result = render_batch(&options, &world, &b) ? 0 : 1;
+            destroy_batch(&b);
+        }
+        destroy_scene(&world);
+        return result;
+    }
 
-            // Divide the color by the number of samples.
-            const float scale = 1.f / samples_per_pixel;
-            pixel_color = HMM_MultiplyVec3f(pixel_color, scale);
+    if (options.band_rows > 0) {
+        if (options.hdr_out || options.coordinator || options.denoise || options.aov_out || options.time_budget > 0.0) {
+            fprintf(stderr, "--band-rows only streams a PPM from local rendering\n");
+            destroy_scene(&world);
+            return 1;
+        }
+        render_bands(&options, &world, stdout, options.band_rows, true);
+        destroy_scene(&world);
+        fprintf(stderr, "\nDone.\n");
+        return 0;
+    }
 
-            write_color(stdout, pixel_color);
+    // Render
+    fb = create_framebuffer(image_width, image_height);
+
+    if (options.coordinator) {
+        if (run_coordinator(options.coordinator, &options, options.work_tile_size, options.spawn, &fb) != 0) {
+            destroy_framebuffer(&fb);
+            destroy_scene(&world);
+            return 1;
+        }
+    }
+    else if (options.time_budget > 0.0) {
+        if (!render_budgeted(&options, &world, &fb)) {
+            destroy_framebuffer(&fb);
+            destroy_scene(&world);
+            return 1;
+        }
+    }
+    else if (options.wavefront) {
+        render_wavefront(&options, &world, &fb, true);
+    }
+    else if (options.denoise || options.aov_out) {
+        if (!render_with_features(&options, &world, &fb)) {
+            destroy_framebuffer(&fb);
+            destroy_scene(&world);
+            return 1;
         }
     }
+    else if (options.sync_output || options.hdr_out) {
+        render(&options, &world, &fb, true);
+    }
+    else {
+        // Rows are encoded and written by the writer thread while tracing continues.
+        render_to_stream(&options, &world, &fb, stdout, true);
+    }
+
+    int result = 0;
+
+    if (options.hdr_out) {
+        result = write_hdr_file(options.hdr_out, &fb) ? 0 : 1;
+    }
+    else if (options.coordinator || options.sync_output || options.denoise || options.aov_out || options.time_budget > 0.0 ||
+        options.wavefront) {
+        write_framebuffer(stdout, &fb, &options.tonemap);
+    }
+    destroy_framebuffer(&fb);
+    destroy_scene(&world);
 
     fprintf(stderr, "\nDone.\n");
-}
\ No newline at end of file
+    return result;
+}
@@ -8,6 +8,8 @@ typedef struct material {
     bool dielectric;
     float fuzz;
     float ir;
+    // Set by the scene, every sphere owns its material.
+    unsigned int id;
 } material;
 
 material mat_lambertian(const color albedo) {
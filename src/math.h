@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #define HANDMADE_MATH_IMPLEMENTATION
 #define HANDMADE_MATH_NO_SSE
@@ -10,9 +11,60 @@
 typedef hmm_v3 point3;   // 3D point
 typedef hmm_v3 color;    // RGB color
 
+// Per-thread generator state, so render threads never contend on a shared rand().
+static _Thread_local uint64_t random_state = 0x853c49e6748fea9bULL;
+
+uint32_t hash_u32(uint32_t x) {
+    // Integer finalizer, turns structured seeds (pixel coordinates, indices) into well mixed ones.
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+uint64_t hash_u64(uint64_t x) {
+    // SplitMix64 finalizer.
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+void random_seed(uint64_t seed) {
+    random_state = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+}
+
+void random_seed_sample(uint32_t pixel, uint32_t sample) {
+    // Every (pixel, sample index) pair gets its own stream, so any subset of samples can be
+    // rendered on its own and still produce exactly the values of a full render.
+    random_seed(hash_u64(((uint64_t) pixel << 32) | sample));
+}
+
+uint64_t random_get_state() {
+    return random_state;
+}
+
+void random_set_state(uint64_t state) {
+    // Paths traced in batches carry their own stream from bounce to bounce.
+    random_state = state;
+}
+
+uint32_t random_u32() {
+    // PCG-XSH-RR step.
+    const uint64_t old = random_state;
+    random_state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    const uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    const uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31u));
+}
+
 float random_float() {
     // Returns a random real in [0,1).
-    return (float) rand() / (RAND_MAX + 1.f);
+    return (float)(random_u32() >> 8) * (1.f / 16777216.f);
 }
 
 float random_float_interval(float min, float max) {
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "math.h"
+#include "framebuffer.h"
+#include "accum.h"
+#include "hdr.h"
+
+// Merges accumulation buffers rendered over disjoint sample ranges (raytracer --sample-range
+// with --accum-out) and writes the resolved image, or the merged buffer with -o. --hdr writes
+// the resolved linear colors to an .exr or .pfm file instead of the PPM.
+
+typedef struct merge_part {
+    const char* path;
+    accum_header header;
+} merge_part;
+
+int compare_merge_part(const void* a, const void* b) {
+    const uint32_t ba = ((const merge_part*) a)->header.sample_begin;
+    const uint32_t bb = ((const merge_part*) b)->header.sample_begin;
+    return (ba > bb) - (ba < bb);
+}
+
+int main(int argc, char** argv) {
+    const char* output = NULL;
+    const char* hdr_output = NULL;
+    merge_part* parts = malloc(sizeof(merge_part) * (argc > 1 ? argc : 1));
+    int part_count = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--hdr") == 0 && i + 1 < argc) {
+            hdr_output = argv[++i];
+        }
+        else {
+            parts[part_count++] = (merge_part) { .path = argv[i] };
+        }
+    }
+
+    // The best kernels the CPU supports, the merged image doesn't depend on them.
+    select_resolve_kernel(detect_cpu_isa());
+    select_tonemap_kernel(detect_cpu_isa());
+
+    if (part_count == 0) {
+        fprintf(stderr, "usage: rtmerge [-o merged.acc | --hdr image.exr] part.acc... > image.ppm\n");
+        free(parts);
+        return 1;
+    }
+
+    accum_buffer merged = { 0 };
+    accum_header merged_header = { 0 };
+
+    for (int i = 0; i < part_count; ++i) {
+        FILE* file = fopen(parts[i].path, "rb");
+        accum_buffer part;
+
+        if (!file || !read_accum_buffer(file, &part, &parts[i].header)) {
+            fprintf(stderr, "Can't read accumulation buffer %s\n", parts[i].path);
+            if (file) fclose(file);
+            destroy_accum_buffer(&merged);
+            free(parts);
+            return 1;
+        }
+        fclose(file);
+
+        if (i == 0) {
+            merged = create_accum_buffer(part.width, part.height);
+            merged_header = parts[i].header;
+        }
+        else if (!same_accum_render(&parts[i].header, &merged_header)) {
+            fprintf(stderr, "%s was rendered with a different image size, camera, depth or scene\n", parts[i].path);
+            destroy_accum_buffer(&part);
+            destroy_accum_buffer(&merged);
+            free(parts);
+            return 1;
+        }
+
+        for (size_t p = 0; p < (size_t) merged.width * merged.height; ++p) {
+            accum_merge(merged.pixels + p, part.pixels + p);
+        }
+
+        destroy_accum_buffer(&part);
+    }
+
+    // Overlapping ranges would count samples twice, gaps only lower the sample count.
+    qsort(parts, part_count, sizeof(merge_part), compare_merge_part);
+    merged_header.sample_begin = parts[0].header.sample_begin;
+    merged_header.sample_end = parts[0].header.sample_end;
+
+    for (int i = 1; i < part_count; ++i) {
+        const accum_header* h = &parts[i].header;
+        if (h->sample_begin < merged_header.sample_end) {
+            fprintf(stderr, "%s overlaps samples of another part\n", parts[i].path);
+            destroy_accum_buffer(&merged);
+            free(parts);
+            return 1;
+        }
+        if (h->sample_begin > merged_header.sample_end) {
+            fprintf(stderr, "Warning: samples %u to %u are missing\n", merged_header.sample_end, h->sample_begin);
+        }
+        merged_header.sample_end = h->sample_end;
+    }
+
+    int result = 0;
+
+    if (output) {
+        FILE* file = fopen(output, "wb");
+        if (!file || !write_accum_buffer(file, &merged, &merged_header)) {
+            fprintf(stderr, "Can't write %s\n", output);
+            result = 1;
+        }
+        if (file && fclose(file) != 0) result = 1;
+    }
+    else {
+        framebuffer fb = create_framebuffer(merged.width, merged.height);
+        resolve_accum_pixels(merged.pixels, fb.pixels, (size_t) merged.width * merged.height);
+        if (hdr_output) {
+            if (!write_hdr_file(hdr_output, &fb)) result = 1;
+        }
+        else {
+            write_framebuffer(stdout, &fb, NULL);
+        }
+        destroy_framebuffer(&fb);
+    }
+
+    fprintf(stderr, "Merged %i parts, samples %u to %u\n", part_count, merged_header.sample_begin, merged_header.sample_end);
+    destroy_accum_buffer(&merged);
+    free(parts);
+    return result;
+}
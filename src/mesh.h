@@ -0,0 +1,287 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "tile.h"
+#include "perf.h"
+
+// Triangle meshes. Triangles are sorted along a 3D Morton curve of their centroids and packed
+// MESH_PACKET_WIDTH at a time into packets that hold each vertex and edge coordinate as one
+// vector, so a single Moller-Trumbore test runs over the whole packet. The mesh's BVH is
+// built over the packets' bounds and its leaves test up to BVH_MAX_LEAF_SIZE packets.
+// Normals are geometric, shading normals from the file are not used.
+
+#ifdef __AVX__
+#define MESH_PACKET_WIDTH 8
+#else
+#define MESH_PACKET_WIDTH 4
+#endif
+
+#define MESH_EPSILON 1e-8f
+
+typedef float packet_lanes __attribute__((vector_size(sizeof(float) * MESH_PACKET_WIDTH)));
+typedef int packet_mask __attribute__((vector_size(sizeof(int) * MESH_PACKET_WIDTH)));
+
+typedef struct triangle_packet {
+    // x, y and z rows of the first vertex and both edges leaving it. Unused lanes have zero
+    // edges, which no ray can hit.
+    packet_lanes v0[3];
+    packet_lanes e1[3];
+    packet_lanes e2[3];
+} triangle_packet;
+
+typedef struct mesh {
+    triangle_packet* packets;
+    unsigned int packet_count;
+    unsigned int triangle_count;
+    material material;
+    bvh accel;
+} mesh;
+
+uint32_t morton_encode_3d(uint32_t x, uint32_t y, uint32_t z) {
+    // Interleave the lower 10 bits of x, y and z.
+    uint32_t v[3] = { x & 0x3ff, y & 0x3ff, z & 0x3ff };
+    for (int i = 0; i < 3; ++i) {
+        v[i] = (v[i] | (v[i] << 16)) & 0x030000ff;
+        v[i] = (v[i] | (v[i] << 8)) & 0x0300f00f;
+        v[i] = (v[i] | (v[i] << 4)) & 0x030c30c3;
+        v[i] = (v[i] | (v[i] << 2)) & 0x09249249;
+    }
+    return v[0] | (v[1] << 1) | (v[2] << 2);
+}
+
+aabb packet_bounds(const triangle_packet* packet) {
+    aabb bounds = empty_aabb();
+    for (int lane = 0; lane < MESH_PACKET_WIDTH; ++lane) {
+        const point3 v0 = HMM_Vec3(packet->v0[0][lane], packet->v0[1][lane], packet->v0[2][lane]);
+        const hmm_v3 e1 = HMM_Vec3(packet->e1[0][lane], packet->e1[1][lane], packet->e1[2][lane]);
+        const hmm_v3 e2 = HMM_Vec3(packet->e2[0][lane], packet->e2[1][lane], packet->e2[2][lane]);
+        bounds = aabb_extend(bounds, v0);
+        bounds = aabb_extend(bounds, HMM_AddVec3(v0, e1));
+        bounds = aabb_extend(bounds, HMM_AddVec3(v0, e2));
+    }
+    return bounds;
+}
+
+mesh build_mesh(const point3* vertices, const unsigned int* triangles, unsigned int triangle_count, const material mat) {
+    // triangles holds three vertex indices per triangle.
+    mesh m = { .triangle_count = triangle_count, .material = mat };
+    m.packet_count = (triangle_count + MESH_PACKET_WIDTH - 1) / MESH_PACKET_WIDTH;
+    if (m.packet_count == 0) return m;
+
+    aabb centroids = empty_aabb();
+    for (unsigned int i = 0; i < triangle_count; ++i) {
+        const unsigned int* t = triangles + 3 * i;
+        const hmm_v3 sum = HMM_AddVec3(HMM_AddVec3(vertices[t[0]], vertices[t[1]]), vertices[t[2]]);
+        centroids = aabb_extend(centroids, HMM_DivideVec3f(sum, 3.f));
+    }
+
+    curve_entry* order = malloc(sizeof(curve_entry) * triangle_count);
+    const hmm_v3 extent = HMM_SubtractVec3(centroids.max, centroids.min);
+    for (unsigned int i = 0; i < triangle_count; ++i) {
+        const unsigned int* t = triangles + 3 * i;
+        const hmm_v3 sum = HMM_AddVec3(HMM_AddVec3(vertices[t[0]], vertices[t[1]]), vertices[t[2]]);
+        const hmm_v3 offset = HMM_SubtractVec3(HMM_DivideVec3f(sum, 3.f), centroids.min);
+        uint32_t cell[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            const float e = extent.Elements[axis];
+            cell[axis] = e > 0.f ? (uint32_t)(offset.Elements[axis] / e * 1023.f) : 0;
+        }
+        order[i] = (curve_entry) { .key = morton_encode_3d(cell[0], cell[1], cell[2]), .value = i };
+    }
+    qsort(order, triangle_count, sizeof(curve_entry), compare_curve_entry);
+
+    m.packets = aligned_alloc(sizeof(packet_lanes), sizeof(triangle_packet) * m.packet_count);
+    memset(m.packets, 0, sizeof(triangle_packet) * m.packet_count);
+    for (unsigned int i = 0; i < triangle_count; ++i) {
+        triangle_packet* packet = m.packets + i / MESH_PACKET_WIDTH;
+        const int lane = i % MESH_PACKET_WIDTH;
+        const unsigned int* t = triangles + 3 * order[i].value;
+        const hmm_v3 e1 = HMM_SubtractVec3(vertices[t[1]], vertices[t[0]]);
+        const hmm_v3 e2 = HMM_SubtractVec3(vertices[t[2]], vertices[t[0]]);
+        for (int axis = 0; axis < 3; ++axis) {
+            packet->v0[axis][lane] = vertices[t[0]].Elements[axis];
+            packet->e1[axis][lane] = e1.Elements[axis];
+            packet->e2[axis][lane] = e2.Elements[axis];
+        }
+    }
+    free(order);
+
+    // Padding lanes repeat the packet's first vertex, so they don't stretch its bounds.
+    triangle_packet* last = m.packets + m.packet_count - 1;
+    for (unsigned int lane = triangle_count % MESH_PACKET_WIDTH; lane > 0 && lane < MESH_PACKET_WIDTH; ++lane) {
+        for (int axis = 0; axis < 3; ++axis) {
+            last->v0[axis][lane] = last->v0[axis][0];
+        }
+    }
+
+    aabb* bounds = malloc(sizeof(aabb) * m.packet_count);
+    for (unsigned int i = 0; i < m.packet_count; ++i) {
+        bounds[i] = packet_bounds(m.packets + i);
+    }
+    m.accel = build_bvh(bounds, m.packet_count);
+    free(bounds);
+    return m;
+}
+
+bool load_obj(const char* path, const material mat, mesh* m) {
+    // Vertex positions and faces, polygons are split into fans. Other statements are skipped.
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open mesh %s\n", path);
+        return false;
+    }
+
+    const double start = now_seconds();
+    point3* vertices = NULL;
+    unsigned int* triangles = NULL;
+    unsigned int vertex_count = 0, vertex_capacity = 0, triangle_count = 0, triangle_capacity = 0;
+    char line[4096];
+    int line_number = 0;
+    bool valid = true;
+
+    while (valid && fgets(line, sizeof(line), file)) {
+        ++line_number;
+
+        if (line[0] == 'v' && line[1] == ' ') {
+            if (vertex_count == vertex_capacity) {
+                vertex_capacity = vertex_capacity ? vertex_capacity * 2 : 1024;
+                vertices = realloc(vertices, sizeof(point3) * vertex_capacity);
+            }
+            point3* v = vertices + vertex_count++;
+            valid = sscanf(line + 2, "%f %f %f", &v->X, &v->Y, &v->Z) == 3;
+        }
+        else if (line[0] == 'f' && line[1] == ' ') {
+            unsigned int face[3];
+            int corners = 0;
+            char* cursor = line + 2;
+
+            for (;;) {
+                char* end;
+                const long index = strtol(cursor, &end, 10);
+                if (end == cursor) break;
+                // Skip texture and normal indices, negative indices count back from the last vertex.
+                cursor = end + strcspn(end, " \t\r\n");
+                const long resolved = index < 0 ? (long) vertex_count + index : index - 1;
+                if (resolved < 0 || resolved >= (long) vertex_count) {
+                    valid = false;
+                    break;
+                }
+
+                face[corners < 2 ? corners : 2] = (unsigned int) resolved;
+                if (++corners < 3) continue;
+
+                if (triangle_count == triangle_capacity) {
+                    triangle_capacity = triangle_capacity ? triangle_capacity * 2 : 1024;
+                    triangles = realloc(triangles, sizeof(unsigned int) * 3 * triangle_capacity);
+                }
+                memcpy(triangles + 3 * triangle_count++, face, sizeof(face));
+                face[1] = face[2];
+            }
+
+            valid = valid && corners >= 3;
+        }
+    }
+
+    fclose(file);
+    if (!valid) {
+        fprintf(stderr, "%s:%i: malformed vertex or face\n", path, line_number);
+    }
+    else {
+        const double parsed = now_seconds();
+        *m = build_mesh(vertices, triangles, triangle_count, mat);
+        const double built = now_seconds();
+        const size_t bytes = sizeof(triangle_packet) * m->packet_count + bvh_bytes(&m->accel);
+        fprintf(stderr, "%s: %u triangles in %u packets of %i, %.2f MB, parsed in %.3fs, built in %.3fs\n", path,
+            m->triangle_count, m->packet_count, MESH_PACKET_WIDTH, bytes / 1e6, parsed - start, built - parsed);
+    }
+
+    free(triangles);
+    free(vertices);
+    return valid;
+}
+
+mesh copy_mesh(const mesh* m) {
+    mesh copy = *m;
+    if (m->packet_count > 0) {
+        copy.packets = aligned_alloc(sizeof(packet_lanes), sizeof(triangle_packet) * m->packet_count);
+        memcpy(copy.packets, m->packets, sizeof(triangle_packet) * m->packet_count);
+    }
+    copy.accel = copy_bvh(&m->accel);
+    return copy;
+}
+
+void destroy_mesh(mesh* m) {
+    destroy_bvh(&m->accel);
+    free(m->packets);
+    *m = (mesh) { 0 };
+}
+
+packet_lanes splat_lanes(float value) {
+    return value + (packet_lanes) { 0 };
+}
+
+bool intersect_packet_at(const void* triangle_mesh, unsigned int index, const ray* r, float t_min, ray_hit* hit) {
+    // The closest lane goes into part.
+    const mesh* m = triangle_mesh;
+    const triangle_packet* p = m->packets + index;
+    const packet_lanes dx = splat_lanes(r->direction.X), dy = splat_lanes(r->direction.Y), dz = splat_lanes(r->direction.Z);
+
+    // Moller-Trumbore on every lane at once.
+    const packet_lanes px = dy * p->e2[2] - dz * p->e2[1];
+    const packet_lanes py = dz * p->e2[0] - dx * p->e2[2];
+    const packet_lanes pz = dx * p->e2[1] - dy * p->e2[0];
+    const packet_lanes det = p->e1[0] * px + p->e1[1] * py + p->e1[2] * pz;
+    const packet_lanes inv_det = 1.f / det;
+
+    const packet_lanes tx = r->origin.X - p->v0[0], ty = r->origin.Y - p->v0[1], tz = r->origin.Z - p->v0[2];
+    const packet_lanes u = (tx * px + ty * py + tz * pz) * inv_det;
+
+    const packet_lanes qx = ty * p->e1[2] - tz * p->e1[1];
+    const packet_lanes qy = tz * p->e1[0] - tx * p->e1[2];
+    const packet_lanes qz = tx * p->e1[1] - ty * p->e1[0];
+    const packet_lanes v = (dx * qx + dy * qy + dz * qz) * inv_det;
+    const packet_lanes t = (p->e2[0] * qx + p->e2[1] * qy + p->e2[2] * qz) * inv_det;
+
+    const packet_mask found = ((det > MESH_EPSILON) | (det < -MESH_EPSILON)) & (u >= 0.f) & (v >= 0.f) & (u + v <= 1.f) &
+        (t > t_min) & (t < hit->t);
+
+    int best = -1;
+    float closest = hit->t;
+    for (int lane = 0; lane < MESH_PACKET_WIDTH; ++lane) {
+        if (found[lane] && t[lane] < closest) {
+            closest = t[lane];
+            best = lane;
+        }
+    }
+    if (best < 0) return false;
+
+    *hit = (ray_hit) { .t = closest, .primitive = index, .part = (unsigned int) best };
+    return true;
+}
+
+void fill_mesh_record(hit_record* rec, const ray* r, const mesh* m, const ray_hit* hit) {
+    const triangle_packet* p = m->packets + hit->primitive;
+    const unsigned int lane = hit->part;
+    const hmm_v3 e1 = HMM_Vec3(p->e1[0][lane], p->e1[1][lane], p->e1[2][lane]);
+    const hmm_v3 e2 = HMM_Vec3(p->e2[0][lane], p->e2[1][lane], p->e2[2][lane]);
+    rec->t = hit->t;
+    rec->point = ray_at(r, hit->t);
+    rec->normal = HMM_NormalizeVec3(HMM_Cross(e1, e2));
+    rec->material = m->material;
+    rec->front_face = HMM_DotVec3(r->direction, rec->normal) < 0.f;
+
+    if (!rec->front_face) {
+        rec->normal = HMM_MultiplyVec3f(rec->normal, -1.f);
+    }
+}
+
+bool hit_mesh(const mesh* m, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    return bvh_traverse(&m->accel, m, intersect_packet_at, r, t_min, any_hit, hit);
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Addresses are "unix:/path/to/socket" or "tcp:host:port".
+
+bool split_tcp_address(const char* address, char* host, size_t host_size, char* port, size_t port_size) {
+    const char* separator = strrchr(address, ':');
+    if (!separator || (size_t)(separator - address) >= host_size || strlen(separator + 1) >= port_size) {
+        return false;
+    }
+
+    memcpy(host, address, separator - address);
+    host[separator - address] = '\0';
+    strcpy(port, separator + 1);
+    return true;
+}
+
+int unix_socket(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+int tcp_socket(const char* address, bool passive, struct addrinfo** info) {
+    char host[256], port[32];
+    if (!split_tcp_address(address, host, sizeof(host), port, sizeof(port))) {
+        fprintf(stderr, "Invalid tcp address: %s\n", address);
+        return -1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, info) != 0) {
+        fprintf(stderr, "Can't resolve %s\n", address);
+        return -1;
+    }
+
+    return socket((*info)->ai_family, (*info)->ai_socktype, (*info)->ai_protocol);
+}
+
+int net_listen(const char* address) {
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        fd = unix_socket(address + 5, &addr);
+        if (fd < 0) return -1;
+        unlink(addr.sun_path);
+        if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    else if (strncmp(address, "tcp:", 4) == 0) {
+        struct addrinfo* info = NULL;
+        fd = tcp_socket(address + 4, true, &info);
+        if (fd >= 0) {
+            const int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(fd, info->ai_addr, info->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (info) freeaddrinfo(info);
+        if (fd < 0) return -1;
+    }
+    else {
+        fprintf(stderr, "Unknown address scheme: %s\n", address);
+        return -1;
+    }
+
+    if (listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int net_connect(const char* address) {
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        fd = unix_socket(address + 5, &addr);
+        if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else if (strncmp(address, "tcp:", 4) == 0) {
+        struct addrinfo* info = NULL;
+        fd = tcp_socket(address + 4, false, &info);
+        if (fd >= 0 && connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0) {
+            // Tile requests are tiny, don't let Nagle hold them back.
+            const int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+        if (info) freeaddrinfo(info);
+    }
+    else {
+        fprintf(stderr, "Unknown address scheme: %s\n", address);
+    }
+
+    return fd;
+}
+
+bool send_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = data;
+
+    while (size > 0) {
+        const ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        p += sent;
+        size -= (size_t) sent;
+    }
+
+    return true;
+}
+
+bool recv_all(int fd, void* data, size_t size) {
+    uint8_t* p = data;
+
+    while (size > 0) {
+        const ssize_t received = recv(fd, p, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        p += received;
+        size -= (size_t) received;
+    }
+
+    return true;
+}
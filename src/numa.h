@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "math.h"
+
+// Node discovery reads Linux's sysfs and pinning uses its affinity calls. Elsewhere the
+// machine is one node and threads can't be pinned, --pin and --numa are refused there.
+#ifdef __linux__
+#define NUMA_SUPPORTED 1
+#endif
+
+#define MAX_NUMA_NODES 64
+
+typedef struct numa_topology {
+    unsigned int node_count;
+    // CPUs of every node, node_cpus[n] holds node_cpu_count[n] entries.
+    int* node_cpus[MAX_NUMA_NODES];
+    unsigned int node_cpu_count[MAX_NUMA_NODES];
+} numa_topology;
+
+unsigned int parse_cpu_list(const char* list, int* cpus, unsigned int capacity) {
+    // Parses the kernel's cpulist format, e.g. "0-7,16-23".
+    unsigned int count = 0;
+    const char* p = list;
+
+    while (*p) {
+        char* end;
+        const long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        p = end;
+
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+
+        for (long cpu = first; cpu <= last && count < capacity; ++cpu) {
+            cpus[count++] = (int) cpu;
+        }
+
+        if (*p == ',') ++p;
+        else break;
+    }
+
+    return count;
+}
+
+numa_topology detect_numa_topology() {
+    numa_topology topology = { 0 };
+#ifdef NUMA_SUPPORTED
+    const long cpu_capacity = HMM_MAX(sysconf(_SC_NPROCESSORS_CONF), 1L);
+
+    for (unsigned int node = 0; node < MAX_NUMA_NODES; ++node) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (!file) continue;
+
+        char list[4096] = { 0 };
+        const bool read = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+        if (!read) continue;
+
+        int* cpus = malloc(sizeof(int) * cpu_capacity);
+        const unsigned int count = parse_cpu_list(list, cpus, (unsigned int) cpu_capacity);
+
+        // Memory-only nodes have no CPUs to run on.
+        if (count == 0) {
+            free(cpus);
+            continue;
+        }
+
+        topology.node_cpus[topology.node_count] = cpus;
+        topology.node_cpu_count[topology.node_count] = count;
+        ++topology.node_count;
+    }
+#endif
+
+    if (topology.node_count == 0) {
+        // No sysfs, treat the machine as a single node.
+        const long online = HMM_MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+        topology.node_cpus[0] = malloc(sizeof(int) * online);
+        for (long i = 0; i < online; ++i) {
+            topology.node_cpus[0][i] = (int) i;
+        }
+        topology.node_cpu_count[0] = (unsigned int) online;
+        topology.node_count = 1;
+    }
+
+    return topology;
+}
+
+void destroy_numa_topology(numa_topology* topology) {
+    for (unsigned int node = 0; node < topology->node_count; ++node) {
+        free(topology->node_cpus[node]);
+    }
+    *topology = (numa_topology) { 0 };
+}
+
+unsigned int numa_worker_node(const numa_topology* topology, unsigned int worker) {
+    // Workers are spread round-robin so small thread counts still use every socket.
+    return worker % topology->node_count;
+}
+
+int numa_worker_cpu(const numa_topology* topology, unsigned int worker) {
+    const unsigned int node = numa_worker_node(topology, worker);
+    const unsigned int slot = worker / topology->node_count;
+    return topology->node_cpus[node][slot % topology->node_cpu_count[node]];
+}
+
+bool pin_thread_to_cpu(int cpu) {
+#ifdef NUMA_SUPPORTED
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+bool pin_thread_to_node(const numa_topology* topology, unsigned int node) {
+#ifdef NUMA_SUPPORTED
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned int i = 0; i < topology->node_cpu_count[node]; ++i) {
+        CPU_SET(topology->node_cpus[node][i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) topology;
+    (void) node;
+    return false;
+#endif
+}
+
+typedef void (*numa_node_fn)(unsigned int node, void* user);
+
+typedef struct numa_node_task {
+    const numa_topology* topology;
+    unsigned int node;
+    numa_node_fn fn;
+    void* user;
+} numa_node_task;
+
+void* numa_node_task_main(void* arg) {
+    const numa_node_task* task = arg;
+    pin_thread_to_node(task->topology, task->node);
+    task->fn(task->node, task->user);
+    return NULL;
+}
+
+void run_on_each_node(const numa_topology* topology, numa_node_fn fn, void* user) {
+    // Runs fn once per node on a thread bound to that node, so memory it first touches is node-local.
+    pthread_t handles[MAX_NUMA_NODES];
+    numa_node_task tasks[MAX_NUMA_NODES];
+
+    for (unsigned int node = 0; node < topology->node_count; ++node) {
+        tasks[node] = (numa_node_task) { .topology = topology, .node = node, .fn = fn, .user = user };
+        pthread_create(handles + node, NULL, numa_node_task_main, tasks + node);
+    }
+
+    for (unsigned int node = 0; node < topology->node_count; ++node) {
+        pthread_join(handles[node], NULL);
+    }
+}
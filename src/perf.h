@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+typedef enum perf_counter {
+    PERF_L1D_READ_MISSES,
+    PERF_LLC_READ_MISSES,
+    PERF_CACHE_MISSES,
+    PERF_INSTRUCTIONS,
+    PERF_COUNTER_COUNT
+} perf_counter;
+
+const char* perf_counter_names[PERF_COUNTER_COUNT] = { "L1D miss", "LLC miss", "cache miss", "instr" };
+
+typedef struct perf_counters {
+    int fds[PERF_COUNTER_COUNT];
+    uint64_t values[PERF_COUNTER_COUNT];
+} perf_counters;
+
+#ifdef __linux__
+int perf_open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    // Count threads spawned after opening too, the render workers are created later.
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+perf_counters perf_open() {
+    perf_counters counters;
+    memset(&counters, 0, sizeof(counters));
+
+#ifdef __linux__
+    const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    counters.fds[PERF_L1D_READ_MISSES] = perf_open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | read_miss);
+    counters.fds[PERF_LLC_READ_MISSES] = perf_open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | read_miss);
+    counters.fds[PERF_CACHE_MISSES] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counters.fds[PERF_INSTRUCTIONS] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+#else
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        counters.fds[i] = -1;
+    }
+#endif
+
+    return counters;
+}
+
+void perf_start(perf_counters* counters) {
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void perf_stop(perf_counters* counters) {
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        counters->values[i] = 0;
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[i], counters->values + i, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            counters->values[i] = 0;
+        }
+    }
+#endif
+}
+
+bool perf_available(const perf_counters* counters, perf_counter counter) {
+    return counters->fds[counter] >= 0;
+}
+
+void perf_close(perf_counters* counters) {
+#ifdef __linux__
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+    }
+#endif
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "math.h"
+#include "material.h"
+#include "ray.h"
+#include "sphere.h"
+
+// Infinite plane through point, facing along its unit normal. It has no bounds, so the scene
+// tests planes next to its acceleration structures, see hit_world().
+
+#define PLANE_PARALLEL_EPSILON 1e-8f
+
+typedef struct plane {
+    point3 point;
+    hmm_v3 normal;
+    material material;
+} plane;
+
+bool intersect_plane(const plane* p, const ray* r, float t_min, float* t) {
+    const float denominator = HMM_DotVec3(p->normal, r->direction);
+    if (fabsf(denominator) < PLANE_PARALLEL_EPSILON) return false;
+
+    const float plane_t = HMM_DotVec3(HMM_SubtractVec3(p->point, r->origin), p->normal) / denominator;
+    if (plane_t >= *t || plane_t <= t_min) return false;
+
+    *t = plane_t;
+    return true;
+}
+
+void fill_plane_record(hit_record* rec, const float t, const ray* r, const plane* p) {
+    rec->t = t;
+    rec->point = ray_at(r, t);
+    rec->material = p->material;
+    rec->front_face = HMM_DotVec3(p->normal, r->direction) < 0.f;
+    rec->normal = rec->front_face ? p->normal : HMM_MultiplyVec3f(p->normal, -1.f);
+}
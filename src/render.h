@@ -0,0 +1,562 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "scene.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "accum.h"
+#include "features.h"
+#include "tile.h"
+#include "frustum.h"
+#include "wavefront.h"
+#include "numa.h"
+#include "perf.h"
+#include "writer.h"
+
+color ray_color(const scene* world, const ray* r, int depth, first_hit* first, const sphere_subset* candidates) {
+    // first receives the features of the first surface hit, candidates are the only spheres the
+    // ray can hit if set, see frustum.h. Both are NULL below the camera ray.
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth <= 0) {
+        return HMM_Vec3(0.f, 0.f, 0.f);
+    }
+
+    hit_record hit_r;
+
+    if (hit_world_subset(world, candidates, r, 0.001f, INFINITY, &hit_r)) {
+        ray scattered;
+        color attenuation;
+
+        if (first) {
+            record_first_hit(first, r, &hit_r);
+        }
+        
+        if (scatter_ray(&hit_r.material, r, &hit_r, &attenuation, &scattered)) {
+            return HMM_MultiplyVec3(attenuation, ray_color(world, &scattered, depth - 1, NULL, NULL));
+        }
+
+        return HMM_Vec3(0.f, 0.f, 0.f);
+    }
+
+    const color sky = sky_color(r);
+
+    if (first) {
+        record_first_miss(first, sky);
+    }
+
+    return sky;
+}
+
+typedef struct render_options {
+    int image_width;
+    int image_height;
+    float aspect_ratio;
+    camera_params view;
+    int samples_per_pixel;
+    // Sample indices rendered for every pixel, end is exclusive.
+    int sample_begin;
+    int sample_end;
+    int max_depth;
+    unsigned int threads;
+    int tile_size;
+    tile_order order;
+    tile_order pixel_order;
+    bool bench;
+    bool pin;
+    bool numa;
+    uint32_t scene_seed;
+    // Small spheres of the random scene lie on a lattice from -scene_size to scene_size.
+    int scene_size;
+    // Infinite plane as the random scene's ground instead of the radius 1000 sphere.
+    bool ground_plane;
+    scene_accel accel;
+    bool accel_bench;
+    bool kernel_check;
+    // Cull the spheres against every tile's primary ray frustum before rendering, see frustum.h.
+    bool frustum_cull;
+    // Trace bounce by bounce, reordering the rays in between, see wavefront.h.
+    bool wavefront;
+    ray_order ray_order;
+    // Kernel variants to run, see cpu.h, CPU_ISA_COUNT picks the best the CPU supports.
+    cpu_isa isa;
+    // Copies of one sphere cluster placed by instancing instead of the random scene, see instance.h.
+    unsigned int instances;
+    // OBJ file added to the scene as a triangle mesh, see mesh.h.
+    const char* mesh;
+    const char* accum_out;
+    // Linear half-float EXR or float PFM written instead of the PPM, see hdr.h.
+    const char* hdr_out;
+    tonemap_options tonemap;
+    // Write the whole image after rendering instead of streaming finished rows from a writer thread.
+    bool sync_output;
+    // Denoise with first-hit features after rendering, and compare against a reference accumulation buffer.
+    bool denoise;
+    const char* reference;
+    // First-hit AOVs written next to the image, the extension picks EXR or PFM, see features.h.
+    const char* aov_out;
+    // Animated sequence, see animation.h.
+    unsigned int animate_frames;
+    const char* frame_out;
+    float rebuild_threshold;
+    // Views and outputs rendered against one shared scene, see batch.h.
+    const char* batch;
+    // Wall-clock limit in seconds for progressive rendering, zero renders all samples.
+    double time_budget;
+    const char* spp_map;
+    // Render and write horizontal bands of this many rows, see band.h. Zero renders the whole image.
+    int band_rows;
+    // Render daemon and its clients, see daemon.h.
+    const char* daemon;
+    const char* submit;
+    // Distributed rendering, see distributed.h.
+    const char* coordinator;
+    const char* worker;
+    unsigned int spawn;
+    int work_tile_size;
+    int worker_exit_after;
+} render_options;
+
+scene_descriptor describe_scene(const render_options* options) {
+    // The mesh path is checked against SCENE_MESH_PATH_MAX when parsing the options.
+    scene_descriptor description = {
+        .seed = options->scene_seed,
+        .size = options->scene_size,
+        .instances = options->instances,
+        .accel = options->accel,
+        .ground_plane = options->ground_plane
+    };
+    if (options->mesh) {
+        snprintf(description.mesh, sizeof(description.mesh), "%s", options->mesh);
+    }
+    return description;
+}
+
+typedef struct render_job {
+    const render_options* options;
+    camera cam;
+    // The target may cover only a region of the image, starting at the origin pixel. Pixels are
+    // either resolved into the framebuffer or their raw sums written to the accumulation buffer.
+    framebuffer* fb;
+    accum_buffer* accum;
+    // First-hit features averaged per pixel, if set.
+    feature_buffer* features;
+    // Add the sums to the accumulation buffer instead of replacing them.
+    bool accumulate;
+    // Tiles started after this time on the now_seconds() clock are skipped, zero for no limit.
+    double deadline;
+    // Passes of one sample per pixel over the whole image, until samples_per_pixel or the
+    // deadline, instead of a single pass over the options' sample range. Counts the passes started.
+    bool progressive;
+    unsigned int passes;
+    // Sample range of the current pass, end is exclusive.
+    int sample_begin, sample_end;
+    int origin_x, origin_y;
+    // Finished rows of the framebuffer are encoded to the output stream while rendering, if set.
+    FILE* output;
+    output_writer* writer;
+    const tile_set* tiles;
+    const numa_topology* topology;
+    // Per-tile spheres for the primary rays, if frustum culling is on.
+    const tile_candidates* candidates;
+    // Scene each worker traces against, workers use worlds[worker % world_count].
+    const scene* worlds[MAX_NUMA_NODES];
+    unsigned int world_count;
+    scene replicas[MAX_NUMA_NODES];
+} render_job;
+
+int render_sample_end(const render_options* options) {
+    // An unset range covers all samples_per_pixel samples.
+    return options->sample_end > 0 ? options->sample_end : options->samples_per_pixel;
+}
+
+void render_tile(const tile* t, const tile_set* set, unsigned int worker, void* user) {
+    const render_job* job = user;
+    const scene* world = job->worlds[worker % job->world_count];
+    const int sample_begin = job->sample_begin;
+    const int sample_end = job->sample_end;
+    const int max_depth = job->options->max_depth;
+    const int image_width = job->options->image_width;
+    const int image_height = job->options->image_height;
+
+    if (job->deadline > 0.0 && now_seconds() >= job->deadline) {
+        return;
+    }
+
+    sphere_subset subset;
+    const sphere_subset* candidates = NULL;
+    if (job->candidates && job->candidates->listed[t->index]) {
+        subset = tile_sphere_subset(job->candidates, t);
+        candidates = &subset;
+    }
+
+    for (unsigned int p = 0; p < set->pixel_order_length; ++p) {
+        const int x = t->x0 + (set->pixel_order[p] & 0xff);
+        const int y = t->y0 + (set->pixel_order[p] >> 8);
+        if (x >= t->x1 || y >= t->y1) continue;
+
+        const int i = job->origin_x + x;
+        const int row = job->origin_y + y;
+        const uint32_t pixel_index = (uint32_t) row * (uint32_t) image_width + (uint32_t) i;
+
+        // Framebuffer rows run top-down, v runs bottom-up.
+        const int j = image_height - 1 - row;
+        accum_pixel sum = { 0 };
+        first_hit first = { 0 };
+        color albedo = HMM_Vec3(0.f, 0.f, 0.f);
+        hmm_v3 normal = HMM_Vec3(0.f, 0.f, 0.f);
+        double luminance_sum = 0.0, luminance_squares = 0.0;
+        float depth = 0.f, material_id = FEATURE_NO_MATERIAL;
+        int depth_hits = 0;
+
+        for (int s = sample_begin; s < sample_end; ++s) {
+            // Seeded per sample, so the image doesn't depend on tiling, thread count or sample split.
+            random_seed_sample(pixel_index, (uint32_t) s);
+            const float u = ((float) i + random_float()) / ((float) image_width - 1.f);
+            const float v = ((float) j + random_float()) / ((float) image_height - 1.f);
+            const ray r = get_ray(&job->cam, u, v);
+            const color sample = ray_color(world, &r, max_depth, job->features ? &first : NULL, candidates);
+            accum_add(&sum, sample);
+
+            if (job->features) {
+                const double l = luminance(sample);
+                albedo = HMM_AddVec3(albedo, first.albedo);
+                normal = HMM_AddVec3(normal, first.normal);
+                luminance_sum += l;
+                luminance_squares += l * l;
+                if (s == sample_begin) material_id = first.material_id;
+                if (isfinite(first.depth)) {
+                    depth += first.depth;
+                    ++depth_hits;
+                }
+            }
+        }
+
+        if (job->features && sample_end > sample_begin) {
+            const size_t index = feature_index(job->features, x, y);
+            const double n = sample_end - sample_begin;
+            const double mean = luminance_sum / n;
+            job->features->albedo[index] = HMM_DivideVec3f(albedo, (float) n);
+            job->features->normal[index] = HMM_DivideVec3f(normal, (float) n);
+            job->features->variance[index] = (float)(fmax(luminance_squares / n - mean * mean, 0.0) / n);
+            job->features->depth[index] = depth_hits > 0 ? depth / (float) depth_hits : INFINITY;
+            job->features->material_id[index] = material_id;
+        }
+
+        if (job->accum && job->accumulate) {
+            accum_merge(accum_at(job->accum, x, y), &sum);
+        }
+        else if (job->accum) {
+            *accum_at(job->accum, x, y) = sum;
+        }
+        else {
+            // Divide the color by the number of samples.
+            *framebuffer_at(job->fb, x, y) = accum_resolve(&sum);
+        }
+    }
+
+    if (job->writer) {
+        writer_submit(job->writer, t);
+    }
+}
+
+void pin_render_worker(unsigned int worker, void* user) {
+    const render_job* job = user;
+    pin_thread_to_cpu(numa_worker_cpu(job->topology, worker));
+}
+
+unsigned int band_node(unsigned int tile_row, unsigned int tiles_y, unsigned int node_count) {
+    // Every node owns a horizontal band of tile rows, so its framebuffer pages aren't shared.
+    return tile_row * node_count / tiles_y;
+}
+
+void prepare_numa_node(unsigned int node, void* user) {
+    // Runs pinned to the node: replicate the read-only scene and first-touch the node's framebuffer band.
+    render_job* job = user;
+    job->replicas[node] = copy_scene(job->worlds[0]);
+
+    const int tile_size = job->tiles->tile_size;
+    for (unsigned int row = 0; row < job->tiles->tiles_y; ++row) {
+        if (band_node(row, job->tiles->tiles_y, job->topology->node_count) != node) continue;
+        const int y0 = row * tile_size;
+        if (job->accum && job->accumulate) {
+            // Already holds earlier passes, they were first touched by then.
+            continue;
+        }
+        else if (job->accum) {
+            const int y1 = HMM_MIN(y0 + tile_size, job->accum->height);
+            memset(accum_at(job->accum, 0, y0), 0, sizeof(accum_pixel) * job->accum->width * (y1 - y0));
+        }
+        else {
+            const int y1 = HMM_MIN(y0 + tile_size, job->fb->height);
+            memset(framebuffer_at(job->fb, 0, y0), 0, sizeof(color) * job->fb->width * (y1 - y0));
+        }
+    }
+}
+
+void report_numa_throughput(const render_job* job, const tile_worker_stats* stats, unsigned int threads, double elapsed) {
+    const unsigned int node_count = job->topology->node_count;
+    fprintf(stderr, "\n%-6s %8s %8s %8s %12s %14s %14s\n", "node", "threads", "tiles", "stolen", "Msamples", "Msamples/s", "per thread");
+
+    for (unsigned int node = 0; node < node_count; ++node) {
+        unsigned int node_threads = 0, tiles = 0, stolen = 0;
+        uint64_t pixels = 0;
+        double busy = 0.0;
+
+        for (unsigned int w = 0; w < threads; ++w) {
+            if (numa_worker_node(job->topology, w) != node) continue;
+            ++node_threads;
+            tiles += stats[w].tiles;
+            stolen += stats[w].stolen;
+            pixels += stats[w].pixels;
+            busy += stats[w].busy_seconds;
+        }
+
+        // Every pass takes the same number of samples, the stats sum all passes.
+        const double samples = (double) pixels * (job->sample_end - job->sample_begin);
+        fprintf(stderr, "%-6u %8u %8u %8u %12.2f %14.3f %14.3f\n", node, node_threads, tiles, stolen,
+            samples * 1e-6, samples / elapsed * 1e-6, busy > 0.0 ? samples / busy * 1e-6 : 0.0);
+    }
+}
+
+void run_render_job(render_job* job, int width, int height, bool progress) {
+    const render_options* options = job->options;
+    tile_set tiles = create_tile_set(width, height, options->tile_size, options->order, options->pixel_order);
+    job->cam = create_camera_from_params(&options->view, options->aspect_ratio);
+    job->tiles = &tiles;
+    job->world_count = 1;
+    const scene* world = job->worlds[0];
+
+    tile_dispatch_config config = {
+        .threads = options->threads,
+        .progress = progress
+    };
+
+    const unsigned int threads = HMM_MAX(options->threads, 1u);
+    numa_topology topology = { 0 };
+    unsigned int* tile_node = NULL;
+    unsigned int* worker_node = NULL;
+    tile_worker_stats* stats = NULL;
+
+    if (options->pin || options->numa) {
+        topology = detect_numa_topology();
+        job->topology = &topology;
+        config.worker_init = pin_render_worker;
+    }
+
+    if (options->numa) {
+        tile_node = malloc(sizeof(unsigned int) * tiles.length);
+        for (unsigned int i = 0; i < tiles.length; ++i) {
+            tile_node[i] = band_node(tiles.tiles[i].y0 / tiles.tile_size, tiles.tiles_y, topology.node_count);
+        }
+
+        worker_node = malloc(sizeof(unsigned int) * threads);
+        for (unsigned int w = 0; w < threads; ++w) {
+            worker_node[w] = numa_worker_node(&topology, w);
+        }
+
+        stats = calloc(threads, sizeof(tile_worker_stats));
+        config.queue_count = topology.node_count;
+        config.tile_queue = tile_node;
+        config.worker_queue = worker_node;
+        config.stats = stats;
+
+        run_on_each_node(&topology, prepare_numa_node, job);
+        for (unsigned int node = 0; node < topology.node_count; ++node) {
+            job->worlds[node] = job->replicas + node;
+        }
+        job->world_count = topology.node_count;
+    }
+
+    output_writer writer;
+    if (job->output) {
+        start_output_writer(&writer, job->output, job->fb, &tiles, &options->tonemap);
+        job->writer = &writer;
+    }
+
+    tile_candidates candidates = { 0 };
+    if (options->frustum_cull) {
+        const double cull_start = now_seconds();
+        candidates = build_tile_candidates(world, &job->cam, &tiles, options->image_width, options->image_height,
+            job->origin_x, job->origin_y);
+        job->candidates = &candidates;
+        if (progress) {
+            report_tile_candidates(&candidates, world, now_seconds() - cull_start);
+        }
+    }
+
+    // Workers, replicas and candidates are set up once and serve every pass.
+    tile_pool pool;
+    start_tile_pool(&pool, &tiles, &config, render_tile, job);
+    const double start = now_seconds();
+
+    if (job->progressive) {
+        for (int s = 0; s < options->samples_per_pixel && (job->deadline <= 0.0 || now_seconds() < job->deadline); ++s) {
+            job->sample_begin = s;
+            job->sample_end = s + 1;
+            run_tile_pass(&pool);
+            ++job->passes;
+        }
+    }
+    else {
+        job->sample_begin = options->sample_begin;
+        job->sample_end = render_sample_end(options);
+        run_tile_pass(&pool);
+    }
+
+    const double elapsed = now_seconds() - start;
+    finish_tile_pool(&pool);
+
+    if (job->writer) {
+        finish_output_writer(&writer, progress);
+        job->writer = NULL;
+    }
+
+    if (options->numa) {
+        report_numa_throughput(job, stats, threads, elapsed);
+        for (unsigned int node = 0; node < topology.node_count; ++node) {
+            destroy_scene(job->replicas + node);
+        }
+        // The job may run again, with fresh replicas.
+        job->worlds[0] = world;
+    }
+
+    destroy_tile_candidates(&candidates);
+    job->candidates = NULL;
+    free(stats);
+    free(worker_node);
+    free(tile_node);
+    destroy_numa_topology(&topology);
+    destroy_tile_set(&tiles);
+    job->tiles = NULL;
+    job->topology = NULL;
+}
+
+void render_region(const render_options* options, const scene* world, framebuffer* fb, int origin_x, int origin_y, bool progress) {
+    render_job job = {
+        .options = options,
+        .fb = fb,
+        .origin_x = origin_x,
+        .origin_y = origin_y,
+        .worlds = { world }
+    };
+    run_render_job(&job, fb->width, fb->height, progress);
+}
+
+void render_accum(const render_options* options, const scene* world, accum_buffer* accum, bool progress) {
+    render_job job = {
+        .options = options,
+        .accum = accum,
+        .worlds = { world }
+    };
+    run_render_job(&job, accum->width, accum->height, progress);
+}
+
+void render_features(const render_options* options, const scene* world, framebuffer* fb, feature_buffer* features, bool progress) {
+    render_job job = {
+        .options = options,
+        .fb = fb,
+        .features = features,
+        .worlds = { world }
+    };
+    run_render_job(&job, fb->width, fb->height, progress);
+}
+
+unsigned int render_time_budget(const render_options* options, const scene* world, accum_buffer* accum, double seconds) {
+    // Progressive passes of one sample per pixel over the whole image until the budget runs
+    // out or samples_per_pixel is reached. Tiles left when time is up keep one sample less,
+    // every pixel's count is in its accumulation. Returns the number of passes started.
+    render_job job = {
+        .options = options,
+        .accum = accum,
+        .accumulate = true,
+        .deadline = now_seconds() + seconds,
+        .progressive = true,
+        .worlds = { world }
+    };
+    run_render_job(&job, accum->width, accum->height, false);
+    return job.passes;
+}
+
+void render(const render_options* options, const scene* world, framebuffer* fb, bool progress) {
+    render_region(options, world, fb, 0, 0, progress);
+}
+
+void render_to_stream(const render_options* options, const scene* world, framebuffer* fb, FILE* stream, bool progress) {
+    // Renders and writes the PPM, rows are written as soon as all their tiles are done.
+    render_job job = {
+        .options = options,
+        .fb = fb,
+        .output = stream,
+        .worlds = { world }
+    };
+    run_render_job(&job, fb->width, fb->height, progress);
+}
+
+void report_wavefront_stats(const wavefront_depth_stats* stats, int max_depth, const perf_counters* counters) {
+    fprintf(stderr, "\n%-6s %12s %11s %10s %10s", "depth", "rays", "reorder ms", "trace s", "Mrays/s");
+    for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+        fprintf(stderr, " %14s", perf_counter_names[c]);
+    }
+    fprintf(stderr, "\n");
+
+    uint64_t rays = 0;
+    double reorder = 0.0, trace = 0.0;
+    for (int depth = 0; depth < max_depth && stats[depth].rays > 0; ++depth) {
+        const wavefront_depth_stats* s = stats + depth;
+        fprintf(stderr, "%-6d %12llu %11.3f %10.3f %10.3f", depth, (unsigned long long) s->rays, s->reorder_seconds * 1e3,
+            s->trace_seconds, s->rays / s->trace_seconds * 1e-6);
+        // Per ray, so depths with few rays left compare with the first ones.
+        for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+            if (perf_available(counters, (perf_counter) c)) {
+                fprintf(stderr, " %14.2f", (double) s->counters[c] / s->rays);
+            }
+            else {
+                fprintf(stderr, " %14s", "n/a");
+            }
+        }
+        fprintf(stderr, "\n");
+        rays += s->rays;
+        reorder += s->reorder_seconds;
+        trace += s->trace_seconds;
+    }
+    fprintf(stderr, "%-6s %12llu %11.3f %10.3f %10.3f\n", "total", (unsigned long long) rays, reorder * 1e3, trace,
+        rays / (trace + reorder) * 1e-6);
+}
+
+void render_wavefront(const render_options* options, const scene* world, framebuffer* fb, bool progress) {
+    const camera cam = create_camera_from_params(&options->view, options->aspect_ratio);
+    const wavefront_config config = {
+        .world = world,
+        .cam = &cam,
+        .image_width = fb->width,
+        .image_height = fb->height,
+        .sample_begin = options->sample_begin,
+        .sample_end = render_sample_end(options),
+        .max_depth = options->max_depth,
+        .threads = options->threads,
+        .order = options->ray_order
+    };
+
+    accum_buffer accum = create_accum_buffer(fb->width, fb->height);
+    wavefront_depth_stats* stats = calloc(HMM_MAX(options->max_depth, 1), sizeof(wavefront_depth_stats));
+    perf_counters counters = perf_open();
+    render_wavefronts(&config, &accum, &counters, stats);
+
+    resolve_accum_pixels(accum.pixels, fb->pixels, (size_t) fb->width * fb->height);
+
+    if (progress) {
+        fprintf(stderr, "Wavefront tracing, %s order", ray_order_names[options->ray_order]);
+        report_wavefront_stats(stats, options->max_depth, &counters);
+    }
+
+    perf_close(&counters);
+    free(stats);
+    destroy_accum_buffer(&accum);
+}
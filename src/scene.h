@@ -0,0 +1,478 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "sphere_lanes.h"
+#include "plane.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "compressed_bvh.h"
+#include "grid.h"
+#include "instance.h"
+#include "mesh.h"
+
+// Acceleration structure hit_world() traces the spheres with, the default is the binary BVH.
+typedef enum scene_accel {
+    SCENE_ACCEL_BVH,
+    SCENE_ACCEL_WIDE,
+    SCENE_ACCEL_COMPRESSED,
+    SCENE_ACCEL_GRID,
+    SCENE_ACCEL_LINEAR,
+    SCENE_ACCEL_COUNT
+} scene_accel;
+
+const char* scene_accel_names[SCENE_ACCEL_COUNT] = { "bvh", "wide", "compressed", "grid", "linear" };
+
+bool parse_scene_accel(const char* name, scene_accel* accel) {
+    for (int i = 0; i < SCENE_ACCEL_COUNT; ++i) {
+        if (strcmp(name, scene_accel_names[i]) == 0) {
+            *accel = (scene_accel) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Spheres with a radius above this many times the median are kept out of the acceleration
+// structures, one of them would stretch the root over the whole scene.
+#define SCENE_LARGE_RADIUS 64.f
+
+typedef struct scene {
+    sphere* spheres;
+    unsigned int spheres_length;
+    unsigned int spheres_capacity;
+    // Copy of the spheres for the vector kernels of the linear search, see sphere_lanes.h.
+    sphere_lanes lanes;
+    // Unbounded planes and oversized spheres, tested by every ray before the acceleration
+    // structure, and the remaining spheres it is built over, see classify_scene_spheres().
+    plane* planes;
+    unsigned int planes_length;
+    unsigned int* large;
+    unsigned int large_length;
+    unsigned int* bounded;
+    unsigned int bounded_length;
+    // Built by build_scene_bvh(), hit_world() falls back to testing every sphere without it.
+    bvh accel;
+    // Collapsed from accel by derive_scene_accel().
+    wide_bvh wide;
+    compressed_bvh compressed;
+    // Built from the spheres directly.
+    uniform_grid grid;
+    scene_accel accel_kind;
+    // Repeated geometry placed by transforms, traced next to the spheres above.
+    instance_set instanced;
+    // Triangle meshes, each with its own BVH, see mesh.h.
+    mesh* meshes;
+    unsigned int meshes_length;
+    // Material ids handed out so far, every primitive added gets the next one.
+    unsigned int material_count;
+} scene;
+
+// Everything a scene is built from. Render jobs carry one, so every process working on a job
+// builds the same scene, and resident scenes are looked up by it.
+#define SCENE_MESH_PATH_MAX 256
+
+typedef struct scene_descriptor {
+    uint32_t seed;
+    // Small spheres of the random scene lie on a lattice from -size to size.
+    int32_t size;
+    // Copies of one sphere cluster instead of the random scene if not zero.
+    uint32_t instances;
+    int32_t accel;
+    uint8_t ground_plane;
+    uint8_t padding[3];
+    // OBJ file added as a triangle mesh, empty for none.
+    char mesh[SCENE_MESH_PATH_MAX];
+} scene_descriptor;
+
+typedef bool (*scene_factory)(const scene_descriptor* description, scene* world);
+
+bool same_scene_descriptor(const scene_descriptor* a, const scene_descriptor* b) {
+    return a->seed == b->seed && a->size == b->size && a->instances == b->instances && a->accel == b->accel &&
+        a->ground_plane == b->ground_plane && strncmp(a->mesh, b->mesh, SCENE_MESH_PATH_MAX) == 0;
+}
+
+void add_sphere(scene* world, const point3 center, const float radius, const material mat) {
+    if (world->spheres_length >= world->spheres_capacity) {
+        world->spheres_capacity = world->spheres_capacity ? world->spheres_capacity * 2 : 64;
+        world->spheres = realloc(world->spheres, sizeof(sphere) * world->spheres_capacity);
+    }
+
+    world->spheres[world->spheres_length] = (sphere) {
+        .center = center,
+        .radius = radius,
+        .material = mat
+    };
+    world->spheres[world->spheres_length].material.id = world->material_count++;
+
+    ++world->spheres_length;
+}
+
+void add_plane(scene* world, const point3 point, const hmm_v3 normal, const material mat) {
+    world->planes = realloc(world->planes, sizeof(plane) * (world->planes_length + 1));
+    world->planes[world->planes_length] = (plane) {
+        .point = point,
+        .normal = HMM_NormalizeVec3(normal),
+        .material = mat
+    };
+    world->planes[world->planes_length].material.id = world->material_count++;
+    ++world->planes_length;
+}
+
+unsigned int* copy_indices(const unsigned int* indices, unsigned int length) {
+    if (!indices) return NULL;
+    unsigned int* copy = malloc(sizeof(unsigned int) * (length > 0 ? length : 1));
+    memcpy(copy, indices, sizeof(unsigned int) * length);
+    return copy;
+}
+
+scene copy_scene(const scene* world) {
+    // Deep copy, the copy's pages are first touched by the calling thread.
+    const unsigned int capacity = HMM_MAX(world->spheres_length, 1u);
+    scene copy = {
+        .spheres = malloc(sizeof(sphere) * capacity),
+        .spheres_length = world->spheres_length,
+        .spheres_capacity = capacity
+    };
+    memcpy(copy.spheres, world->spheres, sizeof(sphere) * world->spheres_length);
+    copy.lanes = copy_sphere_lanes(&world->lanes);
+    if (world->planes_length > 0) {
+        copy.planes = malloc(sizeof(plane) * world->planes_length);
+        copy.planes_length = world->planes_length;
+        memcpy(copy.planes, world->planes, sizeof(plane) * world->planes_length);
+    }
+    copy.large = copy_indices(world->large, world->large_length);
+    copy.large_length = world->large_length;
+    copy.bounded = copy_indices(world->bounded, world->bounded_length);
+    copy.bounded_length = world->bounded_length;
+    copy.accel = copy_bvh(&world->accel);
+    copy.wide = copy_wide_bvh(&world->wide);
+    copy.compressed = copy_compressed_bvh(&world->compressed);
+    copy.grid = copy_grid(&world->grid);
+    copy.accel_kind = world->accel_kind;
+    copy.material_count = world->material_count;
+    copy.instanced = copy_instance_set(&world->instanced);
+    if (world->meshes_length > 0) {
+        copy.meshes = malloc(sizeof(mesh) * world->meshes_length);
+        copy.meshes_length = world->meshes_length;
+        for (unsigned int i = 0; i < world->meshes_length; ++i) {
+            copy.meshes[i] = copy_mesh(world->meshes + i);
+        }
+    }
+    return copy;
+}
+
+void destroy_scene(scene* world) {
+    for (unsigned int i = 0; i < world->meshes_length; ++i) {
+        destroy_mesh(world->meshes + i);
+    }
+    free(world->meshes);
+    destroy_instance_set(&world->instanced);
+    destroy_grid(&world->grid);
+    destroy_compressed_bvh(&world->compressed);
+    destroy_wide_bvh(&world->wide);
+    destroy_bvh(&world->accel);
+    free(world->bounded);
+    free(world->large);
+    free(world->planes);
+    destroy_sphere_lanes(&world->lanes);
+    free(world->spheres);
+    *world = (scene) { 0 };
+}
+
+bool hit_spheres(const scene* world, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    if (world->lanes.length == world->spheres_length) {
+        return intersect_sphere_lanes(&world->lanes, r, t_min, any_hit, hit);
+    }
+
+    // The distance stays in a local, the loop would go through memory with hit->t.
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+
+    for (unsigned int i = 0; i < world->spheres_length; ++i) {
+        if (intersect_sphere(world->spheres + i, r, t_min, &closest_so_far)) {
+            hit_anything = true;
+            hit->primitive = i;
+            if (any_hit) break;
+        }
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
+
+int compare_radius(const void* a, const void* b) {
+    const float ra = *(const float*) a, rb = *(const float*) b;
+    return (ra > rb) - (ra < rb);
+}
+
+void classify_scene_spheres(scene* world) {
+    // Spheres added since the last call are classified again along with the others, and their
+    // lanes rebuilt.
+    destroy_sphere_lanes(&world->lanes);
+    world->lanes = create_sphere_lanes(world->spheres, world->spheres_length);
+    free(world->large);
+    free(world->bounded);
+    const unsigned int capacity = HMM_MAX(world->spheres_length, 1u);
+    world->large = malloc(sizeof(unsigned int) * capacity);
+    world->bounded = malloc(sizeof(unsigned int) * capacity);
+    world->large_length = 0;
+    world->bounded_length = 0;
+    if (world->spheres_length == 0) return;
+
+    float* radii = malloc(sizeof(float) * world->spheres_length);
+    for (unsigned int i = 0; i < world->spheres_length; ++i) {
+        radii[i] = world->spheres[i].radius;
+    }
+    qsort(radii, world->spheres_length, sizeof(float), compare_radius);
+    const float large_radius = radii[world->spheres_length / 2] * SCENE_LARGE_RADIUS;
+    free(radii);
+
+    for (unsigned int i = 0; i < world->spheres_length; ++i) {
+        if (world->spheres[i].radius > large_radius) {
+            world->large[world->large_length++] = i;
+        }
+        else {
+            world->bounded[world->bounded_length++] = i;
+        }
+    }
+}
+
+void build_scene_bvh(scene* world) {
+    classify_scene_spheres(world);
+    destroy_bvh(&world->accel);
+    aabb* bounds = create_sphere_bounds(world->spheres, world->spheres_length);
+    world->accel = build_bvh_subset(bounds, world->bounded, world->bounded_length);
+    free(bounds);
+}
+
+bool scene_traces_linearly(const scene* world) {
+    return world->accel_kind == SCENE_ACCEL_LINEAR || (world->accel_kind == SCENE_ACCEL_BVH && !world->accel.nodes);
+}
+
+void derive_scene_accel(scene* world) {
+    // Collapses the wide and compressed layouts from the binary BVH as it is, the grid is built
+    // from the spheres themselves.
+    const scene_accel kind = world->accel_kind;
+    destroy_grid(&world->grid);
+    destroy_compressed_bvh(&world->compressed);
+    destroy_wide_bvh(&world->wide);
+    if (kind == SCENE_ACCEL_WIDE || kind == SCENE_ACCEL_COMPRESSED) {
+        world->wide = collapse_bvh(&world->accel);
+    }
+    if (kind == SCENE_ACCEL_COMPRESSED) {
+        world->compressed = compress_bvh(&world->wide);
+        destroy_wide_bvh(&world->wide);
+    }
+    if (kind == SCENE_ACCEL_GRID) {
+        world->grid = build_grid(world->spheres, world->bounded, world->bounded_length);
+    }
+}
+
+void select_scene_accel(scene* world, scene_accel kind) {
+    // Builds the binary BVH with SAH, or just classifies the spheres for the layouts that don't
+    // need it, and derives the selected layout.
+    world->accel_kind = kind;
+    destroy_bvh(&world->accel);
+    if (kind != SCENE_ACCEL_LINEAR && kind != SCENE_ACCEL_GRID) {
+        build_scene_bvh(world);
+    }
+    else {
+        classify_scene_spheres(world);
+    }
+    derive_scene_accel(world);
+}
+
+void refresh_scene_accel(scene* world) {
+    // After the spheres moved and the binary BVH was refit or rebuilt. The wide and compressed
+    // layouts keep its topology, they're collapsed again instead of built with SAH, so only the
+    // grid and the lanes of the linear search start over.
+    if (scene_traces_linearly(world)) {
+        destroy_sphere_lanes(&world->lanes);
+        world->lanes = create_sphere_lanes(world->spheres, world->spheres_length);
+    }
+    derive_scene_accel(world);
+}
+
+void add_mesh(scene* world, const mesh* m) {
+    // Takes ownership of the mesh.
+    world->meshes = realloc(world->meshes, sizeof(mesh) * (world->meshes_length + 1));
+    world->meshes[world->meshes_length] = *m;
+    world->meshes[world->meshes_length].material.id = world->material_count++;
+    ++world->meshes_length;
+}
+
+void add_scene_instance(scene* world, unsigned int group, const transform* to_world) {
+    // The group's spheres have to be added first, each placement gets one material id per sphere.
+    add_instance(&world->instanced, group, to_world, world->material_count);
+    world->material_count += world->instanced.groups[group].length;
+}
+
+// Kind of primitive a scene_hit refers to, hit.primitive indexes the matching array.
+typedef enum scene_primitive {
+    SCENE_PRIMITIVE_SPHERE,
+    SCENE_PRIMITIVE_PLANE,
+    SCENE_PRIMITIVE_INSTANCE,
+    SCENE_PRIMITIVE_MESH
+} scene_primitive;
+
+typedef struct scene_hit {
+    ray_hit hit;
+    scene_primitive kind;
+    // Index of the mesh for SCENE_PRIMITIVE_MESH.
+    unsigned int object;
+} scene_hit;
+
+// Spheres a group of rays can hit, like the candidates of an image tile's primary rays. Large
+// spheres have to be listed too, they aren't tested separately.
+typedef struct sphere_subset {
+    const unsigned int* indices;
+    unsigned int length;
+} sphere_subset;
+
+bool hit_sphere_subset(const scene* world, const sphere_subset* subset, const ray* r, float t_min, bool any_hit,
+    ray_hit* hit) {
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+
+    for (unsigned int i = 0; i < subset->length; ++i) {
+        if (intersect_sphere(world->spheres + subset->indices[i], r, t_min, &closest_so_far)) {
+            hit_anything = true;
+            hit->primitive = subset->indices[i];
+            if (any_hit) break;
+        }
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
+
+bool search_world(const scene* world, const sphere_subset* subset, const ray* r, float t_min, bool any_hit,
+    scene_hit* closest) {
+    // Only the spheres of subset are tested if it is set, otherwise the large ones and the
+    // acceleration structure. Unbounded and large primitives go first, a hit on the ground
+    // shortens the search below.
+    ray_hit* hit = &closest->hit;
+    bool hit_anything = false;
+    for (unsigned int i = 0; i < world->planes_length; ++i) {
+        if (intersect_plane(world->planes + i, r, t_min, &hit->t)) {
+            if (any_hit) return true;
+            hit->primitive = i;
+            closest->kind = SCENE_PRIMITIVE_PLANE;
+            hit_anything = true;
+        }
+    }
+
+    // Testing every sphere covers the large ones too.
+    const bool linear = scene_traces_linearly(world);
+    if (!linear && !subset) {
+        for (unsigned int i = 0; i < world->large_length; ++i) {
+            if (intersect_sphere_at(world->spheres, world->large[i], r, t_min, hit)) {
+                if (any_hit) return true;
+                closest->kind = SCENE_PRIMITIVE_SPHERE;
+                hit_anything = true;
+            }
+        }
+    }
+
+    bool hit_spheres_accel;
+    if (subset) {
+        hit_spheres_accel = hit_sphere_subset(world, subset, r, t_min, any_hit, hit);
+    }
+    else if (linear) {
+        hit_spheres_accel = hit_spheres(world, r, t_min, any_hit, hit);
+    }
+    else if (world->accel_kind == SCENE_ACCEL_WIDE) {
+        hit_spheres_accel = wide_bvh_hit(&world->wide, world->spheres, r, t_min, any_hit, hit);
+    }
+    else if (world->accel_kind == SCENE_ACCEL_COMPRESSED) {
+        hit_spheres_accel = compressed_bvh_hit(&world->compressed, world->spheres, r, t_min, any_hit, hit);
+    }
+    else if (world->accel_kind == SCENE_ACCEL_GRID) {
+        hit_spheres_accel = grid_hit(&world->grid, world->spheres, r, t_min, any_hit, hit);
+    }
+    else {
+        hit_spheres_accel = bvh_hit(&world->accel, world->spheres, r, t_min, any_hit, hit);
+    }
+    if (hit_spheres_accel) {
+        if (any_hit) return true;
+        closest->kind = SCENE_PRIMITIVE_SPHERE;
+        hit_anything = true;
+    }
+
+    if (world->instanced.instances_length > 0 && hit_instances(&world->instanced, r, t_min, any_hit, hit)) {
+        if (any_hit) return true;
+        closest->kind = SCENE_PRIMITIVE_INSTANCE;
+        hit_anything = true;
+    }
+
+    for (unsigned int i = 0; i < world->meshes_length; ++i) {
+        if (hit_mesh(world->meshes + i, r, t_min, any_hit, hit)) {
+            if (any_hit) return true;
+            closest->kind = SCENE_PRIMITIVE_MESH;
+            closest->object = i;
+            hit_anything = true;
+        }
+    }
+    return hit_anything;
+}
+
+bool closest_hit(const scene* world, const ray* r, float t_min, float t_max, scene_hit* closest) {
+    // Only the distance and the primitive, see fill_scene_record() for the rest.
+    closest->hit.t = t_max;
+    return search_world(world, NULL, r, t_min, false, closest);
+}
+
+bool occluded(const scene* world, const ray* r, float t_min, float t_max) {
+    // Any intersection will do, the search stops at the first one.
+    scene_hit hit = { .hit.t = t_max };
+    return search_world(world, NULL, r, t_min, true, &hit);
+}
+
+void fill_scene_record(hit_record* rec, const ray* r, const scene* world, const scene_hit* closest) {
+    const ray_hit* hit = &closest->hit;
+    switch (closest->kind) {
+        case SCENE_PRIMITIVE_SPHERE:
+            fill_hit_record(rec, hit->t, r, world->spheres + hit->primitive);
+            break;
+        case SCENE_PRIMITIVE_PLANE:
+            fill_plane_record(rec, hit->t, r, world->planes + hit->primitive);
+            break;
+        case SCENE_PRIMITIVE_INSTANCE:
+            fill_instance_record(rec, r, &world->instanced, hit);
+            break;
+        case SCENE_PRIMITIVE_MESH:
+            fill_mesh_record(rec, r, world->meshes + closest->object, hit);
+            break;
+    }
+}
+
+color sky_color(const ray* r) {
+    // Light of rays leaving the scene.
+    hmm_v3 unit_direction = HMM_NormalizeVec3(r->direction);
+    const float t = 0.5f * (unit_direction.Y + 1.f);
+    color color0 = HMM_MultiplyVec3f(HMM_Vec3(1.f, 1.f, 1.f), (1.f - t));
+    color color1 = HMM_MultiplyVec3f(HMM_Vec3(0.5f, 0.7f, 1.f), t);
+    return HMM_AddVec3(color0, color1);
+}
+
+bool hit_world_subset(const scene* world, const sphere_subset* subset, const ray* r, float t_min, float t_max,
+    hit_record* rec) {
+    scene_hit closest = { .hit.t = t_max };
+    if (!search_world(world, subset, r, t_min, false, &closest)) return false;
+
+    fill_scene_record(rec, r, world, &closest);
+    return true;
+}
+
+bool hit_world(const scene* world, const ray* r, float t_min, float t_max, hit_record* rec) {
+    scene_hit closest;
+    if (!closest_hit(world, r, t_min, t_max, &closest)) return false;
+
+    fill_scene_record(rec, r, world, &closest);
+    return true;
+}
@@ -18,6 +18,14 @@ typedef struct hit_record {
     bool front_face;
 } hit_record;
 
+// What a closest or any hit search keeps: the distance and the primitive hit, part picks a
+// piece of it, like a packet's lane. The hit record is only filled in for the final hit.
+typedef struct ray_hit {
+    float t;
+    unsigned int primitive;
+    unsigned int part;
+} ray_hit;
+
 bool scatter_ray(const material* mat, const ray* r_in, const hit_record* rec, color* attenuation, ray* scattered) {
 
     if (mat->reflect) {
@@ -83,7 +91,8 @@ void fill_hit_record(hit_record* rec, const float t, const ray* r, const sphere*
     }
 }
 
-bool hit_sphere(const sphere* s, const ray* r, float t_min, float t_max, hit_record* rec) {
+bool intersect_sphere(const sphere* s, const ray* r, float t_min, float* t) {
+    // *t bounds the search, it becomes the distance to the sphere if that is closer.
     const hmm_v3 oc = HMM_SubtractVec3(r->origin, s->center);
     const float a = HMM_LengthSquaredVec3(r->direction);
     const float half_b = HMM_DotVec3(oc, r->direction);
@@ -93,18 +102,26 @@ bool hit_sphere(const sphere* s, const ray* r, float t_min, float t_max, hit_rec
     if (discriminant > 0.f) {
         const float root = sqrtf(discriminant);
 
-        float t = (-half_b - root) / a;
-        if (t < t_max && t > t_min) {
-            fill_hit_record(rec, t, r, s);
+        float root_t = (-half_b - root) / a;
+        if (root_t < *t && root_t > t_min) {
+            *t = root_t;
             return true;
         }
 
-        t = (-half_b + root) / a;
-        if (t < t_max && t > t_min) {
-            fill_hit_record(rec, t, r, s);
+        root_t = (-half_b + root) / a;
+        if (root_t < *t && root_t > t_min) {
+            *t = root_t;
             return true;
         }
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+bool hit_sphere(const sphere* s, const ray* r, float t_min, float t_max, hit_record* rec) {
+    float t = t_max;
+    if (!intersect_sphere(s, r, t_min, &t)) return false;
+
+    fill_hit_record(rec, t, r, s);
+    return true;
+}
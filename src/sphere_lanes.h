@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cpu.h"
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+
+// The spheres' centers and radii in one array per component, for testing a ray against a
+// run of spheres a vector at a time. The arrays are padded to whole vectors of the widest
+// kernel with NaN centers, which no ray hits. Each kernel variant finds the same sphere at
+// the same distance as intersect_sphere() in a loop, the arithmetic is done in the same order.
+
+#define SPHERE_LANES_PADDING 16
+
+typedef struct sphere_lanes {
+    float* x;
+    float* y;
+    float* z;
+    float* radius;
+    unsigned int length;
+    unsigned int padded;
+} sphere_lanes;
+
+sphere_lanes create_sphere_lanes(const sphere* spheres, unsigned int length) {
+    const unsigned int padded = (length + SPHERE_LANES_PADDING - 1) / SPHERE_LANES_PADDING * SPHERE_LANES_PADDING;
+    sphere_lanes lanes = { .length = length, .padded = padded };
+    if (padded == 0) return lanes;
+
+    lanes.x = aligned_alloc(64, sizeof(float) * 4 * padded);
+    lanes.y = lanes.x + padded;
+    lanes.z = lanes.y + padded;
+    lanes.radius = lanes.z + padded;
+    for (unsigned int i = 0; i < padded; ++i) {
+        const bool used = i < length;
+        lanes.x[i] = used ? spheres[i].center.X : NAN;
+        lanes.y[i] = used ? spheres[i].center.Y : NAN;
+        lanes.z[i] = used ? spheres[i].center.Z : NAN;
+        lanes.radius[i] = used ? spheres[i].radius : 0.f;
+    }
+    return lanes;
+}
+
+sphere_lanes copy_sphere_lanes(const sphere_lanes* lanes) {
+    sphere_lanes copy = *lanes;
+    if (lanes->padded == 0) return copy;
+
+    copy.x = aligned_alloc(64, sizeof(float) * 4 * lanes->padded);
+    copy.y = copy.x + lanes->padded;
+    copy.z = copy.y + lanes->padded;
+    copy.radius = copy.z + lanes->padded;
+    memcpy(copy.x, lanes->x, sizeof(float) * 4 * lanes->padded);
+    return copy;
+}
+
+void destroy_sphere_lanes(sphere_lanes* lanes) {
+    free(lanes->x);
+    *lanes = (sphere_lanes) { 0 };
+}
+
+// Closest or any hit among all spheres of lanes, like hit_spheres().
+typedef bool (*sphere_lanes_fn)(const sphere_lanes* lanes, const ray* r, float t_min, bool any_hit, ray_hit* hit);
+
+bool intersect_sphere_lanes_scalar(const sphere_lanes* lanes, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    const float a = HMM_LengthSquaredVec3(r->direction);
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+
+    for (unsigned int i = 0; i < lanes->length; ++i) {
+        const hmm_v3 oc = HMM_SubtractVec3(r->origin, HMM_Vec3(lanes->x[i], lanes->y[i], lanes->z[i]));
+        const float half_b = HMM_DotVec3(oc, r->direction);
+        const float c = HMM_LengthSquaredVec3(oc) - lanes->radius[i] * lanes->radius[i];
+        const float discriminant = half_b * half_b - a * c;
+        if (!(discriminant > 0.f)) continue;
+
+        const float root = sqrtf(discriminant);
+        const float near = (-half_b - root) / a;
+        const float t = near > t_min ? near : (-half_b + root) / a;
+        if (t > t_min && t < closest_so_far) {
+            hit_anything = true;
+            closest_so_far = t;
+            hit->primitive = i;
+            if (any_hit) break;
+        }
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
+
+#ifdef CPU_X86
+bool take_sphere_lanes_hit(const float* t, unsigned int mask, unsigned int first, bool any_hit, float* closest_so_far,
+    ray_hit* hit) {
+    // Lanes set in mask all hit closer than *closest_so_far. The first of them wins an any hit
+    // search, the closest a closest hit search, on ties the lowest index like a scalar loop.
+    do {
+        const unsigned int lane = (unsigned int) __builtin_ctz(mask);
+        if (t[lane] < *closest_so_far) {
+            *closest_so_far = t[lane];
+            hit->primitive = first + lane;
+            if (any_hit) return true;
+        }
+        mask &= mask - 1;
+    } while (mask);
+    return false;
+}
+
+CPU_TARGET_SSE4 bool intersect_sphere_lanes_sse4(const sphere_lanes* lanes, const ray* r, float t_min, bool any_hit,
+    ray_hit* hit) {
+    const __m128 origin[3] = { _mm_set1_ps(r->origin.X), _mm_set1_ps(r->origin.Y), _mm_set1_ps(r->origin.Z) };
+    const __m128 direction[3] = {
+        _mm_set1_ps(r->direction.X), _mm_set1_ps(r->direction.Y), _mm_set1_ps(r->direction.Z)
+    };
+    const __m128 a = _mm_set1_ps(HMM_LengthSquaredVec3(r->direction));
+    const __m128 low = _mm_set1_ps(t_min);
+    const __m128 sign = _mm_set1_ps(-0.f);
+    const __m128 zero = _mm_setzero_ps();
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+    __m128 closest = _mm_set1_ps(closest_so_far);
+
+    for (unsigned int first = 0; first < lanes->padded; first += 4) {
+        const __m128 ocx = _mm_sub_ps(origin[0], _mm_load_ps(lanes->x + first));
+        const __m128 ocy = _mm_sub_ps(origin[1], _mm_load_ps(lanes->y + first));
+        const __m128 ocz = _mm_sub_ps(origin[2], _mm_load_ps(lanes->z + first));
+        const __m128 radius = _mm_load_ps(lanes->radius + first);
+        const __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, direction[0]), _mm_mul_ps(ocy, direction[1])),
+            _mm_mul_ps(ocz, direction[2]));
+        const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)),
+            _mm_mul_ps(ocz, ocz)), _mm_mul_ps(radius, radius));
+        const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+        const __m128 crossed = _mm_cmpgt_ps(discriminant, zero);
+        if (!_mm_movemask_ps(crossed)) continue;
+
+        const __m128 root = _mm_sqrt_ps(discriminant);
+        const __m128 minus_half_b = _mm_xor_ps(half_b, sign);
+        const __m128 near = _mm_div_ps(_mm_sub_ps(minus_half_b, root), a);
+        const __m128 far = _mm_div_ps(_mm_add_ps(minus_half_b, root), a);
+        const __m128 t = _mm_blendv_ps(far, near, _mm_cmpgt_ps(near, low));
+        const __m128 found = _mm_and_ps(crossed, _mm_and_ps(_mm_cmpgt_ps(t, low), _mm_cmplt_ps(t, closest)));
+
+        const unsigned int mask = (unsigned int) _mm_movemask_ps(found);
+        if (!mask) continue;
+        float ts[4];
+        _mm_storeu_ps(ts, t);
+        hit_anything = true;
+        if (take_sphere_lanes_hit(ts, mask, first, any_hit, &closest_so_far, hit)) break;
+        closest = _mm_set1_ps(closest_so_far);
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
+
+CPU_TARGET_AVX2 bool intersect_sphere_lanes_avx2(const sphere_lanes* lanes, const ray* r, float t_min, bool any_hit,
+    ray_hit* hit) {
+    const __m256 origin[3] = { _mm256_set1_ps(r->origin.X), _mm256_set1_ps(r->origin.Y), _mm256_set1_ps(r->origin.Z) };
+    const __m256 direction[3] = {
+        _mm256_set1_ps(r->direction.X), _mm256_set1_ps(r->direction.Y), _mm256_set1_ps(r->direction.Z)
+    };
+    const __m256 a = _mm256_set1_ps(HMM_LengthSquaredVec3(r->direction));
+    const __m256 low = _mm256_set1_ps(t_min);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    const __m256 zero = _mm256_setzero_ps();
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+    __m256 closest = _mm256_set1_ps(closest_so_far);
+
+    for (unsigned int first = 0; first < lanes->padded; first += 8) {
+        const __m256 ocx = _mm256_sub_ps(origin[0], _mm256_load_ps(lanes->x + first));
+        const __m256 ocy = _mm256_sub_ps(origin[1], _mm256_load_ps(lanes->y + first));
+        const __m256 ocz = _mm256_sub_ps(origin[2], _mm256_load_ps(lanes->z + first));
+        const __m256 radius = _mm256_load_ps(lanes->radius + first);
+        const __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, direction[0]),
+            _mm256_mul_ps(ocy, direction[1])), _mm256_mul_ps(ocz, direction[2]));
+        const __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+            _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(radius, radius));
+        const __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+        const __m256 crossed = _mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ);
+        if (!_mm256_movemask_ps(crossed)) continue;
+
+        const __m256 root = _mm256_sqrt_ps(discriminant);
+        const __m256 minus_half_b = _mm256_xor_ps(half_b, sign);
+        const __m256 near = _mm256_div_ps(_mm256_sub_ps(minus_half_b, root), a);
+        const __m256 far = _mm256_div_ps(_mm256_add_ps(minus_half_b, root), a);
+        const __m256 t = _mm256_blendv_ps(far, near, _mm256_cmp_ps(near, low, _CMP_GT_OQ));
+        const __m256 found = _mm256_and_ps(crossed,
+            _mm256_and_ps(_mm256_cmp_ps(t, low, _CMP_GT_OQ), _mm256_cmp_ps(t, closest, _CMP_LT_OQ)));
+
+        const unsigned int mask = (unsigned int) _mm256_movemask_ps(found);
+        if (!mask) continue;
+        float ts[8];
+        _mm256_storeu_ps(ts, t);
+        hit_anything = true;
+        if (take_sphere_lanes_hit(ts, mask, first, any_hit, &closest_so_far, hit)) break;
+        closest = _mm256_set1_ps(closest_so_far);
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
+
+CPU_TARGET_AVX512 bool intersect_sphere_lanes_avx512(const sphere_lanes* lanes, const ray* r, float t_min,
+    bool any_hit, ray_hit* hit) {
+    // 16 spheres a step. The range checks are mask registers: each compare only runs on the
+    // lanes the one before it let through, instead of ANDing full-width compare results.
+    const __m512 origin[3] = { _mm512_set1_ps(r->origin.X), _mm512_set1_ps(r->origin.Y), _mm512_set1_ps(r->origin.Z) };
+    const __m512 direction[3] = {
+        _mm512_set1_ps(r->direction.X), _mm512_set1_ps(r->direction.Y), _mm512_set1_ps(r->direction.Z)
+    };
+    const __m512 a = _mm512_set1_ps(HMM_LengthSquaredVec3(r->direction));
+    const __m512 low = _mm512_set1_ps(t_min);
+    const __m512 sign = _mm512_set1_ps(-0.f);
+    const __m512 zero = _mm512_setzero_ps();
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+    __m512 closest = _mm512_set1_ps(closest_so_far);
+
+    for (unsigned int first = 0; first < lanes->padded; first += 16) {
+        const __m512 ocx = _mm512_sub_ps(origin[0], _mm512_load_ps(lanes->x + first));
+        const __m512 ocy = _mm512_sub_ps(origin[1], _mm512_load_ps(lanes->y + first));
+        const __m512 ocz = _mm512_sub_ps(origin[2], _mm512_load_ps(lanes->z + first));
+        const __m512 radius = _mm512_load_ps(lanes->radius + first);
+        const __m512 half_b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, direction[0]),
+            _mm512_mul_ps(ocy, direction[1])), _mm512_mul_ps(ocz, direction[2]));
+        const __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)),
+            _mm512_mul_ps(ocz, ocz)), _mm512_mul_ps(radius, radius));
+        const __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(half_b, half_b), _mm512_mul_ps(a, c));
+
+        // Most rays pass all 16 spheres, the roots are only taken when one is crossed.
+        const __mmask16 crossed = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GT_OQ);
+        if (!crossed) continue;
+
+        const __m512 root = _mm512_sqrt_ps(discriminant);
+        const __m512 minus_half_b = _mm512_xor_ps(half_b, sign);
+        const __m512 near = _mm512_div_ps(_mm512_sub_ps(minus_half_b, root), a);
+        const __m512 far = _mm512_div_ps(_mm512_add_ps(minus_half_b, root), a);
+        const __m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(near, low, _CMP_GT_OQ), far, near);
+        const __mmask16 above = _mm512_mask_cmp_ps_mask(crossed, t, low, _CMP_GT_OQ);
+        const unsigned int mask = _mm512_mask_cmp_ps_mask(above, t, closest, _CMP_LT_OQ);
+
+        if (!mask) continue;
+        float ts[16];
+        _mm512_storeu_ps(ts, t);
+        hit_anything = true;
+        if (take_sphere_lanes_hit(ts, mask, first, any_hit, &closest_so_far, hit)) break;
+        closest = _mm512_set1_ps(closest_so_far);
+    }
+
+    hit->t = closest_so_far;
+    return hit_anything;
+}
+#endif
+
+sphere_lanes_fn intersect_sphere_lanes = intersect_sphere_lanes_scalar;
+
+cpu_isa select_sphere_lanes_kernel(cpu_isa isa) {
+#ifdef CPU_X86
+    if (isa >= CPU_ISA_AVX512) {
+        intersect_sphere_lanes = intersect_sphere_lanes_avx512;
+        return CPU_ISA_AVX512;
+    }
+    if (isa >= CPU_ISA_AVX2) {
+        intersect_sphere_lanes = intersect_sphere_lanes_avx2;
+        return CPU_ISA_AVX2;
+    }
+    if (isa >= CPU_ISA_SSE4) {
+        intersect_sphere_lanes = intersect_sphere_lanes_sse4;
+        return CPU_ISA_SSE4;
+    }
+#endif
+    intersect_sphere_lanes = intersect_sphere_lanes_scalar;
+    return CPU_ISA_SCALAR;
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "math.h"
+#include "perf.h"
+
+#define MAX_TILE_SIZE 256
+
+typedef enum tile_order {
+    TILE_ORDER_SCANLINE,
+    TILE_ORDER_MORTON,
+    TILE_ORDER_HILBERT,
+    TILE_ORDER_COUNT
+} tile_order;
+
+const char* tile_order_names[TILE_ORDER_COUNT] = { "scanline", "morton", "hilbert" };
+
+typedef struct tile {
+    // Pixel bounds, rows counted from the top of the image, max is exclusive.
+    int x0, y0;
+    int x1, y1;
+    unsigned int index;     // position in scanline order, independent of the traversal order
+} tile;
+
+typedef struct tile_set {
+    tile* tiles;
+    unsigned int length;
+    unsigned int tiles_x, tiles_y;
+    int tile_size;
+    // Visiting order of the pixels inside a tile, packed as x | (y << 8).
+    uint16_t* pixel_order;
+    unsigned int pixel_order_length;
+} tile_set;
+
+bool parse_tile_order(const char* name, tile_order* order) {
+    for (int i = 0; i < TILE_ORDER_COUNT; ++i) {
+        if (strcmp(name, tile_order_names[i]) == 0) {
+            *order = (tile_order) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint32_t morton_encode_2d(uint32_t x, uint32_t y) {
+    // Interleave the lower 16 bits of x and y.
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+
+    y &= 0xffff;
+    y = (y | (y << 8)) & 0x00ff00ff;
+    y = (y | (y << 4)) & 0x0f0f0f0f;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+
+    return x | (y << 1);
+}
+
+uint32_t hilbert_encode_2d(uint32_t n, uint32_t x, uint32_t y) {
+    // Distance along the Hilbert curve filling an n x n grid, n must be a power of two.
+    uint32_t d = 0;
+
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        const uint32_t rx = (x & s) > 0;
+        const uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the sub-curve is in canonical orientation.
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            const uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+
+    return d;
+}
+
+uint32_t next_power_of_two(uint32_t v) {
+    uint32_t n = 1;
+    while (n < v) n <<= 1;
+    return n;
+}
+
+uint32_t curve_key(tile_order order, uint32_t width, uint32_t x, uint32_t y) {
+    switch (order) {
+        case TILE_ORDER_MORTON:
+            return morton_encode_2d(x, y);
+        case TILE_ORDER_HILBERT:
+            return hilbert_encode_2d(next_power_of_two(width), x, y);
+        default:
+            return y * width + x;
+    }
+}
+
+typedef struct curve_entry {
+    uint32_t key;
+    uint32_t value;
+} curve_entry;
+
+int compare_curve_entry(const void* a, const void* b) {
+    const uint32_t ka = ((const curve_entry*) a)->key;
+    const uint32_t kb = ((const curve_entry*) b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+void sort_along_curve(curve_entry* entries, unsigned int length, tile_order order, uint32_t grid_x, uint32_t grid_y) {
+    // Grids that aren't square powers of two are embedded in the enclosing one, so keys stay unique.
+    const uint32_t grid = order == TILE_ORDER_SCANLINE ? grid_x : next_power_of_two(grid_x > grid_y ? grid_x : grid_y);
+
+    for (unsigned int i = 0; i < length; ++i) {
+        const uint32_t x = entries[i].value % grid_x;
+        const uint32_t y = entries[i].value / grid_x;
+        entries[i].key = curve_key(order, grid, x, y);
+    }
+
+    qsort(entries, length, sizeof(curve_entry), compare_curve_entry);
+}
+
+tile_set create_tile_set(int width, int height, int tile_size, tile_order order, tile_order pixel_order) {
+    tile_set set = { 0 };
+    set.tile_size = HMM_Clamp(1, tile_size, MAX_TILE_SIZE);
+    set.tiles_x = (width + set.tile_size - 1) / set.tile_size;
+    set.tiles_y = (height + set.tile_size - 1) / set.tile_size;
+    set.length = set.tiles_x * set.tiles_y;
+    set.tiles = malloc(sizeof(tile) * set.length);
+
+    const unsigned int entries_length = HMM_MAX(set.length, (unsigned int)(set.tile_size * set.tile_size));
+    curve_entry* entries = malloc(sizeof(curve_entry) * entries_length);
+
+    for (unsigned int i = 0; i < set.length; ++i) {
+        entries[i].value = i;
+    }
+
+    sort_along_curve(entries, set.length, order, set.tiles_x, set.tiles_y);
+
+    for (unsigned int i = 0; i < set.length; ++i) {
+        const unsigned int index = entries[i].value;
+        const int tx = index % set.tiles_x;
+        const int ty = index / set.tiles_x;
+
+        set.tiles[i] = (tile) {
+            .x0 = tx * set.tile_size,
+            .y0 = ty * set.tile_size,
+            .x1 = HMM_MIN((tx + 1) * set.tile_size, width),
+            .y1 = HMM_MIN((ty + 1) * set.tile_size, height),
+            .index = index
+        };
+    }
+
+    set.pixel_order_length = set.tile_size * set.tile_size;
+    set.pixel_order = malloc(sizeof(uint16_t) * set.pixel_order_length);
+
+    for (unsigned int i = 0; i < set.pixel_order_length; ++i) {
+        entries[i].value = i;
+    }
+
+    sort_along_curve(entries, set.pixel_order_length, pixel_order, set.tile_size, set.tile_size);
+
+    for (unsigned int i = 0; i < set.pixel_order_length; ++i) {
+        const unsigned int x = entries[i].value % set.tile_size;
+        const unsigned int y = entries[i].value / set.tile_size;
+        // 256 wide tiles store offset 255 at most, so both fit in a byte.
+        set.pixel_order[i] = (uint16_t)(x | (y << 8));
+    }
+
+    free(entries);
+    return set;
+}
+
+void destroy_tile_set(tile_set* set) {
+    free(set->tiles);
+    free(set->pixel_order);
+    *set = (tile_set) { 0 };
+}
+
+typedef void (*tile_render_fn)(const tile* t, const tile_set* set, unsigned int worker, void* user);
+
+typedef struct tile_worker_stats {
+    unsigned int tiles;
+    unsigned int stolen;        // tiles taken from another worker's home queue
+    uint64_t pixels;
+    double busy_seconds;
+} tile_worker_stats;
+
+typedef struct tile_dispatch_config {
+    unsigned int threads;
+    bool progress;
+    // Optional partition into several queues, e.g. one per NUMA node. tile_queue holds the
+    // queue of every tile, worker_queue the home queue of every worker. Tiles keep their
+    // traversal order inside a queue, workers steal from other queues once theirs is empty.
+    unsigned int queue_count;
+    const unsigned int* tile_queue;
+    const unsigned int* worker_queue;
+    // Optional hook run on each worker thread before it takes tiles, e.g. to pin it.
+    void (*worker_init)(unsigned int worker, void* user);
+    // Optional, one entry per thread.
+    tile_worker_stats* stats;
+} tile_dispatch_config;
+
+typedef struct tile_queue {
+    unsigned int* tiles;
+    unsigned int length;
+    atomic_uint next;
+} tile_queue;
+
+typedef struct tile_dispatch {
+    const tile_set* set;
+    const tile_dispatch_config* config;
+    tile_render_fn render;
+    void* user;
+    tile_queue* queues;
+    unsigned int queue_count;
+    atomic_uint remaining;
+} tile_dispatch;
+
+typedef struct tile_pool {
+    // Workers live across passes over the same tiles. Every pass the start barrier releases
+    // them into it, or out of their loop once stop is set, and the done barrier waits for all.
+    tile_dispatch dispatch;
+    pthread_t* handles;
+    struct tile_worker* workers;
+    unsigned int threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    bool stop;
+} tile_pool;
+
+typedef struct tile_worker {
+    tile_pool* pool;
+    unsigned int index;
+} tile_worker;
+
+const tile* next_tile(tile_dispatch* dispatch, unsigned int home, bool* stolen) {
+    for (unsigned int q = 0; q < dispatch->queue_count; ++q) {
+        tile_queue* queue = dispatch->queues + (home + q) % dispatch->queue_count;
+        if (atomic_load_explicit(&queue->next, memory_order_relaxed) >= queue->length) continue;
+
+        // Tiles are handed out in traversal order, so concurrent workers stay close on the curve.
+        const unsigned int i = atomic_fetch_add(&queue->next, 1);
+        if (i < queue->length) {
+            *stolen = q != 0;
+            return dispatch->set->tiles + queue->tiles[i];
+        }
+    }
+
+    return NULL;
+}
+
+void render_tile_pass(tile_dispatch* dispatch, unsigned int worker, unsigned int home) {
+    const tile_dispatch_config* config = dispatch->config;
+    tile_worker_stats stats = { 0 };
+    bool stolen;
+    const tile* t;
+
+    while ((t = next_tile(dispatch, home, &stolen)) != NULL) {
+        const unsigned int remaining = atomic_fetch_sub(&dispatch->remaining, 1) - 1;
+        if (config->progress) {
+            fprintf(stderr, "\rTiles remaining: %u ", remaining);
+        }
+
+        const double start = now_seconds();
+        dispatch->render(t, dispatch->set, worker, dispatch->user);
+        stats.busy_seconds += now_seconds() - start;
+        stats.tiles += 1;
+        stats.stolen += stolen;
+        stats.pixels += (uint64_t)(t->x1 - t->x0) * (uint64_t)(t->y1 - t->y0);
+    }
+
+    // Summed over all passes of the pool.
+    if (config->stats) {
+        tile_worker_stats* total = config->stats + worker;
+        total->tiles += stats.tiles;
+        total->stolen += stats.stolen;
+        total->pixels += stats.pixels;
+        total->busy_seconds += stats.busy_seconds;
+    }
+}
+
+void* tile_worker_main(void* arg) {
+    const tile_worker* worker = arg;
+    tile_pool* pool = worker->pool;
+    tile_dispatch* dispatch = &pool->dispatch;
+    const tile_dispatch_config* config = dispatch->config;
+    const unsigned int home = config->worker_queue ? config->worker_queue[worker->index] % dispatch->queue_count : 0;
+
+    if (config->worker_init) {
+        config->worker_init(worker->index, dispatch->user);
+    }
+
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->stop) return NULL;
+        render_tile_pass(dispatch, worker->index, home);
+        pthread_barrier_wait(&pool->done);
+    }
+}
+
+void start_tile_pool(tile_pool* pool, const tile_set* set, const tile_dispatch_config* config, tile_render_fn render,
+    void* user) {
+    *pool = (tile_pool) {
+        .dispatch = {
+            .set = set,
+            .config = config,
+            .render = render,
+            .user = user,
+            .queue_count = config->tile_queue && config->queue_count > 1 ? config->queue_count : 1
+        },
+        .threads = HMM_MAX(config->threads, 1u)
+    };
+    tile_dispatch* dispatch = &pool->dispatch;
+
+    const unsigned int queue_capacity = HMM_MAX(set->length, 1u);
+    dispatch->queues = calloc(dispatch->queue_count, sizeof(tile_queue));
+    for (unsigned int q = 0; q < dispatch->queue_count; ++q) {
+        dispatch->queues[q].tiles = malloc(sizeof(unsigned int) * queue_capacity);
+        atomic_init(&dispatch->queues[q].next, 0);
+    }
+
+    for (unsigned int i = 0; i < set->length; ++i) {
+        tile_queue* queue = dispatch->queues + (config->tile_queue ? config->tile_queue[i] % dispatch->queue_count : 0);
+        queue->tiles[queue->length++] = i;
+    }
+
+    if (config->stats) {
+        memset(config->stats, 0, sizeof(tile_worker_stats) * pool->threads);
+    }
+
+    pthread_barrier_init(&pool->start, NULL, pool->threads + 1);
+    pthread_barrier_init(&pool->done, NULL, pool->threads + 1);
+    pool->handles = malloc(sizeof(pthread_t) * pool->threads);
+    pool->workers = malloc(sizeof(tile_worker) * pool->threads);
+
+    for (unsigned int i = 0; i < pool->threads; ++i) {
+        pool->workers[i] = (tile_worker) { .pool = pool, .index = i };
+        pthread_create(pool->handles + i, NULL, tile_worker_main, pool->workers + i);
+    }
+}
+
+void run_tile_pass(tile_pool* pool) {
+    // Every pass hands out all tiles again, in the same queues and order.
+    tile_dispatch* dispatch = &pool->dispatch;
+    for (unsigned int q = 0; q < dispatch->queue_count; ++q) {
+        atomic_store(&dispatch->queues[q].next, 0);
+    }
+    atomic_store(&dispatch->remaining, dispatch->set->length);
+
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+}
+
+void finish_tile_pool(tile_pool* pool) {
+    pool->stop = true;
+    pthread_barrier_wait(&pool->start);
+    for (unsigned int i = 0; i < pool->threads; ++i) {
+        pthread_join(pool->handles[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->done);
+    pthread_barrier_destroy(&pool->start);
+
+    for (unsigned int q = 0; q < pool->dispatch.queue_count; ++q) {
+        free(pool->dispatch.queues[q].tiles);
+    }
+    free(pool->dispatch.queues);
+    free(pool->workers);
+    free(pool->handles);
+}
+
+void dispatch_tiles(const tile_set* set, const tile_dispatch_config* config, tile_render_fn render, void* user) {
+    tile_pool pool;
+    start_tile_pool(&pool, set, config, render, user);
+    run_tile_pass(&pool);
+    finish_tile_pool(&pool);
+}
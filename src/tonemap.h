@@ -0,0 +1,294 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "math.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TONEMAP_SSE2 1
+#endif
+
+// Converts a linear float framebuffer to gamma-encoded 8-bit in one pass over the image,
+// vectorized over the flat float array rather than per pixel.
+
+#define GAMMA_LUT_BITS 16
+#define GAMMA_LUT_SIZE (1 << GAMMA_LUT_BITS)
+
+typedef enum quantize_mode {
+    QUANTIZE_TRUNCATE,  // (int)(256 * clamp(v, 0, 0.999)), the classic write_color()
+    QUANTIZE_ROUND,     // nearest of 255 levels
+    QUANTIZE_DITHER,    // nearest after adding 4x4 ordered dither, hides banding in gradients
+    QUANTIZE_COUNT
+} quantize_mode;
+
+const char* quantize_mode_names[QUANTIZE_COUNT] = { "truncate", "round", "dither" };
+
+typedef struct tonemap_options {
+    quantize_mode mode;
+    // Look gamma up in a table instead of taking square roots. Always rounds to 255 levels.
+    bool gamma_lut;
+} tonemap_options;
+
+bool parse_quantize_mode(const char* name, quantize_mode* mode) {
+    for (int i = 0; i < QUANTIZE_COUNT; ++i) {
+        if (strcmp(name, quantize_mode_names[i]) == 0) {
+            *mode = (quantize_mode) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const float bayer_4x4[16] = {
+     0.f,  8.f,  2.f, 10.f,
+    12.f,  4.f, 14.f,  6.f,
+     3.f, 11.f,  1.f,  9.f,
+    15.f,  7.f, 13.f,  5.f
+};
+
+float dither_offset(int x, int y) {
+    // Centered in [-0.5, 0.5) of one output level.
+    return (bayer_4x4[(y & 3) * 4 + (x & 3)] + 0.5f) / 16.f - 0.5f;
+}
+
+uint16_t* create_gamma_lut() {
+    // Gamma 2 encoded values in 8.8 fixed point, indexed by the linear value.
+    uint16_t* lut = malloc(sizeof(uint16_t) * GAMMA_LUT_SIZE);
+    for (int i = 0; i < GAMMA_LUT_SIZE; ++i) {
+        const double encoded = sqrt((double) i / (GAMMA_LUT_SIZE - 1)) * 255.0 * 256.0;
+        lut[i] = (uint16_t) fmin(encoded + 0.5, 65535.0);
+    }
+    return lut;
+}
+
+uint8_t quantize_value(float linear, float dither, quantize_mode mode) {
+    // Scalar reference, the vector paths below produce the same bytes.
+    const float encoded = sqrtf(fmaxf(linear, 0.f));
+
+    if (mode == QUANTIZE_TRUNCATE) {
+        return (uint8_t)(int)(256.f * fminf(encoded, 0.999f));
+    }
+
+    const float level = fminf(encoded * 255.f + 0.5f + dither, 255.f);
+    return (uint8_t)(int) fmaxf(level, 0.f);
+}
+
+uint8_t quantize_value_lut(const uint16_t* lut, float linear, float dither) {
+    const float clamped = fminf(fmaxf(linear, 0.f), 1.f);
+    const int index = (int)(clamped * (GAMMA_LUT_SIZE - 1) + 0.5f);
+    const int level = ((int) lut[index] + (int)(dither * 256.f) + 128) >> 8;
+    return (uint8_t) HMM_Clamp(0, level, 255);
+}
+
+// Converts count floats of one row, dither holds a per-float offset or is NULL.
+typedef void (*tonemap_row_fn)(const float* in, uint8_t* out, size_t count, const float* dither, quantize_mode mode,
+    const uint16_t* lut);
+
+void tonemap_row_tail(const float* in, uint8_t* out, size_t i, size_t count, const float* dither, quantize_mode mode,
+    const uint16_t* lut) {
+    // From float i on, what the vector variants leave over.
+    for (; i < count; ++i) {
+        const float d = dither ? dither[i] : 0.f;
+        out[i] = lut ? quantize_value_lut(lut, in[i], d) : quantize_value(in[i], d, mode);
+    }
+}
+
+void tonemap_row_scalar(const float* in, uint8_t* out, size_t count, const float* dither, quantize_mode mode,
+    const uint16_t* lut) {
+    tonemap_row_tail(in, out, 0, count, dither, mode, lut);
+}
+
+#ifdef TONEMAP_SSE2
+void tonemap_row_sse2(const float* in, uint8_t* out, size_t count, const float* dither, quantize_mode mode,
+    const uint16_t* lut) {
+    size_t i = 0;
+    const __m128 zero = _mm_setzero_ps();
+
+    if (lut) {
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 lut_scale = _mm_set1_ps((float)(GAMMA_LUT_SIZE - 1));
+        const __m128 half = _mm_set1_ps(0.5f);
+        int32_t indices[4];
+
+        for (; i + 4 <= count; i += 4) {
+            const __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), zero), one);
+            _mm_storeu_si128((__m128i*) indices, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, lut_scale), half)));
+            for (int k = 0; k < 4; ++k) {
+                const int d = dither ? (int)(dither[i + k] * 256.f) : 0;
+                const int level = ((int) lut[indices[k]] + d + 128) >> 8;
+                out[i + k] = (uint8_t) HMM_Clamp(0, level, 255);
+            }
+        }
+    }
+    else {
+        const __m128 limit = _mm_set1_ps(mode == QUANTIZE_TRUNCATE ? 0.999f : 255.f);
+        const __m128 scale = _mm_set1_ps(mode == QUANTIZE_TRUNCATE ? 256.f : 255.f);
+        const __m128 bias = _mm_set1_ps(mode == QUANTIZE_TRUNCATE ? 0.f : 0.5f);
+
+        for (; i + 16 <= count; i += 16) {
+            __m128i levels[4];
+
+            for (int k = 0; k < 4; ++k) {
+                __m128 v = _mm_sqrt_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4 * k), zero));
+
+                if (mode == QUANTIZE_TRUNCATE) {
+                    v = _mm_mul_ps(scale, _mm_min_ps(v, limit));
+                }
+                else {
+                    v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v, scale), bias), dither ? _mm_loadu_ps(dither + i + 4 * k) : zero);
+                    v = _mm_max_ps(_mm_min_ps(v, limit), zero);
+                }
+
+                levels[k] = _mm_cvttps_epi32(v);
+            }
+
+            // Levels are in [0, 255], so the saturating packs are exact.
+            const __m128i low = _mm_packs_epi32(levels[0], levels[1]);
+            const __m128i high = _mm_packs_epi32(levels[2], levels[3]);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+        }
+    }
+
+    tonemap_row_tail(in, out, i, count, dither, mode, lut);
+}
+#endif
+
+#if defined(CPU_X86) && defined(TONEMAP_SSE2)
+CPU_TARGET_AVX2 void tonemap_row_avx2(const float* in, uint8_t* out, size_t count, const float* dither,
+    quantize_mode mode, const uint16_t* lut) {
+    // The table lookups don't widen, only the arithmetic path has an AVX2 variant.
+    if (lut) {
+        tonemap_row_sse2(in, out, count, dither, mode, lut);
+        return;
+    }
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 limit = _mm256_set1_ps(mode == QUANTIZE_TRUNCATE ? 0.999f : 255.f);
+    const __m256 scale = _mm256_set1_ps(mode == QUANTIZE_TRUNCATE ? 256.f : 255.f);
+    const __m256 bias = _mm256_set1_ps(mode == QUANTIZE_TRUNCATE ? 0.f : 0.5f);
+    // The packs work within 128-bit halves, this puts the 4 byte groups back in order.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i levels[4];
+
+        for (int k = 0; k < 4; ++k) {
+            __m256 v = _mm256_sqrt_ps(_mm256_max_ps(_mm256_loadu_ps(in + i + 8 * k), zero));
+
+            if (mode == QUANTIZE_TRUNCATE) {
+                v = _mm256_mul_ps(scale, _mm256_min_ps(v, limit));
+            }
+            else {
+                v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v, scale), bias),
+                    dither ? _mm256_loadu_ps(dither + i + 8 * k) : zero);
+                v = _mm256_max_ps(_mm256_min_ps(v, limit), zero);
+            }
+
+            levels[k] = _mm256_cvttps_epi32(v);
+        }
+
+        const __m256i low = _mm256_packs_epi32(levels[0], levels[1]);
+        const __m256i high = _mm256_packs_epi32(levels[2], levels[3]);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, high), order));
+    }
+
+    tonemap_row_tail(in, out, i, count, dither, mode, lut);
+}
+#endif
+
+#ifdef TONEMAP_SSE2
+tonemap_row_fn tonemap_row = tonemap_row_sse2;
+#else
+tonemap_row_fn tonemap_row = tonemap_row_scalar;
+#endif
+
+cpu_isa select_tonemap_kernel(cpu_isa isa) {
+    // The SSE2 variant is part of the x86-64 baseline and stands in for SSE4.
+#if defined(CPU_X86) && defined(TONEMAP_SSE2)
+    if (isa >= CPU_ISA_AVX2) {
+        tonemap_row = tonemap_row_avx2;
+        return CPU_ISA_AVX2;
+    }
+#endif
+#ifdef TONEMAP_SSE2
+    if (isa >= CPU_ISA_SSE4) {
+        tonemap_row = tonemap_row_sse2;
+        return CPU_ISA_SSE4;
+    }
+#endif
+    tonemap_row = tonemap_row_scalar;
+    return CPU_ISA_SCALAR;
+}
+
+typedef struct tonemap_context {
+    // Tables for converting rows of one image width, built once per image or writer.
+    quantize_mode mode;
+    int width;
+    uint16_t* lut;      // NULL without gamma_lut
+    float* dither;      // one offset row per row of the 4x4 pattern, NULL unless dithering
+} tonemap_context;
+
+tonemap_context create_tonemap_context(const tonemap_options* options, int width) {
+    const tonemap_options defaults = { 0 };
+    if (!options) options = &defaults;
+
+    tonemap_context context = {
+        .mode = options->gamma_lut && options->mode == QUANTIZE_TRUNCATE ? QUANTIZE_ROUND : options->mode,
+        .width = width,
+        .lut = options->gamma_lut ? create_gamma_lut() : NULL
+    };
+
+    if (options->mode == QUANTIZE_DITHER) {
+        const size_t row_floats = (size_t) width * 3;
+        context.dither = malloc(sizeof(float) * row_floats * 4);
+        for (int y = 0; y < 4; ++y) {
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < 3; ++c) {
+                    context.dither[y * row_floats + x * 3 + c] = dither_offset(x, y);
+                }
+            }
+        }
+    }
+
+    return context;
+}
+
+void destroy_tonemap_context(tonemap_context* context) {
+    free(context->dither);
+    free(context->lut);
+    *context = (tonemap_context) { 0 };
+}
+
+void tonemap_rows(const tonemap_context* context, const float* pixels, int y0, int y1, uint8_t* out) {
+    // Converts rows y0 to y1-1 of an RGB float image of the context's width, out receives 3 bytes per pixel.
+    const size_t row_floats = (size_t) context->width * 3;
+
+    for (int y = y0; y < y1; ++y) {
+        tonemap_row(pixels + (size_t) y * row_floats, out + (size_t)(y - y0) * row_floats, row_floats,
+            context->dither ? context->dither + (y & 3) * row_floats : NULL, context->mode, context->lut);
+    }
+}
+
+size_t format_ppm_rows(const uint8_t* rgb, size_t count, char* text) {
+    // Formats count bytes as P3 text, three values per line. text needs 4 * count bytes.
+    char* p = text;
+
+    for (size_t i = 0; i < count; i += 3) {
+        for (int c = 0; c < 3; ++c) {
+            const unsigned int v = rgb[i + c];
+            if (v >= 100) *p++ = (char)('0' + v / 100);
+            if (v >= 10) *p++ = (char)('0' + v / 10 % 10);
+            *p++ = (char)('0' + v % 10);
+            *p++ = c < 2 ? ' ' : '\n';
+        }
+    }
+
+    return (size_t)(p - text);
+}
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "scene.h"
+#include "camera.h"
+#include "accum.h"
+#include "tile.h"
+#include "perf.h"
+
+// Breadth-first path tracing. A wave of camera rays, one per pixel for one sample index, is
+// traced a bounce at a time: every path of the wave is intersected and scattered before the
+// next bounce starts, and in between the surviving rays can be reordered, so rays starting
+// near each other in similar directions traverse the scene one after another. Every path
+// carries its own random stream and follows exactly the rays of the recursive ray_color(),
+// only the attenuations are multiplied in a different order.
+
+#define WAVEFRONT_SIZE (1u << 18)
+#define WAVEFRONT_CHUNK 256u
+#define WAVEFRONT_DEAD UINT32_MAX
+// Bits per axis of the reorder key's direction and origin cells.
+#define WAVEFRONT_DIRECTION_BITS 3
+#define WAVEFRONT_ORIGIN_BITS 7
+
+typedef enum ray_order {
+    RAY_ORDER_NONE,
+    RAY_ORDER_OCTANT,
+    RAY_ORDER_MORTON,
+    RAY_ORDER_COUNT
+} ray_order;
+
+const char* ray_order_names[RAY_ORDER_COUNT] = { "none", "octant", "morton" };
+
+bool parse_ray_order(const char* name, ray_order* order) {
+    for (int i = 0; i < RAY_ORDER_COUNT; ++i) {
+        if (strcmp(name, ray_order_names[i]) == 0) {
+            *order = (ray_order) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+typedef struct wavefront_ray {
+    ray r;
+    color throughput;
+    // Framebuffer index, WAVEFRONT_DEAD once the path has ended.
+    uint32_t pixel;
+    uint64_t random_state;
+} wavefront_ray;
+
+typedef struct wavefront_config {
+    const scene* world;
+    const camera* cam;
+    int image_width;
+    int image_height;
+    int sample_begin;
+    int sample_end;
+    int max_depth;
+    unsigned int threads;
+    ray_order order;
+} wavefront_config;
+
+typedef struct wavefront_depth_stats {
+    uint64_t rays;
+    // Camera ray setup for the first bounce, compaction and sorting for the others.
+    double reorder_seconds;
+    double trace_seconds;
+    uint64_t counters[PERF_COUNTER_COUNT];
+} wavefront_depth_stats;
+
+typedef struct wavefront_pass {
+    const scene* world;
+    wavefront_ray* rays;
+    unsigned int length;
+    accum_pixel* sums;
+    atomic_uint next;
+} wavefront_pass;
+
+void trace_wavefront_ray(const scene* world, wavefront_ray* w, accum_pixel* sums) {
+    // One bounce of ray_color(), sky light is added to the pixel when the path leaves.
+    random_set_state(w->random_state);
+    hit_record rec;
+    if (hit_world(world, &w->r, 0.001f, INFINITY, &rec)) {
+        ray scattered;
+        color attenuation;
+        if (scatter_ray(&rec.material, &w->r, &rec, &attenuation, &scattered)) {
+            w->r = scattered;
+            w->throughput = HMM_MultiplyVec3(w->throughput, attenuation);
+        }
+        else {
+            w->pixel = WAVEFRONT_DEAD;
+        }
+    }
+    else {
+        accum_add_radiance(sums + w->pixel, HMM_MultiplyVec3(w->throughput, sky_color(&w->r)));
+        w->pixel = WAVEFRONT_DEAD;
+    }
+    w->random_state = random_get_state();
+}
+
+void* wavefront_worker_main(void* arg) {
+    wavefront_pass* pass = arg;
+    unsigned int begin;
+    while ((begin = atomic_fetch_add(&pass->next, WAVEFRONT_CHUNK)) < pass->length) {
+        const unsigned int end = HMM_MIN(begin + WAVEFRONT_CHUNK, pass->length);
+        for (unsigned int i = begin; i < end; ++i) {
+            trace_wavefront_ray(pass->world, pass->rays + i, pass->sums);
+        }
+    }
+    return NULL;
+}
+
+typedef struct wavefront_pool {
+    // Workers live for the whole render. Every pass the start barrier releases them into it,
+    // or out of their loop once stop is set, and the done barrier waits for all of them.
+    pthread_t* handles;
+    unsigned int workers;   // besides the thread calling trace_wavefront()
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    wavefront_pass pass;
+    bool stop;
+} wavefront_pool;
+
+void* wavefront_pool_main(void* arg) {
+    wavefront_pool* pool = arg;
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->stop) return NULL;
+        wavefront_worker_main(&pool->pass);
+        pthread_barrier_wait(&pool->done);
+    }
+}
+
+void start_wavefront_pool(wavefront_pool* pool, unsigned int threads) {
+    *pool = (wavefront_pool) { .workers = HMM_MAX(threads, 1u) - 1 };
+    if (pool->workers == 0) return;
+
+    pthread_barrier_init(&pool->start, NULL, pool->workers + 1);
+    pthread_barrier_init(&pool->done, NULL, pool->workers + 1);
+    pool->handles = malloc(sizeof(pthread_t) * pool->workers);
+    for (unsigned int i = 0; i < pool->workers; ++i) {
+        pthread_create(pool->handles + i, NULL, wavefront_pool_main, pool);
+    }
+}
+
+void finish_wavefront_pool(wavefront_pool* pool) {
+    if (pool->workers == 0) return;
+
+    pool->stop = true;
+    pthread_barrier_wait(&pool->start);
+    for (unsigned int i = 0; i < pool->workers; ++i) {
+        pthread_join(pool->handles[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->done);
+    pthread_barrier_destroy(&pool->start);
+    free(pool->handles);
+}
+
+void trace_wavefront(wavefront_pool* pool, const scene* world, wavefront_ray* rays, unsigned int length,
+    accum_pixel* sums) {
+    // Every pixel appears at most once in a wave, so the workers never add to the same sum.
+    pool->pass.world = world;
+    pool->pass.rays = rays;
+    pool->pass.length = length;
+    pool->pass.sums = sums;
+    atomic_init(&pool->pass.next, 0);
+
+    // A single chunk isn't worth waking the workers for, late bounces often get down to one.
+    const bool shared = pool->workers > 0 && length > WAVEFRONT_CHUNK;
+    if (shared) {
+        pthread_barrier_wait(&pool->start);
+    }
+    wavefront_worker_main(&pool->pass);
+    if (shared) {
+        pthread_barrier_wait(&pool->done);
+    }
+}
+
+uint32_t quantize_cell(float value, float low, float size, unsigned int bits) {
+    const int cells = 1 << bits;
+    const int cell = (int) ((value - low) / size * (float) cells);
+    return (uint32_t) HMM_Clamp(0, cell, cells - 1);
+}
+
+uint32_t wavefront_ray_key(const wavefront_ray* w, ray_order order, const aabb* origins) {
+    // Octant order only groups the direction signs. Morton order puts the direction's cell on a
+    // coarse grid over the unit cube in the high bits, the origin's cell in the scene below.
+    const hmm_v3 d = w->r.direction;
+    if (order == RAY_ORDER_OCTANT) {
+        return (uint32_t) (d.X < 0.f) | (uint32_t) (d.Y < 0.f) << 1 | (uint32_t) (d.Z < 0.f) << 2;
+    }
+
+    const hmm_v3 unit = HMM_NormalizeVec3(d);
+    uint32_t direction[3], origin[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        const float low = origins->min.Elements[axis];
+        const float size = fmaxf(origins->max.Elements[axis] - low, 1e-6f);
+        direction[axis] = quantize_cell(unit.Elements[axis], -1.f, 2.f, WAVEFRONT_DIRECTION_BITS);
+        origin[axis] = quantize_cell(w->r.origin.Elements[axis], low, size, WAVEFRONT_ORIGIN_BITS);
+    }
+    return morton_encode_3d(direction[0], direction[1], direction[2]) << (3 * WAVEFRONT_ORIGIN_BITS) |
+        morton_encode_3d(origin[0], origin[1], origin[2]);
+}
+
+void radix_sort_curve_entries(curve_entry* entries, curve_entry* scratch, unsigned int length, unsigned int key_bits) {
+    // Stable LSD radix sort, 8 bits a pass, the result ends up in entries.
+    curve_entry* from = entries;
+    curve_entry* to = scratch;
+    for (unsigned int shift = 0; shift < key_bits; shift += 8) {
+        unsigned int offsets[257] = { 0 };
+        for (unsigned int i = 0; i < length; ++i) {
+            ++offsets[((from[i].key >> shift) & 0xff) + 1];
+        }
+        for (int digit = 0; digit < 256; ++digit) {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (unsigned int i = 0; i < length; ++i) {
+            to[offsets[(from[i].key >> shift) & 0xff]++] = from[i];
+        }
+
+        curve_entry* swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != entries) {
+        memcpy(entries, from, sizeof(curve_entry) * length);
+    }
+}
+
+unsigned int reorder_wavefront(wavefront_ray* rays, wavefront_ray* next, unsigned int length, ray_order order,
+    curve_entry* entries, curve_entry* scratch) {
+    // Drops finished paths and sorts the rest into next, returns how many are left.
+    if (order == RAY_ORDER_NONE) {
+        unsigned int alive = 0;
+        for (unsigned int i = 0; i < length; ++i) {
+            if (rays[i].pixel != WAVEFRONT_DEAD) next[alive++] = rays[i];
+        }
+        return alive;
+    }
+
+    unsigned int alive = 0;
+    aabb origins = empty_aabb();
+    for (unsigned int i = 0; i < length; ++i) {
+        if (rays[i].pixel == WAVEFRONT_DEAD) continue;
+        origins = aabb_extend(origins, rays[i].r.origin);
+        entries[alive++].value = i;
+    }
+
+    for (unsigned int i = 0; i < alive; ++i) {
+        entries[i].key = wavefront_ray_key(rays + entries[i].value, order, &origins);
+    }
+    const unsigned int key_bits = order == RAY_ORDER_OCTANT ? 3 :
+        3 * (WAVEFRONT_DIRECTION_BITS + WAVEFRONT_ORIGIN_BITS);
+    radix_sort_curve_entries(entries, scratch, alive, key_bits);
+
+    for (unsigned int i = 0; i < alive; ++i) {
+        next[i] = rays[entries[i].value];
+    }
+    return alive;
+}
+
+unsigned int start_wavefront(const wavefront_config* config, wavefront_ray* rays, uint32_t first_pixel, int sample,
+    accum_buffer* accum) {
+    // Camera rays of up to WAVEFRONT_SIZE pixels from first_pixel on, like render_tile() makes them.
+    const uint32_t pixel_count = (uint32_t) config->image_width * (uint32_t) config->image_height;
+    const unsigned int length = HMM_MIN(pixel_count - first_pixel, WAVEFRONT_SIZE);
+    for (unsigned int k = 0; k < length; ++k) {
+        const uint32_t pixel = first_pixel + k;
+        const int i = (int) (pixel % (uint32_t) config->image_width);
+        const int j = config->image_height - 1 - (int) (pixel / (uint32_t) config->image_width);
+
+        random_seed_sample(pixel, (uint32_t) sample);
+        const float u = ((float) i + random_float()) / ((float) config->image_width - 1.f);
+        const float v = ((float) j + random_float()) / ((float) config->image_height - 1.f);
+        rays[k] = (wavefront_ray) {
+            .r = get_ray(config->cam, u, v),
+            .throughput = HMM_Vec3(1.f, 1.f, 1.f),
+            .pixel = pixel
+        };
+        rays[k].random_state = random_get_state();
+        ++accum->pixels[pixel].samples;
+    }
+    return length;
+}
+
+void render_wavefronts(const wavefront_config* config, accum_buffer* accum, perf_counters* counters,
+    wavefront_depth_stats* stats) {
+    // stats has an entry per bounce, max_depth of them. The counters are read around every
+    // tracing pass.
+    wavefront_ray* rays = malloc(sizeof(wavefront_ray) * WAVEFRONT_SIZE);
+    wavefront_ray* next = malloc(sizeof(wavefront_ray) * WAVEFRONT_SIZE);
+    curve_entry* entries = malloc(sizeof(curve_entry) * WAVEFRONT_SIZE);
+    curve_entry* scratch = malloc(sizeof(curve_entry) * WAVEFRONT_SIZE);
+    const uint32_t pixel_count = (uint32_t) config->image_width * (uint32_t) config->image_height;
+    // The workers are started after the counters were opened, so those count them too.
+    wavefront_pool pool;
+    start_wavefront_pool(&pool, config->threads);
+
+    for (int sample = config->sample_begin; sample < config->sample_end; ++sample) {
+        for (uint32_t first_pixel = 0; first_pixel < pixel_count; first_pixel += WAVEFRONT_SIZE) {
+            double start = now_seconds();
+            unsigned int length = start_wavefront(config, rays, first_pixel, sample, accum);
+            stats[0].reorder_seconds += now_seconds() - start;
+
+            for (int depth = 0; depth < config->max_depth && length > 0; ++depth) {
+                wavefront_depth_stats* depth_stats = stats + depth;
+                depth_stats->rays += length;
+
+                perf_start(counters);
+                start = now_seconds();
+                trace_wavefront(&pool, config->world, rays, length, accum->pixels);
+                depth_stats->trace_seconds += now_seconds() - start;
+                perf_stop(counters);
+                for (int c = 0; c < PERF_COUNTER_COUNT; ++c) {
+                    depth_stats->counters[c] += counters->values[c];
+                }
+
+                // Paths still going after the last bounce gather nothing.
+                if (depth + 1 == config->max_depth) break;
+                start = now_seconds();
+                length = reorder_wavefront(rays, next, length, config->order, entries, scratch);
+                stats[depth + 1].reorder_seconds += now_seconds() - start;
+
+                wavefront_ray* swap = rays;
+                rays = next;
+                next = swap;
+            }
+        }
+    }
+
+    finish_wavefront_pool(&pool);
+    free(scratch);
+    free(entries);
+    free(next);
+    free(rays);
+}
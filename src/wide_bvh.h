@@ -0,0 +1,208 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "math.h"
+#include "ray.h"
+#include "sphere.h"
+#include "bvh.h"
+
+// Wide BVH collapsed from the binary one. Every node holds the bounds of up to
+// WIDE_BVH_WIDTH children as one vector per plane, so a ray is tested against all of them in
+// a single slab test. Collapsing repeatedly opens the child with the largest surface area
+// until the node is full, the binary leaves and their primitive order are kept as they are.
+
+#ifdef __AVX__
+#define WIDE_BVH_WIDTH 8
+#else
+#define WIDE_BVH_WIDTH 4
+#endif
+
+#define WIDE_BVH_STACK_SIZE (BVH_STACK_SIZE * WIDE_BVH_WIDTH)
+
+typedef float node_lanes __attribute__((vector_size(sizeof(float) * WIDE_BVH_WIDTH)));
+typedef int node_mask __attribute__((vector_size(sizeof(int) * WIDE_BVH_WIDTH)));
+
+typedef struct wide_bvh_node {
+    // bounds[0] holds the minimum, bounds[1] the maximum x, y and z of every child. Empty
+    // lanes have inverted bounds that no ray can enter.
+    node_lanes bounds[2][3];
+    // Leaves cover count primitives from indices[child], inner children have count 0 and
+    // child is their node index.
+    unsigned int child[WIDE_BVH_WIDTH];
+    unsigned int count[WIDE_BVH_WIDTH];
+} wide_bvh_node;
+
+typedef struct wide_bvh {
+    wide_bvh_node* nodes;
+    unsigned int node_count;
+    unsigned int* indices;
+    unsigned int length;
+} wide_bvh;
+
+typedef struct wide_bvh_entry {
+    unsigned int child;
+    unsigned int count;
+    float entry;
+} wide_bvh_entry;
+
+unsigned int collapse_bvh_node(wide_bvh* wide, const bvh* tree, unsigned int binary_index) {
+    const unsigned int index = wide->node_count++;
+    unsigned int children[WIDE_BVH_WIDTH] = { binary_index };
+    int length = 1;
+
+    // Open the largest inner child until the node is full or only leaves are left.
+    while (length < WIDE_BVH_WIDTH) {
+        int largest = -1;
+        float largest_area = -1.f;
+        for (int i = 0; i < length; ++i) {
+            const bvh_node* node = tree->nodes + children[i];
+            if (node->count == 0 && aabb_area(node->bounds) > largest_area) {
+                largest = i;
+                largest_area = aabb_area(node->bounds);
+            }
+        }
+        if (largest < 0) break;
+
+        const unsigned int first = tree->nodes[children[largest]].first;
+        children[largest] = first;
+        children[length++] = first + 1;
+    }
+
+    wide_bvh_node* node = wide->nodes + index;
+    for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+        const aabb bounds = lane < length ? tree->nodes[children[lane]].bounds : empty_aabb();
+        for (int axis = 0; axis < 3; ++axis) {
+            node->bounds[0][axis][lane] = bounds.min.Elements[axis];
+            node->bounds[1][axis][lane] = bounds.max.Elements[axis];
+        }
+        node->child[lane] = 0;
+        node->count[lane] = 0;
+    }
+
+    for (int lane = 0; lane < length; ++lane) {
+        const bvh_node* child = tree->nodes + children[lane];
+        if (child->count) {
+            node->child[lane] = child->first;
+            node->count[lane] = child->count;
+        }
+        else {
+            node->child[lane] = collapse_bvh_node(wide, tree, children[lane]);
+        }
+    }
+
+    return index;
+}
+
+wide_bvh collapse_bvh(const bvh* tree) {
+    wide_bvh wide = { .length = tree->length };
+    if (tree->node_count == 0) return wide;
+
+    // Every wide node opens at least one binary inner node, the root included.
+    wide.nodes = aligned_alloc(sizeof(node_lanes), sizeof(wide_bvh_node) * tree->node_count);
+    wide.indices = malloc(sizeof(unsigned int) * tree->length);
+    memcpy(wide.indices, tree->indices, sizeof(unsigned int) * tree->length);
+    collapse_bvh_node(&wide, tree, 0);
+    return wide;
+}
+
+wide_bvh copy_wide_bvh(const wide_bvh* tree) {
+    wide_bvh copy = *tree;
+    if (!tree->nodes) return copy;
+
+    copy.nodes = aligned_alloc(sizeof(node_lanes), sizeof(wide_bvh_node) * tree->node_count);
+    copy.indices = malloc(sizeof(unsigned int) * tree->length);
+    memcpy(copy.nodes, tree->nodes, sizeof(wide_bvh_node) * tree->node_count);
+    memcpy(copy.indices, tree->indices, sizeof(unsigned int) * tree->length);
+    return copy;
+}
+
+void destroy_wide_bvh(wide_bvh* tree) {
+    free(tree->indices);
+    free(tree->nodes);
+    *tree = (wide_bvh) { 0 };
+}
+
+size_t wide_bvh_bytes(const wide_bvh* tree) {
+    return sizeof(wide_bvh_node) * tree->node_count + sizeof(unsigned int) * tree->length;
+}
+
+node_lanes lanes_max(node_lanes a, node_lanes b) {
+    // b where a is NaN, like the scalar slab test.
+    const node_mask greater = a > b;
+    return (node_lanes)((greater & (node_mask) a) | (~greater & (node_mask) b));
+}
+
+node_lanes lanes_min(node_lanes a, node_lanes b) {
+    const node_mask less = a < b;
+    return (node_lanes)((less & (node_mask) a) | (~less & (node_mask) b));
+}
+
+bool wide_bvh_traverse(const wide_bvh* tree, const void* primitives, bvh_intersect_fn intersect, const ray* r,
+    float t_min, bool any_hit, ray_hit* hit) {
+    if (tree->node_count == 0) return false;
+
+    const hmm_v3 inverse_direction = HMM_Vec3(1.f / r->direction.X, 1.f / r->direction.Y, 1.f / r->direction.Z);
+    node_lanes origin[3], inverse[3];
+    int near_plane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        origin[axis] = r->origin.Elements[axis] + (node_lanes) { 0 };
+        inverse[axis] = inverse_direction.Elements[axis] + (node_lanes) { 0 };
+        near_plane[axis] = inverse_direction.Elements[axis] < 0.f;
+    }
+
+    wide_bvh_entry stack[WIDE_BVH_STACK_SIZE];
+    unsigned int stack_length = 0;
+    bool hit_anything = false;
+    float closest_so_far = hit->t;
+    stack[stack_length++] = (wide_bvh_entry) { .child = 0, .count = 0, .entry = t_min };
+
+    while (stack_length > 0) {
+        const wide_bvh_entry top = stack[--stack_length];
+        if (top.entry > closest_so_far) continue;
+
+        if (top.count) {
+            for (unsigned int i = 0; i < top.count; ++i) {
+                if (intersect(primitives, tree->indices[top.child + i], r, t_min, hit)) {
+                    if (any_hit) return true;
+                    hit_anything = true;
+                    closest_so_far = hit->t;
+                }
+            }
+            continue;
+        }
+
+        // Slab test of every child at once, the planes are picked by the direction's signs.
+        const wide_bvh_node* node = tree->nodes + top.child;
+        node_lanes entry = t_min + (node_lanes) { 0 };
+        node_lanes exit = closest_so_far + (node_lanes) { 0 };
+        for (int axis = 0; axis < 3; ++axis) {
+            const node_lanes t0 = (node->bounds[near_plane[axis]][axis] - origin[axis]) * inverse[axis];
+            const node_lanes t1 = (node->bounds[1 - near_plane[axis]][axis] - origin[axis]) * inverse[axis];
+            entry = lanes_max(t0, entry);
+            exit = lanes_min(t1, exit);
+        }
+        const node_mask lanes_hit = entry <= exit;
+
+        // Push the children that were hit farthest first, so the nearest is visited next.
+        wide_bvh_entry hits[WIDE_BVH_WIDTH];
+        int hit_count = 0;
+        for (int lane = 0; lane < WIDE_BVH_WIDTH; ++lane) {
+            if (!lanes_hit[lane]) continue;
+            int i = hit_count++;
+            while (i > 0 && hits[i - 1].entry < entry[lane]) {
+                hits[i] = hits[i - 1];
+                --i;
+            }
+            hits[i] = (wide_bvh_entry) { .child = node->child[lane], .count = node->count[lane], .entry = entry[lane] };
+        }
+        memcpy(stack + stack_length, hits, sizeof(wide_bvh_entry) * hit_count);
+        stack_length += hit_count;
+    }
+
+    return hit_anything;
+}
+
+bool wide_bvh_hit(const wide_bvh* tree, const sphere* spheres, const ray* r, float t_min, bool any_hit, ray_hit* hit) {
+    return wide_bvh_traverse(tree, spheres, intersect_sphere_at, r, t_min, any_hit, hit);
+}
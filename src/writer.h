@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "framebuffer.h"
+#include "tile.h"
+#include "tonemap.h"
+#include "perf.h"
+
+// Writer stage that encodes and writes finished rows of tiles while rendering continues.
+// Render workers push finished tiles through a bounded queue, the writer thread counts
+// them per tile row and flushes rows to the stream in order as soon as they're complete.
+
+#define WRITER_QUEUE_CAPACITY 64
+
+typedef struct output_writer {
+    FILE* stream;
+    const framebuffer* fb;
+    tonemap_context tonemap;
+    int tile_size;
+    unsigned int tiles_x, tiles_y;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    const tile* queue[WRITER_QUEUE_CAPACITY];
+    unsigned int head, count;
+
+    unsigned int* row_tiles;        // finished tiles per tile row
+    unsigned int next_row;          // next tile row to write
+
+    double busy_seconds;            // encoding and writing
+    double blocked_seconds;         // waiting for finished tiles
+    double producer_blocked_seconds;// render workers waiting on a full queue
+} output_writer;
+
+void writer_flush_rows(output_writer* writer) {
+    const int y0 = writer->next_row * writer->tile_size;
+    unsigned int row = writer->next_row;
+
+    while (row < writer->tiles_y && writer->row_tiles[row] == writer->tiles_x) ++row;
+    if (row == writer->next_row) return;
+
+    const int y1 = HMM_MIN((int) row * writer->tile_size, writer->fb->height);
+    writer->next_row = row;
+
+    // Encoding happens outside the lock, workers keep queueing tiles meanwhile.
+    pthread_mutex_unlock(&writer->mutex);
+    const double start = now_seconds();
+    write_framebuffer_rows(writer->stream, writer->fb, y0, y1, &writer->tonemap);
+    fflush(writer->stream);
+    const double busy = now_seconds() - start;
+    pthread_mutex_lock(&writer->mutex);
+
+    writer->busy_seconds += busy;
+}
+
+void* writer_main(void* arg) {
+    output_writer* writer = arg;
+    pthread_mutex_lock(&writer->mutex);
+
+    while (writer->next_row < writer->tiles_y) {
+        const double wait_start = now_seconds();
+        while (writer->count == 0) {
+            pthread_cond_wait(&writer->not_empty, &writer->mutex);
+        }
+        writer->blocked_seconds += now_seconds() - wait_start;
+
+        // Drain everything queued, then write whatever rows became complete.
+        while (writer->count > 0) {
+            const tile* t = writer->queue[writer->head];
+            writer->head = (writer->head + 1) % WRITER_QUEUE_CAPACITY;
+            --writer->count;
+            ++writer->row_tiles[t->y0 / writer->tile_size];
+        }
+        pthread_cond_broadcast(&writer->not_full);
+
+        writer_flush_rows(writer);
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+void start_output_writer(output_writer* writer, FILE* stream, const framebuffer* fb, const tile_set* tiles,
+    const tonemap_options* tonemap) {
+    *writer = (output_writer) {
+        .stream = stream,
+        .fb = fb,
+        .tonemap = create_tonemap_context(tonemap, fb->width),
+        .tile_size = tiles->tile_size,
+        .tiles_x = tiles->tiles_x,
+        .tiles_y = tiles->tiles_y,
+        .row_tiles = calloc(tiles->tiles_y, sizeof(unsigned int))
+    };
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->not_empty, NULL);
+    pthread_cond_init(&writer->not_full, NULL);
+    write_ppm_header(stream, fb->width, fb->height);
+    pthread_create(&writer->thread, NULL, writer_main, writer);
+}
+
+void writer_submit(output_writer* writer, const tile* t) {
+    // Called by render workers once a tile's pixels are final.
+    pthread_mutex_lock(&writer->mutex);
+
+    if (writer->count == WRITER_QUEUE_CAPACITY) {
+        const double wait_start = now_seconds();
+        while (writer->count == WRITER_QUEUE_CAPACITY) {
+            pthread_cond_wait(&writer->not_full, &writer->mutex);
+        }
+        writer->producer_blocked_seconds += now_seconds() - wait_start;
+    }
+
+    writer->queue[(writer->head + writer->count) % WRITER_QUEUE_CAPACITY] = t;
+    ++writer->count;
+    pthread_cond_signal(&writer->not_empty);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+void finish_output_writer(output_writer* writer, bool report) {
+    pthread_join(writer->thread, NULL);
+
+    if (report) {
+        fprintf(stderr, "\nWriter busy %.3fs, waiting for tiles %.3fs, render workers blocked %.3fs\n",
+            writer->busy_seconds, writer->blocked_seconds, writer->producer_blocked_seconds);
+    }
+
+    pthread_cond_destroy(&writer->not_full);
+    pthread_cond_destroy(&writer->not_empty);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->row_tiles);
+    destroy_tonemap_context(&writer->tonemap);
+}